@@ -14,11 +14,29 @@
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Target/TargetOptions.h"
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <array>
+#include <sstream>
+#include <tuple>
+#include <algorithm>
 
 Recompiler::Recompiler()
 : m_IRBuilder( m_LLVMContext )
 , m_RecompilationModule( "recompilation", m_LLVMContext )
 , m_RomResetAddr( 0 )
+, m_LoopBackEdgeBlock( nullptr )
+, m_OutlineTemplates( false )
+, m_OutlineCurrentInstruction( false )
+, m_CurrentOpcode( 0 )
 , m_StartFunction( nullptr )
 , m_registerA( nullptr )
 , m_registerDB( nullptr )
@@ -42,7 +60,10 @@ Recompiler::Recompiler()
 , m_UpdateInstructionOutput( nullptr )
 , m_Load8Function( nullptr )
 , m_Store8Function( nullptr )
-, m_DoPPUFrameFunction( nullptr )
+, m_BlockFillFunction( nullptr )
+, m_BlockCopyFunction( nullptr )
+, m_WaitForInterruptFunction( nullptr )
+, m_WaitForSpcPortFunction( nullptr )
 , m_ADC8Function( nullptr )
 , m_ADC16Function( nullptr )
 , m_SBC8Function( nullptr )
@@ -98,26 +119,6 @@ void Recompiler::SetupNmiCall()
 	Push( GetProcessorStatusRegisterValueFromFlags() );
 
 	m_IRBuilder.CreateBr( &oldEntryBlock );
-
-	const auto& functionInfo = m_LabelsToFunctions.find( WAIT_FOR_VBLANK_LOOP_LABEL_OFFSET );
-	if ( functionInfo != m_LabelsToFunctions.end() )
-	{
-		for ( const auto& functionEntry : functionInfo->second )
-		{
-			const auto basicBlockName = functionEntry.first + "_" + WAIT_FOR_VBLANK_LABEL_NAME;
-			auto search = m_LabelNamesToBasicBlocks.find( basicBlockName );
-			assert( search != m_LabelNamesToBasicBlocks.end() );
-
-			auto basicBlock = search->second;
-			auto firstInstruction = basicBlock->getFirstNonPHI();
-			if ( firstInstruction )
-			{
-				auto callPPUFrameFunctionInst = m_IRBuilder.CreateCall( m_DoPPUFrameFunction );
-				callPPUFrameFunctionInst->moveBefore( firstInstruction );
-				m_IRBuilder.CreateCall( nmiFunction )->moveAfter( callPPUFrameFunctionInst );
-			}
-		}
-	}
 }
 
 void Recompiler::CreateMainLoopFunction()
@@ -415,6 +416,184 @@ void Recompiler::InitialiseBasicBlocksFromLabelNames()
 	}
 }
 
+// Recognise the counted clear/fill and copy loops the game uses to initialise buffers:
+//   STZ abs,X | STA abs,X : DEX [: DEX] : BPL loop
+//   STA abs,Y : DEY [: DEY] : BPL loop
+//   LDA abs,X : STA abs,X : DEX [: DEX] : BPL loop (and the Y indexed equivalent)
+// These are lowered to a single runtime call at the loop head, see InsertLoopIdiomFastPath.
+void Recompiler::IdentifyLoopIdioms()
+{
+	const auto numProgramNodes = m_Program.size();
+	for ( size_t nodeIndex = 0; nodeIndex < numProgramNodes; nodeIndex++ )
+	{
+		if ( !std::holds_alternative<Label>( m_Program[ nodeIndex ] ) )
+		{
+			continue;
+		}
+
+		const auto& label = std::get<Label>( m_Program[ nodeIndex ] );
+		std::vector<const Instruction*> loopBody;
+		auto codeGenIndex = nodeIndex + 1;
+		while ( codeGenIndex < numProgramNodes && std::holds_alternative<Instruction>( m_Program[ codeGenIndex ] ) )
+		{
+			loopBody.push_back( &std::get<Instruction>( m_Program[ codeGenIndex ] ) );
+			codeGenIndex++;
+		}
+
+		// The loop has to fall through to a label so the fast path knows where to continue:
+		if ( codeGenIndex >= numProgramNodes || loopBody.size() < 3 || loopBody.size() > 5 )
+		{
+			continue;
+		}
+
+		const auto& branch = *loopBody.back();
+		if ( branch.GetOpcode() != 0x10 || branch.GetJumpLabelName() != label.GetName() )
+		{
+			continue;
+		}
+
+		const auto& first = *loopBody.front();
+		LoopIdiom loopIdiom;
+		loopIdiom.memoryMode = first.GetMemoryMode();
+		loopIdiom.indexMode = first.GetIndexMode();
+		loopIdiom.instructionsPerIteration = static_cast<uint32_t>( loopBody.size() );
+		loopIdiom.exitLabelName = std::get<Label>( m_Program[ codeGenIndex ] ).GetName();
+
+		size_t bodyIndex = 0;
+		switch ( first.GetOpcode() )
+		{
+		case 0x9e:
+		case 0x9d:
+		case 0x99:
+			loopIdiom.type = LoopIdiomType::LOOP_IDIOM_FILL;
+			loopIdiom.storeZero = first.GetOpcode() == 0x9e;
+			loopIdiom.indexRegisterY = first.GetOpcode() == 0x99;
+			loopIdiom.destinationOperand = first.GetOperand();
+			bodyIndex = 1;
+			break;
+		case 0xbd:
+		case 0xb9:
+			{
+			loopIdiom.type = LoopIdiomType::LOOP_IDIOM_COPY;
+			loopIdiom.indexRegisterY = first.GetOpcode() == 0xb9;
+			loopIdiom.sourceOperand = first.GetOperand();
+			const auto& store = *loopBody[ 1 ];
+			if ( store.GetOpcode() != ( loopIdiom.indexRegisterY ? 0x99 : 0x9d ) )
+			{
+				continue;
+			}
+			loopIdiom.destinationOperand = store.GetOperand();
+			bodyIndex = 2;
+			}
+			break;
+		default:
+			continue;
+		}
+
+		const uint8_t decrementOpcode = loopIdiom.indexRegisterY ? 0x88 : 0xca;
+		loopIdiom.step = static_cast<uint32_t>( loopBody.size() - 1 - bodyIndex );
+		bool matches = loopIdiom.step == 1 || ( loopIdiom.step == 2 && loopIdiom.memoryMode == SIXTEEN_BIT );
+		for ( const auto instruction : loopBody )
+		{
+			matches &= instruction->GetMemoryMode() == loopIdiom.memoryMode && instruction->GetIndexMode() == loopIdiom.indexMode;
+		}
+		for ( ; matches && bodyIndex < loopBody.size() - 1; bodyIndex++ )
+		{
+			matches = loopBody[ bodyIndex ]->GetOpcode() == decrementOpcode;
+		}
+
+		if ( matches )
+		{
+			m_LoopIdioms.emplace( label.GetOffset(), loopIdiom );
+		}
+	}
+
+	std::cout << "Identified " << m_LoopIdioms.size() << " fill/copy loop idioms" << std::endl;
+}
+
+// Find loops that only poll memory or MMIO and branch, e.g. the game's vblank wait on the flag set by the nmi handler
+// or waiting for the spc to answer on a port. Nothing they read can change until the next event so their back edge
+// yields to the runtime which fast forwards to it instead of spinning through read8. Loops reading a register that
+// changes state when read aren't idle, skipping their iterations would skip those changes too.
+void Recompiler::IdentifyIdleLoops()
+{
+	const auto hasReadSideEffects = []( const uint32_t bank, const uint32_t offset )
+	{
+		if ( ( bank & 0x7f ) >= 0x40 )
+		{
+			return false;
+		}
+		return ( offset >= 0x2137 && offset <= 0x213f ) // counter latch, OAM/VRAM/CGRAM data, H/V counters, STAT77/78
+			|| offset == 0x2180 // WRAM port
+			|| offset == 0x4016 || offset == 0x4017 // serial joypads
+			|| offset == 0x4210 || offset == 0x4211 // RDNMI, TIMEUP
+			|| ( ( bank & 0x7f ) < 0x20 && offset >= 0x6000 && offset <= 0x6fff ); // DSP-1 data, reads pop its output
+	};
+
+	static const std::set<uint8_t> accumulatorLoadOpcodes = { 0xa9, 0xa5, 0xb5, 0xad, 0xbd, 0xb9, 0xa1, 0xb1, 0xb2, 0xa7, 0xb7, 0xaf, 0xbf, 0xa3, 0xb3 };
+	static const std::set<uint8_t> readOpcodes = {
+		0xa2, 0xa6, 0xb6, 0xae, 0xbe, // LDX
+		0xa0, 0xa4, 0xb4, 0xac, 0xbc, // LDY
+		0xc9, 0xc5, 0xd5, 0xcd, 0xdd, 0xd9, 0xc1, 0xd1, 0xd2, 0xc7, 0xd7, 0xcf, 0xdf, 0xc3, 0xd3, // CMP
+		0xe0, 0xe4, 0xec, // CPX
+		0xc0, 0xc4, 0xcc, // CPY
+		0x89, 0x24, 0x34, 0x2c, 0x3c, // BIT
+	};
+	// These modify A so are only allowed once A has been reloaded within the loop:
+	static const std::set<uint8_t> accumulatorOpcodes = {
+		0x29, 0x25, 0x35, 0x2d, 0x3d, 0x39, 0x21, 0x31, 0x32, 0x27, 0x37, 0x2f, 0x3f, 0x23, 0x33, // AND
+		0x09, 0x05, 0x15, 0x0d, 0x1d, 0x19, 0x01, 0x11, 0x12, 0x07, 0x17, 0x0f, 0x1f, 0x03, 0x13, // ORA
+		0x49, 0x45, 0x55, 0x4d, 0x5d, 0x59, 0x41, 0x51, 0x52, 0x47, 0x57, 0x4f, 0x5f, 0x43, 0x53, // EOR
+	};
+	// Only change flags, so running them again while waiting changes nothing: CLC, SEC, CLV, REP, SEP, NOP.
+	static const std::set<uint8_t> flagOpcodes = { 0x18, 0x38, 0xb8, 0xc2, 0xe2, 0xea };
+	static const std::set<uint8_t> immediateOpcodes = { 0xa9, 0xa2, 0xa0, 0xc9, 0xe0, 0xc0, 0x89, 0x29, 0x09, 0x49 };
+	static const std::set<uint8_t> branchOpcodes = { 0x10, 0x30, 0x50, 0x70, 0x90, 0xb0, 0xd0, 0xf0, 0x80, 0x82, 0x4c };
+
+	const auto numProgramNodes = m_Program.size();
+	for ( size_t nodeIndex = 0; nodeIndex < numProgramNodes; nodeIndex++ )
+	{
+		if ( !std::holds_alternative<Label>( m_Program[ nodeIndex ] ) )
+		{
+			continue;
+		}
+
+		const auto& label = std::get<Label>( m_Program[ nodeIndex ] );
+		bool idle = true;
+		bool accumulatorLoaded = false;
+		bool pollsSpcPort = false;
+		const Instruction* lastInstruction = nullptr;
+		for ( auto codeGenIndex = nodeIndex + 1; idle && codeGenIndex < numProgramNodes && std::holds_alternative<Instruction>( m_Program[ codeGenIndex ] ); codeGenIndex++ )
+		{
+			const auto& instruction = std::get<Instruction>( m_Program[ codeGenIndex ] );
+			const auto opcode = instruction.GetOpcode();
+			const bool branch = branchOpcodes.find( opcode ) != branchOpcodes.end();
+			const bool accumulatorLoad = accumulatorLoadOpcodes.find( opcode ) != accumulatorLoadOpcodes.end();
+			idle = branch || accumulatorLoad || readOpcodes.find( opcode ) != readOpcodes.end() || flagOpcodes.find( opcode ) != flagOpcodes.end() || ( accumulatorLoaded && accumulatorOpcodes.find( opcode ) != accumulatorOpcodes.end() );
+			accumulatorLoaded |= accumulatorLoad;
+
+			if ( !branch && immediateOpcodes.find( opcode ) == immediateOpcodes.end() && instruction.GetOperandSize() >= 2 )
+			{
+				// Long addresses outside banks $00-$3f and $80-$bf never reach MMIO, absolute ones depend on DB so might.
+				const auto bank = instruction.GetOperandSize() >= 3 ? instruction.GetOperand() >> 16 & 0xff : 0;
+				const auto offset = instruction.GetOperand() & 0xffff;
+				const bool mmio = ( bank & 0x7f ) < 0x40;
+				pollsSpcPort |= mmio && offset >= 0x2140 && offset <= 0x217f;
+				idle &= !hasReadSideEffects( bank, offset );
+			}
+			lastInstruction = &instruction;
+		}
+
+		// Only single block loops whose last instruction branches back to the top:
+		if ( idle && lastInstruction && branchOpcodes.find( lastInstruction->GetOpcode() ) != branchOpcodes.end() && lastInstruction->GetJumpLabelName() == label.GetName() )
+		{
+			m_IdleLoops.emplace( label.GetOffset(), pollsSpcPort );
+		}
+	}
+
+	std::cout << "Identified " << m_IdleLoops.size() << " idle loops" << std::endl;
+}
+
 void Recompiler::GenerateCode()
 {
 	const auto numProgramNodes = m_Program.size();
@@ -441,6 +620,17 @@ void Recompiler::GenerateCode()
 					m_CurrentBasicBlock = basicBlock;
 					m_IRBuilder.SetInsertPoint( basicBlock );
 
+					auto loopIdiomSearch = m_LoopIdioms.find( labelOffset );
+					auto idleLoopSearch = m_IdleLoops.find( labelOffset );
+					if ( loopIdiomSearch != m_LoopIdioms.end() )
+					{
+						InsertLoopIdiomFastPath( loopIdiomSearch->second, functionEntry.first, basicBlockName );
+					}
+					else if ( idleLoopSearch != m_IdleLoops.end() )
+					{
+						InsertIdleLoopBackEdge( idleLoopSearch->second, basicBlockName );
+					}
+
 					auto codeGenIndex = nodeIndex + 1;
 					auto hasAnyInstructions = false;
 					while ( codeGenIndex < numProgramNodes && std::holds_alternative<Instruction>( m_Program[ codeGenIndex ] ) )
@@ -481,15 +671,19 @@ void Recompiler::GenerateCode()
 							m_IRBuilder.CreateRetVoid();
 							m_CurrentBasicBlock = nullptr;
 						}
-					}		
+					}
+
+					m_LoopBackEdgeLabelName.clear();
+					m_LoopBackEdgeBlock = nullptr;
 				}
 			}
 		}
 	}
 }
 
-void Recompiler::Recompile( const std::string& targetType )
+bool Recompiler::Recompile( const std::string& targetType, const uint32_t partitionCount, const bool profileCalls, const bool outlineTemplates )
 {
+	m_OutlineTemplates = outlineTemplates;
 	llvm::InitializeNativeTarget();
 	
 	if ( targetType == "native" )
@@ -528,7 +722,11 @@ void Recompiler::Recompile( const std::string& targetType )
 	m_Load8Function = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getInt8Ty( m_LLVMContext ), llvm::Type::getInt32Ty( m_LLVMContext ), false ), llvm::Function::ExternalLinkage, "read8", m_RecompilationModule );
 	m_Store8Function = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getVoidTy( m_LLVMContext ), { llvm::Type::getInt32Ty( m_LLVMContext ), llvm::Type::getInt8Ty( m_LLVMContext ) }, false ), llvm::Function::ExternalLinkage, "write8", m_RecompilationModule );
 	
-	m_DoPPUFrameFunction = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getVoidTy( m_LLVMContext ), false ), llvm::Function::ExternalLinkage, "doPPUFrame", m_RecompilationModule );
+	m_BlockFillFunction = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getInt1Ty( m_LLVMContext ), { llvm::Type::getInt32Ty( m_LLVMContext ), llvm::Type::getInt32Ty( m_LLVMContext ), llvm::Type::getInt16Ty( m_LLVMContext ), llvm::Type::getInt32Ty( m_LLVMContext ), llvm::Type::getInt32Ty( m_LLVMContext ) }, false ), llvm::Function::ExternalLinkage, "blockFill", m_RecompilationModule );
+	m_BlockCopyFunction = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getInt1Ty( m_LLVMContext ), { llvm::Type::getInt32Ty( m_LLVMContext ), llvm::Type::getInt32Ty( m_LLVMContext ), llvm::Type::getInt32Ty( m_LLVMContext ), llvm::Type::getInt32Ty( m_LLVMContext ) }, false ), llvm::Function::ExternalLinkage, "blockCopy", m_RecompilationModule );
+
+	m_WaitForInterruptFunction = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getInt1Ty( m_LLVMContext ), false ), llvm::Function::ExternalLinkage, "waitForInterrupt", m_RecompilationModule );
+	m_WaitForSpcPortFunction = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getInt1Ty( m_LLVMContext ), false ), llvm::Function::ExternalLinkage, "waitForSpcPort", m_RecompilationModule );
 
 	m_ADC8Function = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getInt8Ty( m_LLVMContext ), llvm::Type::getInt8Ty( m_LLVMContext ), false ), llvm::Function::ExternalLinkage, "ADC8", m_RecompilationModule );
 	m_ADC16Function = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getInt16Ty( m_LLVMContext ), llvm::Type::getInt16Ty( m_LLVMContext ), false ), llvm::Function::ExternalLinkage, "ADC16", m_RecompilationModule );
@@ -548,7 +746,10 @@ void Recompiler::Recompile( const std::string& targetType )
 	AddInstructionStringGlobalVariables();
 	CreateFunctions();
 	InitialiseBasicBlocksFromLabelNames();
+	IdentifyLoopIdioms();
+	IdentifyIdleLoops();
 	GenerateCode();
+	ReportOutlinedTemplates();
 	EnforceFunctionEntryBlocksConstraints();
 	SetupNmiCall();
 	SetupIrqFunction();
@@ -560,6 +761,7 @@ void Recompiler::Recompile( const std::string& targetType )
 	auto resetFunction = m_Functions[ m_RomResetFuncName ];
 	m_IRBuilder.CreateCall( resetFunction );
 	m_IRBuilder.CreateRetVoid();
+	AddCallProfiling( profileCalls );
 	llvm::verifyModule( m_RecompilationModule, &llvm::errs() );
 
 	llvm::PassBuilder passBuilder;
@@ -580,6 +782,201 @@ void Recompiler::Recompile( const std::string& targetType )
 	std::error_code EC;
 	llvm::raw_fd_ostream outputHumanReadable( "smk.ll", EC );
 	m_RecompilationModule.print( outputHumanReadable, nullptr );
+
+	if ( targetType == "native" )
+	{
+		return EmitObjectFiles( partitionCount );
+	}
+	return true;
+}
+
+// Count calls to every function in profileCallCounts so a run can be turned into a link order by symbol_order.
+// The tables are always emitted so the runtime links either way, profileFunctionCount is 0 when profiling is off.
+void Recompiler::AddCallProfiling( const bool enabled )
+{
+	std::vector<llvm::Function*> profiledFunctions;
+	if ( enabled )
+	{
+		for ( auto& function : m_RecompilationModule.getFunctionList() )
+		{
+			if ( !function.isDeclaration() )
+			{
+				profiledFunctions.push_back( &function );
+			}
+		}
+	}
+
+	const auto profiledFunctionCount = static_cast<uint32_t>( profiledFunctions.size() );
+	auto callCountsType = llvm::ArrayType::get( llvm::Type::getInt64Ty( m_LLVMContext ), profiledFunctionCount );
+	auto callCounts = new llvm::GlobalVariable( m_RecompilationModule, callCountsType, false, llvm::GlobalValue::ExternalLinkage, llvm::ConstantAggregateZero::get( callCountsType ), "profileCallCounts" );
+
+	std::vector<llvm::Constant*> functionNames;
+	for ( uint32_t functionIndex = 0; functionIndex < profiledFunctionCount; functionIndex++ )
+	{
+		auto function = profiledFunctions[ functionIndex ];
+		auto& entryBlock = function->getEntryBlock();
+		auto insertPoint = entryBlock.getFirstInsertionPt();
+		while ( llvm::isa<llvm::AllocaInst>( *insertPoint ) )
+		{
+			++insertPoint;
+		}
+
+		m_IRBuilder.SetInsertPoint( &entryBlock, insertPoint );
+		auto callCount = m_IRBuilder.CreateConstInBoundsGEP2_32( callCountsType, callCounts, 0, functionIndex );
+		m_IRBuilder.CreateStore( m_IRBuilder.CreateAdd( m_IRBuilder.CreateLoad( callCount ), m_IRBuilder.getInt64( 1 ) ), callCount );
+
+		auto functionName = m_IRBuilder.CreateGlobalString( function->getName(), "" );
+		functionNames.push_back( llvm::ConstantExpr::getBitCast( functionName, llvm::Type::getInt8PtrTy( m_LLVMContext ) ) );
+	}
+
+	auto functionNamesType = llvm::ArrayType::get( llvm::Type::getInt8PtrTy( m_LLVMContext ), profiledFunctionCount );
+	new llvm::GlobalVariable( m_RecompilationModule, functionNamesType, true, llvm::GlobalValue::ExternalLinkage, llvm::ConstantArray::get( functionNamesType, functionNames ), "profileFunctionNames" );
+	new llvm::GlobalVariable( m_RecompilationModule, llvm::Type::getInt32Ty( m_LLVMContext ), true, llvm::GlobalValue::ExternalLinkage, m_IRBuilder.getInt32( profiledFunctionCount ), "profileFunctionCount" );
+
+	if ( enabled )
+	{
+		std::cout << "Added call profiling to " << profiledFunctionCount << " functions" << std::endl;
+	}
+}
+
+// Print how much the shared width diamond helpers saved before optimisation. The inline size is what every call
+// would have cost had the helper body been copied into it, which is what a build with --no-outline generates.
+void Recompiler::ReportOutlinedTemplates()
+{
+	if ( m_OutlinedTemplates.empty() )
+	{
+		return;
+	}
+
+	uint64_t instructionCount = 0;
+	for ( auto& function : m_RecompilationModule.getFunctionList() )
+	{
+		instructionCount += function.getInstructionCount();
+	}
+
+	uint64_t inlineInstructionCount = instructionCount;
+	uint64_t outlinedCallCount = 0;
+	for ( const auto& [ _, helper ] : m_OutlinedTemplates )
+	{
+		const uint64_t uses = helper->getNumUses();
+		const uint64_t bodyInstructionCount = helper->getInstructionCount() - 1;
+		inlineInstructionCount += uses * bodyInstructionCount;
+		inlineInstructionCount -= uses + helper->getInstructionCount();
+		outlinedCallCount += uses;
+	}
+
+	std::cout << "Outlined " << outlinedCallCount << " width diamonds into " << m_OutlinedTemplates.size() << " helpers, " << inlineInstructionCount << " -> " << instructionCount << " IR instructions" << std::endl;
+}
+
+// Split the optimised module into partitionCount parts and generate an object file smk_<n>.o for each of them on a pool
+// of at most one worker per core, each taking the next part until none are left. LLVMContexts can't be shared between
+// threads so each part is round tripped through bitcode into a fresh context. SplitModule externalizes anything
+// referenced across parts so the objects link back together. Returns false if any part failed, its object file is
+// removed so a stale one can't be linked in its place.
+bool Recompiler::EmitObjectFiles( const uint32_t partitionCount )
+{
+	llvm::InitializeNativeTargetAsmPrinter();
+
+	const auto targetTriple = llvm::sys::getDefaultTargetTriple();
+	std::string error;
+	auto target = llvm::TargetRegistry::lookupTarget( targetTriple, error );
+	if ( !target )
+	{
+		std::cout << "ERROR: " << error << std::endl;
+		return false;
+	}
+
+	const auto codeGenStart = std::chrono::steady_clock::now();
+	std::vector<std::string> objectFileNames;
+	std::vector<llvm::SmallString<0>> bitcodes;
+	llvm::SplitModule( llvm::CloneModule( m_RecompilationModule ), partitionCount, [&]( std::unique_ptr<llvm::Module> partition )
+	{
+		bitcodes.emplace_back();
+		llvm::raw_svector_ostream bitcodeStream( bitcodes.back() );
+		llvm::WriteBitcodeToFile( *partition, bitcodeStream );
+		objectFileNames.push_back( "smk_" + std::to_string( objectFileNames.size() ) + ".o" );
+	}, false );
+
+	const auto emitObjectFile = [ target, &targetTriple ]( const llvm::SmallString<0>& bitcode, const std::string& objectFileName ) -> bool
+	{
+		llvm::LLVMContext context;
+		auto module = llvm::parseBitcodeFile( llvm::MemoryBufferRef( llvm::StringRef( bitcode.data(), bitcode.size() ), objectFileName ), context );
+		if ( !module )
+		{
+			llvm::consumeError( module.takeError() );
+			std::cout << "ERROR: failed to read back partition for " << objectFileName << std::endl;
+			return false;
+		}
+
+		// One section per function so the linker can reorder them, see symbol_order:
+		llvm::TargetOptions targetOptions;
+		targetOptions.FunctionSections = true;
+		std::unique_ptr<llvm::TargetMachine> targetMachine( target->createTargetMachine( targetTriple, "generic", "", targetOptions, llvm::Reloc::PIC_ ) );
+		( *module )->setTargetTriple( targetTriple );
+		( *module )->setDataLayout( targetMachine->createDataLayout() );
+
+		std::error_code EC;
+		llvm::raw_fd_ostream objectFile( objectFileName, EC );
+		llvm::legacy::PassManager passManager;
+		if ( EC || targetMachine->addPassesToEmitFile( passManager, objectFile, nullptr, llvm::TargetMachine::CGFT_ObjectFile ) )
+		{
+			std::cout << "ERROR: can't emit " << objectFileName << std::endl;
+			return false;
+		}
+		passManager.run( **module );
+		objectFile.close();
+		if ( objectFile.has_error() )
+		{
+			objectFile.clear_error();
+			std::cout << "ERROR: failed to write " << objectFileName << std::endl;
+			return false;
+		}
+		return true;
+	};
+
+	// Each worker takes the next partition until there are none left.
+	std::atomic<size_t> nextPartition{ 0 };
+	std::atomic<bool> failed{ false };
+	const auto workerCount = std::min<size_t>( bitcodes.size(), std::max( std::thread::hardware_concurrency(), 1u ) );
+	std::vector<std::thread> codeGenThreads;
+	for ( size_t worker = 0; worker < workerCount; worker++ )
+	{
+		codeGenThreads.emplace_back( [ & ]()
+		{
+			for ( size_t partition = nextPartition++; partition < bitcodes.size(); partition = nextPartition++ )
+			{
+				if ( !emitObjectFile( bitcodes[ partition ], objectFileNames[ partition ] ) )
+				{
+					llvm::sys::fs::remove( objectFileNames[ partition ] );
+					failed = true;
+				}
+			}
+		} );
+	}
+
+	for ( auto& codeGenThread : codeGenThreads )
+	{
+		codeGenThread.join();
+	}
+
+	if ( failed )
+	{
+		return false;
+	}
+
+	uint64_t objectBytes = 0;
+	for ( const auto& objectFileName : objectFileNames )
+	{
+		uint64_t objectFileSize = 0;
+		if ( !llvm::sys::fs::file_size( objectFileName, objectFileSize ) )
+		{
+			objectBytes += objectFileSize;
+		}
+	}
+
+	const auto codeGenMilliseconds = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - codeGenStart ).count();
+	std::cout << "Generated " << objectFileNames.size() << " object files (" << objectBytes << " bytes) on " << workerCount << " threads in " << codeGenMilliseconds << "ms" << std::endl;
+	return true;
 }
 
 void Recompiler::AddLabelNameToBasicBlock( const std::string& labelName, llvm::BasicBlock* basicBlock )
@@ -1176,12 +1573,14 @@ void Recompiler::PerformStackPointerEmulationFlagForcedConfiguration()
 
 void Recompiler::PerformBranchInstruction( llvm::Value* cond, const std::string& labelName, const std::string& functionName )
 {
-	auto search = m_LabelNamesToBasicBlocks.find( functionName + "_" + labelName );
+	const auto basicBlockName = functionName + "_" + labelName;
+	auto search = m_LabelNamesToBasicBlocks.find( basicBlockName );
 	if ( search != m_LabelNamesToBasicBlocks.end() )
 	{
 		auto [takeBranchBlock, endBlock] = CreateCondTestThenBlock( cond );
 		SelectBlock( takeBranchBlock );
-		m_IRBuilder.CreateBr( search->second );
+		// Recognised loops redirect their back edge, see InsertLoopIdiomFastPath and InsertIdleLoopBackEdge:
+		m_IRBuilder.CreateBr( basicBlockName == m_LoopBackEdgeLabelName ? m_LoopBackEdgeBlock : search->second );
 		SelectBlock( endBlock );
 	}
 	else
@@ -1194,10 +1593,11 @@ void Recompiler::PerformBranchInstruction( llvm::Value* cond, const std::string&
 
 void Recompiler::PerformJumpInstruction( const std::string& labelName, const std::string& functionName )
 {
-	auto search = m_LabelNamesToBasicBlocks.find( functionName + "_" + labelName );
+	const auto basicBlockName = functionName + "_" + labelName;
+	auto search = m_LabelNamesToBasicBlocks.find( basicBlockName );
 	if ( search != m_LabelNamesToBasicBlocks.end() )
 	{
-		m_IRBuilder.CreateBr( search->second );
+		m_IRBuilder.CreateBr( basicBlockName == m_LoopBackEdgeLabelName ? m_LoopBackEdgeBlock : search->second );
 	}
 	else
 	{
@@ -1208,6 +1608,137 @@ void Recompiler::PerformJumpInstruction( const std::string& labelName, const std
 	m_CurrentBasicBlock = nullptr;
 }
 
+// Emits the fast path for a recognised fill/copy loop at the head of the loop. The loop is only lowered when the
+// static register widths match the runtime ones, the starting index is positive and the runtime confirms the
+// whole range is plain memory (DB is only known at runtime), otherwise the original loop body runs unchanged.
+void Recompiler::InsertLoopIdiomFastPath( const LoopIdiom& loopIdiom, const std::string& functionName, const std::string& basicBlockName )
+{
+	auto exitSearch = m_LabelNamesToBasicBlocks.find( functionName + "_" + loopIdiom.exitLabelName );
+	if ( exitSearch == m_LabelNamesToBasicBlocks.end() )
+	{
+		return;
+	}
+
+	const bool memory8 = loopIdiom.memoryMode == EIGHT_BIT;
+	const bool index8 = loopIdiom.indexMode == EIGHT_BIT;
+	auto indexRegister = loopIdiom.indexRegisterY ? m_registerY : m_registerX;
+
+	auto MF = m_IRBuilder.CreateLoad( m_AccumulatorFlag );
+	auto XF = m_IRBuilder.CreateLoad( m_IndexRegisterFlag );
+	auto modesMatch = m_IRBuilder.CreateAnd( m_IRBuilder.CreateICmpEQ( MF, GetConstant( memory8, 1, false ) ), m_IRBuilder.CreateICmpEQ( XF, GetConstant( index8, 1, false ) ) );
+	auto startIndex16 = m_IRBuilder.CreateAnd( m_IRBuilder.CreateLoad( indexRegister ), index8 ? 0xff : 0xffff );
+	auto startIndexPositive = m_IRBuilder.CreateICmpEQ( m_IRBuilder.CreateAnd( startIndex16, index8 ? 0x80 : 0x8000 ), GetConstant( 0, 16, false ) );
+
+	auto function = m_CurrentBasicBlock->getParent();
+	auto tryBlock = llvm::BasicBlock::Create( m_LLVMContext, "", function );
+	auto fastBlock = llvm::BasicBlock::Create( m_LLVMContext, "", function );
+	auto bodyBlock = llvm::BasicBlock::Create( m_LLVMContext, basicBlockName + "_loopBody", function );
+	tryBlock->moveAfter( m_CurrentBasicBlock );
+	fastBlock->moveAfter( tryBlock );
+	bodyBlock->moveAfter( fastBlock );
+	m_IRBuilder.CreateCondBr( m_IRBuilder.CreateAnd( modesMatch, startIndexPositive ), tryBlock, bodyBlock );
+
+	SelectBlock( tryBlock );
+	auto startIndex32 = m_IRBuilder.CreateZExt( startIndex16, llvm::Type::getInt32Ty( m_LLVMContext ) );
+	auto lastIndex32 = loopIdiom.step == 1 ? GetConstant( 0, 32, false ) : m_IRBuilder.CreateAnd( startIndex32, 1 );
+	auto iterations32 = m_IRBuilder.CreateAdd( loopIdiom.step == 1 ? startIndex32 : m_IRBuilder.CreateLShr( startIndex32, 1 ), GetConstant( 1, 32, false ) );
+	llvm::Value* size32 = iterations32;
+	if ( !memory8 )
+	{
+		// Single stepped 16 bit stores overlap by a byte, double stepped ones are contiguous words:
+		size32 = loopIdiom.step == 1 ? m_IRBuilder.CreateAdd( iterations32, GetConstant( 1, 32, false ) ) : m_IRBuilder.CreateShl( iterations32, 1 );
+	}
+	auto instructionCount32 = m_IRBuilder.CreateMul( iterations32, GetConstant( loopIdiom.instructionsPerIteration, 32, false ) );
+	auto destinationAddress = CreateBankAddress( m_IRBuilder.CreateAdd( GetConstant( loopIdiom.destinationOperand, 32, false ), lastIndex32 ) );
+
+	llvm::Value* A16 = nullptr;
+	llvm::Value* sourceAddress = nullptr;
+	llvm::Value* handled = nullptr;
+	if ( loopIdiom.type == LoopIdiomType::LOOP_IDIOM_FILL )
+	{
+		A16 = loopIdiom.storeZero ? GetConstant( 0, 16, false ) : m_IRBuilder.CreateLoad( m_registerA );
+		// Each overlapping 16 bit store leaves its high byte behind except for the last one, which is patched below:
+		auto fillValue16 = !memory8 && loopIdiom.step == 1 ? m_IRBuilder.CreateLShr( A16, 8 ) : A16;
+		const uint32_t fillWidth = !memory8 && loopIdiom.step == 2 ? 2 : 1;
+		std::vector<llvm::Value*> params = { destinationAddress, size32, fillValue16, GetConstant( fillWidth, 32, false ), instructionCount32 };
+		handled = m_IRBuilder.CreateCall( m_BlockFillFunction, params );
+	}
+	else
+	{
+		sourceAddress = CreateBankAddress( m_IRBuilder.CreateAdd( GetConstant( loopIdiom.sourceOperand, 32, false ), lastIndex32 ) );
+		std::vector<llvm::Value*> params = { destinationAddress, sourceAddress, size32, instructionCount32 };
+		handled = m_IRBuilder.CreateCall( m_BlockCopyFunction, params );
+	}
+	m_IRBuilder.CreateCondBr( handled, fastBlock, bodyBlock );
+
+	SelectBlock( fastBlock );
+	if ( loopIdiom.type == LoopIdiomType::LOOP_IDIOM_FILL )
+	{
+		if ( !loopIdiom.storeZero && !memory8 && loopIdiom.step == 1 )
+		{
+			Write8( destinationAddress, m_IRBuilder.CreateTrunc( A16, llvm::Type::getInt8Ty( m_LLVMContext ) ) );
+		}
+	}
+	else
+	{
+		// A holds the last value loaded by the loop:
+		auto low8 = Read8( sourceAddress );
+		if ( memory8 )
+		{
+			LDA8( low8 );
+		}
+		else
+		{
+			auto high8 = Read8( m_IRBuilder.CreateAnd( m_IRBuilder.CreateAdd( sourceAddress, GetConstant( 1, 32, false ) ), 0xffffff ) );
+			LDA16( CombineTo16( low8, high8 ) );
+		}
+	}
+
+	auto finalIndex16 = m_IRBuilder.CreateSub( m_IRBuilder.CreateTrunc( lastIndex32, llvm::Type::getInt16Ty( m_LLVMContext ) ), GetConstant( loopIdiom.step, 16, false ) );
+	if ( index8 )
+	{
+		auto [ indexLow8Ptr, indexHigh8Ptr ] = GetLowHighPtrFromPtr16( indexRegister );
+		m_IRBuilder.CreateStore( m_IRBuilder.CreateTrunc( finalIndex16, llvm::Type::getInt8Ty( m_LLVMContext ) ), indexLow8Ptr );
+	}
+	else
+	{
+		m_IRBuilder.CreateStore( finalIndex16, indexRegister );
+	}
+	PerformClearFlagInstruction( m_ZeroFlag );
+	PerformSetFlagInstruction( m_NegativeFlag );
+	m_IRBuilder.CreateBr( exitSearch->second );
+
+	SelectBlock( bodyBlock );
+	m_LoopBackEdgeLabelName = basicBlockName;
+	m_LoopBackEdgeBlock = bodyBlock;
+}
+
+// Give an idle loop a block to take its back edge through that waits for the next event before polling again.
+void Recompiler::InsertIdleLoopBackEdge( const bool pollsSpcPort, const std::string& basicBlockName )
+{
+	auto loopBlock = m_CurrentBasicBlock;
+	auto idleBlock = llvm::BasicBlock::Create( m_LLVMContext, basicBlockName + "_idle", loopBlock->getParent() );
+	idleBlock->moveAfter( loopBlock );
+	SelectBlock( idleBlock );
+	PerformWaitInstruction( pollsSpcPort ? m_WaitForSpcPortFunction : m_WaitForInterruptFunction );
+	m_IRBuilder.CreateBr( loopBlock );
+
+	SelectBlock( loopBlock );
+	m_LoopBackEdgeLabelName = basicBlockName;
+	m_LoopBackEdgeBlock = idleBlock;
+}
+
+// The runtime advances to the next event and returns whether it was an nmi, in which case the handler is run here.
+void Recompiler::PerformWaitInstruction( llvm::Function* waitFunction )
+{
+	auto serviceNmi = m_IRBuilder.CreateCall( waitFunction );
+	auto [ nmiBlock, endBlock ] = CreateCondTestThenBlock( serviceNmi );
+	SelectBlock( nmiBlock );
+	m_IRBuilder.CreateCall( m_Functions[ m_RomNmiFuncName ] );
+	m_IRBuilder.CreateBr( endBlock );
+	SelectBlock( endBlock );
+}
+
 void Recompiler::InsertJumpTable( llvm::Value* switchValue, const uint32_t instructionOffset, const std::string& functionName )
 {
 	auto findJumpTableEntries = m_JumpTables.find( instructionOffset );
@@ -1554,375 +2085,491 @@ llvm::Value* Recompiler::CombineTo32( llvm::Value* low8, llvm::Value* mid8, llvm
 	return m_IRBuilder.CreateOr( low32, m_IRBuilder.CreateOr( mid32Shifted, high32Shifted ) );
 }
 
+// Emit a width diamond through a shared fastcc helper so every instruction with the same opcode calls one copy of it
+// instead of inlining both the 8 and 16 bit bodies. body generates the diamond from the helper's arguments and must
+// not touch any llvm::Value of the caller other than the operands it is passed. Functions the call profile marks as
+// hot keep the diamond inline.
+template<typename Body, typename... Operands>
+void Recompiler::PerformOutlinedTemplate( const char* templateName, Body body, Operands... operands )
+{
+	if ( !m_OutlineCurrentInstruction )
+	{
+		body( operands... );
+		return;
+	}
+
+	std::array<llvm::Value*, sizeof...( Operands )> callOperands = { operands... };
+	std::stringstream helperName;
+	helperName << templateName << "_" << std::hex << std::uppercase << std::setw( 2 ) << std::setfill( '0' ) << static_cast<uint32_t>( m_CurrentOpcode );
+
+	auto search = m_OutlinedTemplates.find( helperName.str() );
+	llvm::Function* helper = search != m_OutlinedTemplates.end() ? search->second : nullptr;
+	if ( !helper )
+	{
+		std::vector<llvm::Type*> operandTypes;
+		for ( auto operand : callOperands )
+		{
+			operandTypes.push_back( operand->getType() );
+		}
+
+		helper = llvm::Function::Create( llvm::FunctionType::get( llvm::Type::getVoidTy( m_LLVMContext ), operandTypes, false ), llvm::Function::InternalLinkage, helperName.str(), m_RecompilationModule );
+		helper->setCallingConv( llvm::CallingConv::Fast );
+		helper->addFnAttr( llvm::Attribute::NoInline );
+
+		std::array<llvm::Value*, sizeof...( Operands )> arguments;
+		std::transform( helper->arg_begin(), helper->arg_end(), arguments.begin(), []( llvm::Argument& argument ) { return &argument; } );
+
+		auto callerBlock = m_CurrentBasicBlock;
+		SelectBlock( llvm::BasicBlock::Create( m_LLVMContext, "entry", helper ) );
+		std::apply( body, arguments );
+		m_IRBuilder.CreateRetVoid();
+		SelectBlock( callerBlock );
+
+		m_OutlinedTemplates.emplace( helperName.str(), helper );
+	}
+
+	auto call = m_IRBuilder.CreateCall( helper, callOperands );
+	call->setCallingConv( llvm::CallingConv::Fast );
+}
+
 void Recompiler::PerformDirectModifyInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "DirectModify", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionDirectModify8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionDirectModify8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionDirectModify16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionDirectModify16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformBankModifyInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "BankModify", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionBankModify8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionBankModify8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionBankModify16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionBankModify16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformBankReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "BankRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionBankRead8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionBankRead8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionBankRead16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionBankRead16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformBankReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address16, llvm::Value* I )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "BankRead", [ this, op8, op16, modeFlag ]( llvm::Value* address16, llvm::Value* I )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionBankRead8( op8, address16, I );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionBankRead8( op8, address16, I );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionBankRead16( op16, address16, I );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionBankRead16( op16, address16, I );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address16, I );
 }
 
 void Recompiler::PerformLongReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32, llvm::Value* I )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "LongRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32, llvm::Value* I )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionLongRead8( op8, address32, I );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionLongRead8( op8, address32, I );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionLongRead16( op16, address32, I );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionLongRead16( op16, address32, I );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32, I );
 }
 
 void Recompiler::PerformDirectReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "DirectRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionDirectRead8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionDirectRead8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionDirectRead16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionDirectRead16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformDirectReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address16, llvm::Value* I16 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "DirectRead", [ this, op8, op16, modeFlag ]( llvm::Value* address16, llvm::Value* I16 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionDirectRead8( op8, address16, I16 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionDirectRead8( op8, address16, I16 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionDirectRead16( op16, address16, I16 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionDirectRead16( op16, address16, I16 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address16, I16 );
 }
 
 void Recompiler::PerformIndirectReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "IndirectRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionIndirectRead8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndirectRead8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndirectRead16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionIndirectRead16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformIndexedIndirectReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "IndexedIndirectRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionIndexedIndirectRead8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndexedIndirectRead8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndexedIndirectRead16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionIndexedIndirectRead16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformIndirectIndexedReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "IndirectIndexedRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionIndirectIndexedRead8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndirectIndexedRead8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndirectIndexedRead16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionIndirectIndexedRead16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformIndirectLongReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32, llvm::Value* I16 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "IndirectLongRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32, llvm::Value* I16 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionIndirectLongRead8( op8, address32, I16 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndirectLongRead8( op8, address32, I16 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndirectLongRead16( op16, address32, I16 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionIndirectLongRead16( op16, address32, I16 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32, I16 );
 }
 
 void Recompiler::PerformStackReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "StackRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionStackRead8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionStackRead8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionStackRead16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionStackRead16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformIndirectStackReadInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "IndirectStackRead", [ this, op8, op16, modeFlag ]( llvm::Value* address32 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionIndirectStackRead8( op8, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndirectStackRead8( op8, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndirectStackRead16( op16, address32 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionIndirectStackRead16( op16, address32 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address32 );
 }
 
 void Recompiler::PerformBankWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32, llvm::Value* value16 )
 {
 	auto[ low8, high8 ] = ConvertTo8( value16 );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
-	
-	SelectBlock( flagSetBlock );
-	InstructionBankWrite8( address32, low8 );
-	m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionBankWrite16( address32, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "BankWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionBankWrite8( address32, low8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( flagNotSetBlock );
+		InstructionBankWrite16( address32, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, low8, high8 );
 }
 
 void Recompiler::PerformBankWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32, llvm::Value* I16, llvm::Value* value16 )
 {
 	auto[ low8, high8 ] = ConvertTo8( value16 );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
-	
-	SelectBlock( flagSetBlock );
-	InstructionBankWrite8( address32, I16, low8 );
-	m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionBankWrite16( address32, I16, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "BankWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* I16, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionBankWrite8( address32, I16, low8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( flagNotSetBlock );
+		InstructionBankWrite16( address32, I16, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, I16, low8, high8 );
 }
 
 void Recompiler::PerformLongWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32, llvm::Value* I16 )
 {
 	auto A = m_IRBuilder.CreateLoad( m_registerA );
 	auto[ low8, high8 ] = ConvertTo8( A );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionLongWrite8( address32, I16, low8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "LongWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* I16, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionLongWrite16( address32, I16, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionLongWrite8( address32, I16, low8 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionLongWrite16( address32, I16, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, I16, low8, high8 );
 }
 
 void Recompiler::PerformDirectWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32, llvm::Value* value16 )
 {
 	auto[ low8, high8 ] = ConvertTo8( value16 );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionDirectWrite8( address32, low8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "DirectWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionDirectWrite16( address32, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionDirectWrite8( address32, low8 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionDirectWrite16( address32, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, low8, high8 );
 }
 
 void Recompiler::PerformDirectWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32, llvm::Value* I16, llvm::Value* value16 )
 {
 	auto[ low8, high8 ] = ConvertTo8( value16 );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionDirectWrite8( address32, I16, low8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "DirectWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* I16, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionDirectWrite16( address32, I16, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionDirectWrite8( address32, I16, low8 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionDirectWrite16( address32, I16, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, I16, low8, high8 );
 }
 
 void Recompiler::PerformIndirectWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
 	auto A = m_IRBuilder.CreateLoad( m_registerA );
 	auto[ low8, high8 ] = ConvertTo8( A );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionIndirectWrite8( address32, low8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "IndirectWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndirectWrite16( address32, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndirectWrite8( address32, low8 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionIndirectWrite16( address32, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, low8, high8 );
 }
 
 void Recompiler::PerformIndexedIndirectWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
 	auto A = m_IRBuilder.CreateLoad( m_registerA );
 	auto[ low8, high8 ] = ConvertTo8( A );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
-	
-	SelectBlock( flagSetBlock );
-	InstructionIndexedIndirectWrite8( address32, low8 );
-	m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndexedIndirectWrite16( address32, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "IndexedIndirectWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndexedIndirectWrite8( address32, low8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( flagNotSetBlock );
+		InstructionIndexedIndirectWrite16( address32, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, low8, high8 );
 }
 
 void Recompiler::PerformIndirectIndexedWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32 )
 {
 	auto A = m_IRBuilder.CreateLoad( m_registerA );
 	auto[ low8, high8 ] = ConvertTo8( A );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionIndirectIndexedWrite8( address32, low8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "IndirectIndexedWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndirectIndexedWrite16( address32, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndirectIndexedWrite8( address32, low8 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionIndirectIndexedWrite16( address32, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, low8, high8 );
 }
 
 void Recompiler::PerformIndirectLongWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32, llvm::Value* I16 )
-{	
+{
 	auto A = m_IRBuilder.CreateLoad( m_registerA );
 	auto[ low8, high8 ] = ConvertTo8( A );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionIndirectLongWrite8( address32, I16, low8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "IndirectLongWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* I16, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndirectLongWrite16( address32, I16, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndirectLongWrite8( address32, I16, low8 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionIndirectLongWrite16( address32, I16, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, I16, low8, high8 );
 }
 
 void Recompiler::PerformStackWriteInstruction( RegisterModeFlag modeFlag, llvm::Value* address32 )
-{	
+{
 	auto A = m_IRBuilder.CreateLoad( m_registerA );
 	auto[ low8, high8 ] = ConvertTo8( A );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
-	
-	SelectBlock( flagSetBlock );
-	InstructionStackWrite8( address32, low8 );
-	m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionStackWrite16( address32, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "StackWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionStackWrite8( address32, low8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( flagNotSetBlock );
+		InstructionStackWrite16( address32, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, low8, high8 );
 }
 
 void Recompiler::PerformBitImmediateInstruction( RegisterModeFlag modeFlag, llvm::Value* operand16 )
@@ -1946,18 +2593,21 @@ void Recompiler::PerformIndirectStackWriteInstruction( RegisterModeFlag modeFlag
 {
 	auto A = m_IRBuilder.CreateLoad( m_registerA );
 	auto[ low8, high8 ] = ConvertTo8( A );
-	
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
-	
-	SelectBlock( flagSetBlock );
-	InstructionIndirectStackWrite8( address32, low8 );
-	m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionIndirectStackWrite16( address32, low8, high8 );
-	m_IRBuilder.CreateBr( endBlock );
+	PerformOutlinedTemplate( "IndirectStackWrite", [ this, modeFlag ]( llvm::Value* address32, llvm::Value* low8, llvm::Value* high8 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionIndirectStackWrite8( address32, low8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( flagNotSetBlock );
+		InstructionIndirectStackWrite16( address32, low8, high8 );
+		m_IRBuilder.CreateBr( endBlock );
+
+		SelectBlock( endBlock );
+	}, address32, low8, high8 );
 }
 
 void Recompiler::InstructionBankModify16( Operation op, llvm::Value* address32 )
@@ -2645,32 +3295,38 @@ void Recompiler::InstructionBlockMove16( llvm::Value* sourceBank32, llvm::Value*
 
 void Recompiler::PerformDirectIndexedModifyInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address16 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "DirectIndexedModify", [ this, op8, op16, modeFlag ]( llvm::Value* address16 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionDirectIndexedModify8( op8, address16 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionDirectIndexedModify8( op8, address16 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionDirectIndexedModify16( op16, address16 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionDirectIndexedModify16( op16, address16 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address16 );
 }
 
 void Recompiler::PerformBankIndexedModifyInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address16 )
 {
-	auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
+	PerformOutlinedTemplate( "BankIndexedModify", [ this, op8, op16, modeFlag ]( llvm::Value* address16 )
+	{
+		auto[ flagSetBlock, flagNotSetBlock, endBlock ] = CreateRegisterFlagTestBlock( modeFlag == RegisterModeFlag::REGISTER_MODE_FLAG_M ? m_AccumulatorFlag : m_IndexRegisterFlag );
 
-	SelectBlock( flagSetBlock );
-	InstructionBankIndexedModify8( op8, address16 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagSetBlock );
+		InstructionBankIndexedModify8( op8, address16 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( flagNotSetBlock );
-	InstructionBankIndexedModify16( op16, address16 );
-	m_IRBuilder.CreateBr( endBlock );
+		SelectBlock( flagNotSetBlock );
+		InstructionBankIndexedModify16( op16, address16 );
+		m_IRBuilder.CreateBr( endBlock );
 
-	SelectBlock( endBlock );
+		SelectBlock( endBlock );
+	}, address16 );
 }
 
 void Recompiler::InstructionDirectModify8( Operation op, llvm::Value* address32 )
@@ -3368,6 +4024,8 @@ void Recompiler::PerformImpliedModifyInstruction( Operation op8, Operation op16,
 
 void Recompiler::GenerateCodeForInstruction( const Instruction& instruction, const std::string& functionName )
 {
+	m_CurrentOpcode = instruction.GetOpcode();
+	m_OutlineCurrentInstruction = m_OutlineTemplates && m_HotFunctions.find( functionName ) == m_HotFunctions.end();
 	PerformUpdateInstructionOutput( instruction.GetOffset(), instruction.GetPC(), instruction.GetInstructionString() );
 	PerformRomCycle();
 	switch ( instruction.GetOpcode() )
@@ -4006,7 +4664,7 @@ void Recompiler::GenerateCodeForInstruction( const Instruction& instruction, con
 			PerformImpliedModifyInstruction( &Recompiler::DEC8, &Recompiler::DEC16, RegisterModeFlag::REGISTER_MODE_FLAG_X, m_registerX );
 			break;
 		case 0xcb:
-			// WAI - Nothing to do.
+			PerformWaitInstruction( m_WaitForInterruptFunction );
 			break;
 		case 0xcc:
 			PerformBankReadInstruction( &Recompiler::CPY8, &Recompiler::CPY16, RegisterModeFlag::REGISTER_MODE_FLAG_X, GetConstant( instruction.GetOperand(), 32, false ) );
@@ -4173,6 +4831,8 @@ void Recompiler::GenerateCodeForInstruction( const Instruction& instruction, con
 			PerformLongReadInstruction( &Recompiler::SBC8, &Recompiler::SBC16, RegisterModeFlag::REGISTER_MODE_FLAG_M, GetConstant( instruction.GetOperand(), 32, false ), m_IRBuilder.CreateLoad( m_registerX ) );
 			break;
 	}
+
+	m_OutlineCurrentInstruction = false;
 }
 
 void Recompiler::LoadAST( const std::string& filename )
@@ -4230,6 +4890,30 @@ void Recompiler::LoadAST( const std::string& filename )
 	}
 }
 
+// Read the smk_call_counts.txt written by a --profile-calls run. Functions called at least once per frame on average
+// are hot and keep their width diamonds inline, same threshold as symbol_order.
+void Recompiler::LoadCallProfile( const std::string& filename )
+{
+	std::ifstream callCounts( filename );
+	std::string framesLabel;
+	uint64_t frames = 0;
+	if ( !( callCounts >> framesLabel >> frames ) || framesLabel != "frames" )
+	{
+		std::cerr << "Can't load call profile " << filename << std::endl;
+		return;
+	}
+
+	uint64_t count = 0;
+	std::string functionName;
+	while ( callCounts >> count >> functionName )
+	{
+		if ( count != 0 && count >= frames )
+		{
+			m_HotFunctions.insert( functionName );
+		}
+	}
+}
+
 Recompiler::Label::Label( const std::string& name, const uint32_t offset )
 	: m_Name( name )
 	, m_Offset( offset )
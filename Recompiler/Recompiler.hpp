@@ -16,11 +16,14 @@ public:
 	~Recompiler();
 
 	void LoadAST( const std::string& filename );
-	void Recompile( const std::string& targetType );
+	void LoadCallProfile( const std::string& filename );
+	bool Recompile( const std::string& targetType, const uint32_t partitionCount, const bool profileCalls, const bool outlineTemplates );
 
 	void AddLabelNameToBasicBlock( const std::string& labelName, llvm::BasicBlock* basicBlock );
 	void CreateFunctions();
 	void InitialiseBasicBlocksFromLabelNames();
+	void IdentifyLoopIdioms();
+	void IdentifyIdleLoops();
 	void GenerateCode();
 	void EnforceFunctionEntryBlocksConstraints();
 	void SetupNmiCall();
@@ -30,6 +33,9 @@ public:
 	void AddOffsetToInstructionString( const uint32_t offset, const std::string& stringGlobalVariable );
 	void AddInstructionStringGlobalVariables();
 	void SelectBlock( llvm::BasicBlock* basicBlock );
+	void AddCallProfiling( const bool enabled );
+	void ReportOutlinedTemplates();
+	bool EmitObjectFiles( const uint32_t partitionCount );
 
 	const std::unordered_map<uint32_t, std::unordered_map<std::string, bool> >& GetLabelsToFunctions() const { return m_LabelsToFunctions; }
 	const std::unordered_map<std::string, llvm::Function*>& GetFunctions() const { return m_Functions; }
@@ -148,6 +154,9 @@ private:
 		REGISTER_MODE_FLAG_X
 	};
 	
+	template<typename Body, typename... Operands>
+	void PerformOutlinedTemplate( const char* templateName, Body body, Operands... operands );
+
 	void PerformImpliedModifyInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* ptr );
 	void PerformBankModifyInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address32 );
 	void PerformBankIndexedModifyInstruction( Operation op8, Operation op16, RegisterModeFlag modeFlag, llvm::Value* address16 );
@@ -342,7 +351,30 @@ private:
 		std::set<std::string> m_FuncNames;
 	};
 
+	enum class LoopIdiomType
+	{
+		LOOP_IDIOM_FILL,
+		LOOP_IDIOM_COPY
+	};
+
+	struct LoopIdiom
+	{
+		LoopIdiomType type = LoopIdiomType::LOOP_IDIOM_FILL;
+		bool indexRegisterY = false;
+		bool storeZero = false;
+		uint32_t destinationOperand = 0;
+		uint32_t sourceOperand = 0;
+		uint32_t step = 1;
+		uint32_t instructionsPerIteration = 0;
+		MemoryMode memoryMode = SIXTEEN_BIT;
+		MemoryMode indexMode = SIXTEEN_BIT;
+		std::string exitLabelName;
+	};
+
 	void GenerateCodeForInstruction( const Instruction& instruction, const std::string& functionName );
+	void InsertLoopIdiomFastPath( const LoopIdiom& loopIdiom, const std::string& functionName, const std::string& basicBlockName );
+	void InsertIdleLoopBackEdge( const bool pollsSpcPort, const std::string& basicBlockName );
+	void PerformWaitInstruction( llvm::Function* waitFunction );
 
 	static constexpr uint64_t M_FLAG = 0b00100000u;
 	static constexpr uint64_t X_FLAG = 0b00010000u;
@@ -367,6 +399,15 @@ private:
 	std::unordered_map< uint32_t, llvm::GlobalVariable* > m_OffsetsToInstructionStringGlobalVariable;
 	std::unordered_map< std::string, uint32_t > m_returnAddressManipulationFunctions;
 	std::unordered_map< std::string, llvm::BasicBlock* > m_returnAddressManipulationFunctionBlocks;
+	std::unordered_map< uint32_t, LoopIdiom > m_LoopIdioms;
+	std::unordered_map< uint32_t, bool > m_IdleLoops;
+	std::string m_LoopBackEdgeLabelName;
+	llvm::BasicBlock* m_LoopBackEdgeBlock;
+	std::set< std::string > m_HotFunctions;
+	std::unordered_map< std::string, llvm::Function* > m_OutlinedTemplates;
+	bool m_OutlineTemplates;
+	bool m_OutlineCurrentInstruction;
+	uint8_t m_CurrentOpcode;
 
 	llvm::Function* m_StartFunction;
 
@@ -393,13 +434,13 @@ private:
 	llvm::Function* m_PanicFunction;
 	llvm::Function* m_UpdateInstructionOutput;
 
-	static inline const uint32_t WAIT_FOR_VBLANK_LOOP_LABEL_OFFSET = 0x805C;
-	static inline const std::string WAIT_FOR_VBLANK_LABEL_NAME = "CODE_80805C";
-
 	llvm::Function* m_Load8Function;
 	llvm::Function* m_Store8Function;
+	llvm::Function* m_BlockFillFunction;
+	llvm::Function* m_BlockCopyFunction;
 
-	llvm::Function* m_DoPPUFrameFunction;
+	llvm::Function* m_WaitForInterruptFunction;
+	llvm::Function* m_WaitForSpcPortFunction;
 
 	llvm::Function* m_ADC8Function;
 	llvm::Function* m_ADC16Function;
@@ -1,11 +1,16 @@
 #include "Recompiler.hpp"
 #include <iostream>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
 
 int main( int argc, char** argv ) 
 {	
+	static const char* const usage = "Recompiler: Recompiler astpath target(native or wasm) [object file count] [--profile-calls] [--no-outline] [--hot-profile callcountspath]";
 	if ( argc < 3 )
 	{
-		std::cout << "Recompiler: Recompiler astpath target(native or wasm)" << std::endl;
+		std::cout << usage << std::endl;
 		return EXIT_FAILURE;
 	}
 
@@ -16,9 +21,56 @@ int main( int argc, char** argv )
 		return EXIT_FAILURE;
 	}
 
+	uint32_t partitionCount = std::max( std::thread::hardware_concurrency(), 1u );
+	bool profileCalls = false;
+	bool outlineTemplates = true;
+	std::string hotProfile;
+	for ( int i = 3; i < argc; i++ )
+	{
+		const std::string argument( argv[i] );
+		if ( argument == "--profile-calls" )
+		{
+			profileCalls = true;
+		}
+		else if ( argument == "--no-outline" )
+		{
+			outlineTemplates = false;
+		}
+		else if ( argument == "--hot-profile" && i + 1 < argc )
+		{
+			hotProfile = argv[++i];
+		}
+		else
+		{
+			// Anything else has to be the object file count, a bad flag or a missing path is an error rather than a count.
+			char* end = nullptr;
+			const unsigned long count = std::isdigit( static_cast<unsigned char>( argument[0] ) ) ? std::strtoul( argument.c_str(), &end, 10 ) : 0;
+			if ( end == nullptr || *end != '\0' || count > UINT32_MAX )
+			{
+				std::cout << usage << std::endl;
+				return EXIT_FAILURE;
+			}
+			partitionCount = static_cast<uint32_t>( count );
+		}
+	}
+
+	if ( partitionCount == 0 )
+	{
+		std::cout << "ERROR: object file count must be at least 1" << std::endl;
+		return EXIT_FAILURE;
+	}
+
 	Recompiler rc;
 	rc.LoadAST( argv[1] );
-	rc.Recompile( target );
+	if ( !hotProfile.empty() )
+	{
+		rc.LoadCallProfile( hotProfile );
+	}
+	if ( !rc.Recompile( target, partitionCount, profileCalls, outlineTemplates ) )
+	{
+		std::cout << "ERROR: code generation failed" << std::endl;
+		return EXIT_FAILURE;
+	}
 
 	return EXIT_SUCCESS;
 }
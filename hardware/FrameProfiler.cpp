@@ -0,0 +1,118 @@
+#include "FrameProfiler.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <utility>
+
+namespace
+{
+	const char* PHASE_NAMES[ FrameProfiler::PHASE_COUNT ] = { "hdma", "render", "spc", "dsp", "present" };
+
+	double ToMilliseconds( const FrameProfiler::Clock::duration duration )
+	{
+		return std::chrono::duration<double, std::milli>( duration ).count();
+	}
+
+	// Nearest rank percentile of an already sorted set of samples.
+	double Percentile( const std::vector<double>& sorted, const double percent )
+	{
+		if ( sorted.empty() )
+		{
+			return 0.0;
+		}
+		const size_t rank = static_cast<size_t>( percent / 100.0 * ( sorted.size() - 1 ) + 0.5 );
+		return sorted[ std::min( rank, sorted.size() - 1 ) ];
+	}
+
+	void WriteStatistics( std::ofstream& report, std::vector<double> samples )
+	{
+		std::sort( samples.begin(), samples.end() );
+		double total = 0.0;
+		for ( const double sample : samples )
+		{
+			total += sample;
+		}
+
+		report << "{ \"mean\": " << ( samples.empty() ? 0.0 : total / samples.size() )
+			<< ", \"p50\": " << Percentile( samples, 50.0 )
+			<< ", \"p95\": " << Percentile( samples, 95.0 )
+			<< ", \"p99\": " << Percentile( samples, 99.0 )
+			<< ", \"max\": " << ( samples.empty() ? 0.0 : samples.back() ) << " }";
+	}
+}
+
+void FrameProfiler::Enable( const uint64_t expectedFrames )
+{
+	m_Enabled = true;
+	m_Frames.reserve( expectedFrames );
+}
+
+void FrameProfiler::NextFrame()
+{
+	if ( !m_Enabled )
+	{
+		return;
+	}
+
+	const Clock::time_point now = Clock::now();
+	if ( m_FrameStarted )
+	{
+		m_Frames.push_back( { now - m_FrameStart, m_CurrentFrame } );
+	}
+	m_CurrentFrame.fill( Clock::duration::zero() );
+	m_FrameStart = now;
+	m_FrameStarted = true;
+}
+
+bool FrameProfiler::WriteReport( const std::string& path )
+{
+	if ( m_FrameStarted )
+	{
+		m_Frames.push_back( { Clock::now() - m_FrameStart, m_CurrentFrame } );
+		m_FrameStarted = false;
+	}
+
+	std::ofstream report( path );
+	if ( !report )
+	{
+		return false;
+	}
+
+	std::vector<double> frameTimes;
+	std::array<std::vector<double>, PHASE_COUNT> phaseTimes;
+	std::vector<double> cpuTimes;
+	Clock::duration elapsed = Clock::duration::zero();
+	for ( const auto& frame : m_Frames )
+	{
+		Clock::duration accounted = Clock::duration::zero();
+		for ( size_t phase = 0; phase < PHASE_COUNT; phase++ )
+		{
+			phaseTimes[ phase ].push_back( ToMilliseconds( frame.phases[ phase ] ) );
+			accounted += frame.phases[ phase ];
+		}
+		frameTimes.push_back( ToMilliseconds( frame.total ) );
+		cpuTimes.push_back( ToMilliseconds( std::max( frame.total - accounted, Clock::duration::zero() ) ) );
+		elapsed += frame.total;
+	}
+
+	const double seconds = std::chrono::duration<double>( elapsed ).count();
+	report << std::fixed << std::setprecision( 4 );
+	report << "{" << std::endl;
+	report << "\t\"frames\": " << m_Frames.size() << "," << std::endl;
+	report << "\t\"seconds\": " << seconds << "," << std::endl;
+	report << "\t\"fps\": " << ( seconds > 0.0 ? m_Frames.size() / seconds : 0.0 ) << "," << std::endl;
+	report << "\t\"frame_ms\": ";
+	WriteStatistics( report, std::move( frameTimes ) );
+	report << "," << std::endl;
+	report << "\t\"phases_ms\": {" << std::endl;
+	report << "\t\t\"cpu\": ";
+	WriteStatistics( report, std::move( cpuTimes ) );
+	for ( size_t phase = 0; phase < PHASE_COUNT; phase++ )
+	{
+		report << "," << std::endl << "\t\t\"" << PHASE_NAMES[ phase ] << "\": ";
+		WriteStatistics( report, std::move( phaseTimes[ phase ] ) );
+	}
+	report << std::endl << "\t}" << std::endl;
+	report << "}" << std::endl;
+	return static_cast<bool>( report );
+}
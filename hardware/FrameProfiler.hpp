@@ -0,0 +1,82 @@
+#ifndef FRAME_PROFILER_HPP
+#define FRAME_PROFILER_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Times every frame and the subsystems inside it for --benchmark runs. A frame runs from one DoPPUFrame to the next,
+// whatever the other phases don't account for is the recompiled code and is reported as cpu. When the profiler is
+// disabled a Scope costs a single branch.
+class FrameProfiler
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	enum Phase : uint8_t
+	{
+		PHASE_HDMA,
+		PHASE_RENDER,
+		PHASE_SPC,
+		PHASE_DSP,
+		PHASE_PRESENT,
+		PHASE_COUNT
+	};
+
+	class Scope
+	{
+	public:
+		// Nothing is timed unless timed is set, for callers that only know at run time whether there's work worth timing.
+		Scope( FrameProfiler& profiler, const Phase phase, const bool timed = true )
+		: m_Profiler( profiler.m_Enabled && timed ? &profiler : nullptr )
+		, m_Phase( phase )
+		{
+			if ( m_Profiler )
+			{
+				m_Start = Clock::now();
+			}
+		}
+
+		~Scope()
+		{
+			if ( m_Profiler )
+			{
+				m_Profiler->m_CurrentFrame[ m_Phase ] += Clock::now() - m_Start;
+			}
+		}
+
+		Scope( const Scope& other ) = delete;
+		Scope& operator=( const Scope& other ) = delete;
+
+	private:
+		FrameProfiler* m_Profiler;
+		Phase m_Phase;
+		Clock::time_point m_Start;
+	};
+
+	void Enable( const uint64_t expectedFrames );
+	bool IsEnabled() const { return m_Enabled; }
+
+	// Closes the frame in progress and starts timing the next one.
+	void NextFrame();
+
+	// Closes the frame in progress first, so the last frame before quitting is counted.
+	bool WriteReport( const std::string& path );
+
+private:
+	struct Frame
+	{
+		Clock::duration total;
+		std::array<Clock::duration, PHASE_COUNT> phases;
+	};
+
+	bool m_Enabled = false;
+	bool m_FrameStarted = false;
+	Clock::time_point m_FrameStart;
+	std::array<Clock::duration, PHASE_COUNT> m_CurrentFrame = {};
+	std::vector<Frame> m_Frames;
+};
+
+#endif // FRAME_PROFILER_HPP
@@ -0,0 +1,61 @@
+#ifndef FRAME_QUEUE_HPP
+#define FRAME_QUEUE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// A finished frame converted to 32 bit color, ready to be uploaded as a texture.
+struct VideoFrame
+{
+	// 4x hd mode 7.
+	static constexpr uint32_t MAX_WIDTH = 1024;
+	static constexpr uint32_t MAX_HEIGHT = 960;
+
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<uint32_t> pixels = std::vector<uint32_t>( MAX_WIDTH * MAX_HEIGHT );
+};
+
+// Triple buffer handing frames from the emulation thread to the presentation thread without either ever waiting.
+// The emulation thread draws into the back frame and publishes it by swapping it with the shared one, the presentation
+// thread swaps the shared one with its front frame whenever a new one was published. Frames the presentation thread
+// didn't get round to are simply replaced by newer ones.
+class FrameQueue
+{
+public:
+	FrameQueue() = default;
+	FrameQueue( const FrameQueue& other ) = delete;
+	FrameQueue& operator=( const FrameQueue& other ) = delete;
+
+	// Emulation thread.
+	VideoFrame& GetBackFrame() { return m_Frames[ m_Back ]; }
+
+	void Publish()
+	{
+		m_Back = m_Shared.exchange( m_Back | FRESH, std::memory_order_acq_rel ) & INDEX_MASK;
+	}
+
+	// Presentation thread, returns the newest frame or null if none was published since the last call.
+	const VideoFrame* Acquire()
+	{
+		if ( !( m_Shared.load( std::memory_order_relaxed ) & FRESH ) )
+		{
+			return nullptr;
+		}
+		m_Front = m_Shared.exchange( m_Front, std::memory_order_acq_rel ) & INDEX_MASK;
+		return &m_Frames[ m_Front ];
+	}
+
+private:
+	static constexpr uint8_t INDEX_MASK = 0x03;
+	static constexpr uint8_t FRESH = 0x04;
+
+	std::array<VideoFrame, 3> m_Frames;
+	uint8_t m_Back = 0;
+	uint8_t m_Front = 1;
+	std::atomic<uint8_t> m_Shared{ 2 };
+};
+
+#endif // FRAME_QUEUE_HPP
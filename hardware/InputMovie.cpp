@@ -0,0 +1,139 @@
+#include "InputMovie.hpp"
+#include <algorithm>
+
+namespace
+{
+	void WriteLittleEndian( std::ofstream& output, const uint32_t value, const size_t size )
+	{
+		for ( size_t i = 0; i < size; i++ )
+		{
+			output.put( static_cast<char>( ( value >> ( i * 8 ) ) & 0xff ) );
+		}
+	}
+
+	bool ReadLittleEndian( std::ifstream& input, uint32_t& value, const size_t size )
+	{
+		value = 0;
+		for ( size_t i = 0; i < size; i++ )
+		{
+			const int byte = input.get();
+			if ( byte == std::char_traits<char>::eof() )
+			{
+				return false;
+			}
+			value |= static_cast<uint32_t>( byte ) << ( i * 8 );
+		}
+		return true;
+	}
+}
+
+InputMovie::~InputMovie()
+{
+	Close();
+}
+
+bool InputMovie::OpenForRecording( const std::string& path )
+{
+	m_Output.open( path, std::ios::binary | std::ios::trunc );
+	if ( !m_Output )
+	{
+		return false;
+	}
+
+	m_Output.write( MAGIC, sizeof( MAGIC ) );
+	m_Output.put( static_cast<char>( VERSION ) );
+	m_Recording = true;
+	m_RunLength = 0;
+	return true;
+}
+
+bool InputMovie::OpenForPlayback( const std::string& path )
+{
+	m_Input.open( path, std::ios::binary );
+	char magic[ sizeof( MAGIC ) ] = {};
+	if ( !m_Input.read( magic, sizeof( magic ) ) || !std::equal( magic, magic + sizeof( magic ), MAGIC ) || m_Input.get() != VERSION )
+	{
+		m_Input.close();
+		return false;
+	}
+
+	m_Playing = true;
+	m_RunLength = 0;
+	return true;
+}
+
+void InputMovie::WriteFrame( const Pads& pads )
+{
+	if ( m_RunLength > 0 && ( pads != m_RunPads || m_RunLength == UINT32_MAX ) )
+	{
+		WriteRun();
+	}
+	m_RunPads = pads;
+	m_RunLength++;
+}
+
+bool InputMovie::ReadFrame( Pads& pads )
+{
+	if ( m_RunLength == 0 && !ReadRun() )
+	{
+		m_Playing = false;
+		pads.fill( 0 );
+		return false;
+	}
+
+	pads = m_RunPads;
+	m_RunLength--;
+	return true;
+}
+
+void InputMovie::Close()
+{
+	if ( m_Recording )
+	{
+		if ( m_RunLength > 0 )
+		{
+			WriteRun();
+		}
+		m_Output.close();
+		m_Recording = false;
+	}
+
+	if ( m_Input.is_open() )
+	{
+		m_Input.close();
+		m_Playing = false;
+	}
+}
+
+void InputMovie::WriteRun()
+{
+	WriteLittleEndian( m_Output, m_RunLength, sizeof( uint32_t ) );
+	for ( const uint16_t pad : m_RunPads )
+	{
+		WriteLittleEndian( m_Output, pad, sizeof( uint16_t ) );
+	}
+	m_RunLength = 0;
+}
+
+bool InputMovie::ReadRun()
+{
+	uint32_t length = 0;
+	if ( !ReadLittleEndian( m_Input, length, sizeof( uint32_t ) ) )
+	{
+		return false;
+	}
+
+	for ( uint16_t& pad : m_RunPads )
+	{
+		uint32_t value = 0;
+		if ( !ReadLittleEndian( m_Input, value, sizeof( uint16_t ) ) )
+		{
+			return false;
+		}
+		pad = static_cast<uint16_t>( value );
+	}
+
+	// WriteRun never writes an empty run, so one means the file is corrupt and playback stops there.
+	m_RunLength = length;
+	return length > 0;
+}
@@ -0,0 +1,49 @@
+#ifndef INPUT_MOVIE_HPP
+#define INPUT_MOVIE_HPP
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// Records or plays back the pad word of both controller ports for every frame. The file is the magic "SMKM", a
+// version byte and then runs of identical frames, each a 32 bit frame count followed by the two 16 bit pad words,
+// all little endian, so holding the same buttons for any number of frames costs 8 bytes.
+class InputMovie
+{
+public:
+	static constexpr size_t PORT_COUNT = 2;
+	using Pads = std::array<uint16_t, PORT_COUNT>;
+
+	InputMovie() = default;
+	InputMovie( const InputMovie& other ) = delete;
+	InputMovie& operator=( const InputMovie& other ) = delete;
+	~InputMovie();
+
+	bool OpenForRecording( const std::string& path );
+	bool OpenForPlayback( const std::string& path );
+	bool IsRecording() const { return m_Recording; }
+	bool IsPlaying() const { return m_Playing; }
+
+	void WriteFrame( const Pads& pads );
+	// Returns false once every recorded frame has been played back or at a corrupt run, pads are then released.
+	bool ReadFrame( Pads& pads );
+
+	void Close();
+
+private:
+	static constexpr char MAGIC[ 4 ] = { 'S', 'M', 'K', 'M' };
+	static constexpr uint8_t VERSION = 1;
+
+	void WriteRun();
+	bool ReadRun();
+
+	std::ofstream m_Output;
+	std::ifstream m_Input;
+	bool m_Recording = false;
+	bool m_Playing = false;
+	Pads m_RunPads = {};
+	uint32_t m_RunLength = 0;
+};
+
+#endif // INPUT_MOVIE_HPP
@@ -0,0 +1,86 @@
+#ifndef IO_REGISTERS_HPP
+#define IO_REGISTERS_HPP
+
+#include <cstdint>
+#include <deque>
+
+// Handler tables for the memory mapped registers, 256 per page of the low 64KB of the system banks. Each device maps
+// the registers it decodes when the system powers on so reading or writing one is a single indirect call, anything
+// nobody mapped reads as 0 and ignores writes.
+class IoRegisters
+{
+public:
+	using ReadHandler = uint8_t ( * )( void* device, const uint32_t address );
+	using WriteHandler = void ( * )( void* device, const uint32_t address, const uint8_t value );
+
+	IoRegisters()
+	{
+		for ( auto& page : m_Pages )
+		{
+			page = &m_OpenBusPage;
+		}
+	}
+
+	IoRegisters( const IoRegisters& other ) = delete;
+	IoRegisters& operator=( const IoRegisters& other ) = delete;
+
+	void MapRead( const uint32_t address, ReadHandler handler, void* device )
+	{
+		GetMappedPage( address ).read[ address & 0xff ] = { handler, device };
+	}
+
+	void MapWrite( const uint32_t address, WriteHandler handler, void* device )
+	{
+		GetMappedPage( address ).write[ address & 0xff ] = { handler, device };
+	}
+
+	uint8_t Read( const uint32_t address ) const
+	{
+		const ReadRegister& reg = m_Pages[ ( address >> 8 ) & 0xff ]->read[ address & 0xff ];
+		return reg.handler( reg.device, address );
+	}
+
+	void Write( const uint32_t address, const uint8_t value ) const
+	{
+		const WriteRegister& reg = m_Pages[ ( address >> 8 ) & 0xff ]->write[ address & 0xff ];
+		reg.handler( reg.device, address, value );
+	}
+
+private:
+	static uint8_t OpenBusRead( void* device, const uint32_t address ) { return 0; }
+	static void OpenBusWrite( void* device, const uint32_t address, const uint8_t value ) {}
+
+	struct ReadRegister
+	{
+		ReadHandler handler = &OpenBusRead;
+		void* device = nullptr;
+	};
+
+	struct WriteRegister
+	{
+		WriteHandler handler = &OpenBusWrite;
+		void* device = nullptr;
+	};
+
+	struct Page
+	{
+		ReadRegister read[ 256 ];
+		WriteRegister write[ 256 ];
+	};
+
+	Page& GetMappedPage( const uint32_t address )
+	{
+		auto& page = m_Pages[ ( address >> 8 ) & 0xff ];
+		if ( page == &m_OpenBusPage )
+		{
+			page = &m_MappedPages.emplace_back();
+		}
+		return *page;
+	}
+
+	Page m_OpenBusPage;
+	Page* m_Pages[ 256 ];
+	std::deque<Page> m_MappedPages;
+};
+
+#endif // IO_REGISTERS_HPP
@@ -0,0 +1,286 @@
+#include "RewindBuffer.hpp"
+#include <cassert>
+#include <cstring>
+
+namespace
+{
+	// Shorter runs of zeros are cheaper to leave in the literals than to split them into another pair of lengths.
+	constexpr size_t MIN_ZERO_RUN = 4;
+	// Captures arriving while this many are still waiting to be encoded are dropped, the next delta just spans more frames.
+	constexpr size_t MAX_PENDING = 4;
+
+	void WriteLength( std::vector<uint8_t>& output, size_t length )
+	{
+		while ( length >= 0x80 )
+		{
+			output.push_back( static_cast<uint8_t>( length | 0x80 ) );
+			length >>= 7;
+		}
+		output.push_back( static_cast<uint8_t>( length ) );
+	}
+
+	size_t ReadLength( const uint8_t*& input )
+	{
+		size_t length = 0;
+		for ( uint32_t shift = 0; ; shift += 7 )
+		{
+			const uint8_t byte = *input++;
+			length |= static_cast<size_t>( byte & 0x7f ) << shift;
+			if ( !( byte & 0x80 ) )
+			{
+				return length;
+			}
+		}
+	}
+
+	// The encoding is pairs of lengths, a run of zero bytes then a run of literal bytes followed by the literals. A
+	// delta encodes state XOR previous so unchanged bytes are the zeros, a key frame encodes state on its own.
+	template<bool Delta>
+	void Encode( const uint8_t* state, const uint8_t* previous, const size_t size, std::vector<uint8_t>& output )
+	{
+		const auto byteAt = [ state, previous ]( const size_t i ) -> uint8_t { return Delta ? state[ i ] ^ previous[ i ] : state[ i ]; };
+
+		output.clear();
+		size_t i = 0;
+		while ( i < size )
+		{
+			const size_t zeroStart = i;
+			while ( i + sizeof( uint64_t ) <= size )
+			{
+				uint64_t word;
+				memcpy( &word, state + i, sizeof( word ) );
+				if ( Delta )
+				{
+					uint64_t previousWord;
+					memcpy( &previousWord, previous + i, sizeof( previousWord ) );
+					word ^= previousWord;
+				}
+				if ( word != 0 )
+				{
+					break;
+				}
+				i += sizeof( uint64_t );
+			}
+			while ( i < size && byteAt( i ) == 0 )
+			{
+				i++;
+			}
+
+			const size_t literalStart = i;
+			while ( i < size )
+			{
+				if ( byteAt( i ) != 0 )
+				{
+					i++;
+					continue;
+				}
+				size_t zeroEnd = i;
+				while ( zeroEnd < size && zeroEnd - i < MIN_ZERO_RUN && byteAt( zeroEnd ) == 0 )
+				{
+					zeroEnd++;
+				}
+				if ( zeroEnd - i >= MIN_ZERO_RUN || zeroEnd == size )
+				{
+					break;
+				}
+				i = zeroEnd;
+			}
+
+			WriteLength( output, literalStart - zeroStart );
+			WriteLength( output, i - literalStart );
+			for ( size_t literal = literalStart; literal < i; literal++ )
+			{
+				output.push_back( byteAt( literal ) );
+			}
+		}
+	}
+
+	template<bool Delta>
+	void Decode( const std::vector<uint8_t>& encoded, std::vector<uint8_t>& state )
+	{
+		const uint8_t* input = encoded.data();
+		const uint8_t* end = input + encoded.size();
+		uint8_t* output = state.data();
+		while ( input < end )
+		{
+			const size_t zeros = ReadLength( input );
+			const size_t literals = ReadLength( input );
+			if ( !Delta )
+			{
+				memset( output, 0, zeros );
+			}
+			output += zeros;
+			for ( size_t i = 0; i < literals; i++ )
+			{
+				output[ i ] = Delta ? output[ i ] ^ input[ i ] : input[ i ];
+			}
+			output += literals;
+			input += literals;
+		}
+		assert( output == state.data() + state.size() );
+	}
+}
+
+RewindBuffer::~RewindBuffer()
+{
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_Stop = true;
+	}
+	m_Condition.notify_all();
+	if ( m_Worker.joinable() )
+	{
+		m_Worker.join();
+	}
+}
+
+void RewindBuffer::Start( const size_t maxStates, const size_t memoryBudget, const uint32_t keyFrameInterval )
+{
+	m_MaxStates = maxStates;
+	m_MemoryBudget = memoryBudget;
+	m_KeyFrameInterval = keyFrameInterval;
+#ifndef __EMSCRIPTEN__
+	m_Worker = std::thread( &RewindBuffer::WorkerThread, this );
+#endif // __EMSCRIPTEN__
+}
+
+void RewindBuffer::Push( std::vector<uint8_t>& state )
+{
+#ifdef __EMSCRIPTEN__
+	Store( state );
+#else
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		if ( m_Pending.size() >= MAX_PENDING )
+		{
+			return;
+		}
+
+		m_Pending.push_back( std::move( state ) );
+		if ( !m_FreeBuffers.empty() )
+		{
+			state = std::move( m_FreeBuffers.back() );
+			m_FreeBuffers.pop_back();
+		}
+		else
+		{
+			state = {};
+		}
+	}
+	m_Condition.notify_all();
+#endif // __EMSCRIPTEN__
+}
+
+bool RewindBuffer::Pop( std::vector<uint8_t>& state )
+{
+	std::unique_lock<std::mutex> lock( m_Mutex );
+	WaitForPending( lock );
+	if ( m_Entries.size() < 2 )
+	{
+		return false;
+	}
+
+	const Entry newest = std::move( m_Entries.back() );
+	m_Entries.pop_back();
+	m_Bytes -= newest.data.size();
+
+	if ( !newest.keyFrame )
+	{
+		Decode<true>( newest.data, m_Newest );
+		m_DeltasSinceKeyFrame--;
+	}
+	else
+	{
+		// The deltas only run forwards from a key frame, so rebuild the last state of the previous group.
+		size_t keyFrame = m_Entries.size() - 1;
+		while ( !m_Entries[ keyFrame ].keyFrame )
+		{
+			keyFrame--;
+		}
+		Decode<false>( m_Entries[ keyFrame ].data, m_Newest );
+		for ( size_t delta = keyFrame + 1; delta < m_Entries.size(); delta++ )
+		{
+			Decode<true>( m_Entries[ delta ].data, m_Newest );
+		}
+		m_DeltasSinceKeyFrame = static_cast<uint32_t>( m_Entries.size() - 1 - keyFrame );
+	}
+
+	state = m_Newest;
+	return true;
+}
+
+void RewindBuffer::WaitForPending( std::unique_lock<std::mutex>& lock )
+{
+	m_Condition.wait( lock, [ this ] { return m_Pending.empty() && !m_Busy; } );
+}
+
+void RewindBuffer::WorkerThread()
+{
+	std::unique_lock<std::mutex> lock( m_Mutex );
+	while ( true )
+	{
+		m_Condition.wait( lock, [ this ] { return m_Stop || !m_Pending.empty(); } );
+		if ( m_Stop )
+		{
+			return;
+		}
+
+		std::vector<uint8_t> state = std::move( m_Pending.front() );
+		m_Pending.pop_front();
+		m_Busy = true;
+		lock.unlock();
+
+		Store( state );
+
+		lock.lock();
+		m_FreeBuffers.push_back( std::move( state ) );
+		m_Busy = false;
+		m_Condition.notify_all();
+	}
+}
+
+// Runs on the worker, or inline without threads. Leaves the previous newest state in state to be reused.
+void RewindBuffer::Store( std::vector<uint8_t>& state )
+{
+	Entry entry;
+	entry.keyFrame = m_Entries.empty() || m_Newest.size() != state.size() || m_DeltasSinceKeyFrame + 1 >= m_KeyFrameInterval;
+	if ( entry.keyFrame )
+	{
+		Encode<false>( state.data(), nullptr, state.size(), entry.data );
+		m_DeltasSinceKeyFrame = 0;
+	}
+	else
+	{
+		Encode<true>( state.data(), m_Newest.data(), state.size(), entry.data );
+		m_DeltasSinceKeyFrame++;
+	}
+	entry.data.shrink_to_fit();
+
+	m_Bytes += entry.data.size();
+	m_Entries.push_back( std::move( entry ) );
+	m_Newest.swap( state );
+	Evict();
+}
+
+// Drops whole groups from the oldest end, a delta is useless without the key frame before it.
+void RewindBuffer::Evict()
+{
+	while ( m_Entries.size() > m_MaxStates || m_Bytes > m_MemoryBudget )
+	{
+		size_t nextKeyFrame = 1;
+		while ( nextKeyFrame < m_Entries.size() && !m_Entries[ nextKeyFrame ].keyFrame )
+		{
+			nextKeyFrame++;
+		}
+		if ( nextKeyFrame == m_Entries.size() )
+		{
+			return;
+		}
+
+		for ( size_t i = 0; i < nextKeyFrame; i++ )
+		{
+			m_Bytes -= m_Entries.front().data.size();
+			m_Entries.pop_front();
+		}
+	}
+}
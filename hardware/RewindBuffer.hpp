@@ -0,0 +1,62 @@
+#ifndef REWIND_BUFFER_HPP
+#define REWIND_BUFFER_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Keeps the last few seconds of save states in a bounded amount of memory. Every keyFrameInterval states one is kept
+// whole and the ones in between as the XOR with the state before, both compressed by squeezing out the runs of zero
+// bytes. Most of the machine doesn't change from one frame to the next, so a delta is a few KB where a whole state is
+// hundreds. The emulation thread only copies the state out, the encoding runs on a worker thread.
+class RewindBuffer
+{
+public:
+	RewindBuffer() = default;
+	RewindBuffer( const RewindBuffer& other ) = delete;
+	RewindBuffer& operator=( const RewindBuffer& other ) = delete;
+	~RewindBuffer();
+
+	void Start( const size_t maxStates, const size_t memoryBudget, const uint32_t keyFrameInterval );
+	bool IsEnabled() const { return m_MaxStates > 0; }
+
+	// Takes the state to store, state is handed back an unused buffer so capturing doesn't allocate.
+	void Push( std::vector<uint8_t>& state );
+	// Drops the newest state and writes out the one before it, false once there's nothing older left.
+	bool Pop( std::vector<uint8_t>& state );
+
+private:
+	struct Entry
+	{
+		bool keyFrame;
+		std::vector<uint8_t> data;
+	};
+
+	void WorkerThread();
+	void Store( std::vector<uint8_t>& state );
+	void Evict();
+	void WaitForPending( std::unique_lock<std::mutex>& lock );
+
+	size_t m_MaxStates = 0;
+	size_t m_MemoryBudget = 0;
+	uint32_t m_KeyFrameInterval = 0;
+
+	// Only touched by whoever is encoding or decoding, the worker or a Pop that waited for it to go idle.
+	std::deque<Entry> m_Entries;
+	std::vector<uint8_t> m_Newest;
+	size_t m_Bytes = 0;
+	uint32_t m_DeltasSinceKeyFrame = 0;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Condition;
+	std::deque<std::vector<uint8_t>> m_Pending;
+	std::vector<std::vector<uint8_t>> m_FreeBuffers;
+	bool m_Busy = false;
+	bool m_Stop = false;
+	std::thread m_Worker;
+};
+
+#endif // REWIND_BUFFER_HPP
@@ -0,0 +1,58 @@
+#ifndef SERIALIZER_HPP
+#define SERIALIZER_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Walks the state of every component as a list of plain old data blocks, either to measure the size of a save state,
+// to copy the blocks into one or to copy them back out. Each component lists its blocks once in a Serialize function
+// so saving and loading can't get out of step.
+class Serializer
+{
+public:
+	enum class Mode { Size, Save, Load };
+
+	explicit Serializer( const Mode mode, uint8_t* data = nullptr )
+	: m_Mode( mode )
+	, m_Data( data )
+	{
+	}
+
+	template<typename T> void operator()( T& value )
+	{
+		static_assert( std::is_trivially_copyable<T>::value, "only plain old data can be serialized with memcpy" );
+		Block( &value, sizeof( value ) );
+	}
+
+	void Block( void* data, const size_t size )
+	{
+		if ( m_Mode == Mode::Save )
+		{
+			memcpy( m_Data + m_Offset, data, size );
+		}
+		else if ( m_Mode == Mode::Load )
+		{
+			memcpy( data, m_Data + m_Offset, size );
+		}
+		m_Offset += size;
+	}
+
+	// Hands out size bytes of the state for a component that copies its own state, null when only measuring.
+	uint8_t* Reserve( const size_t size )
+	{
+		uint8_t* reserved = m_Mode == Mode::Size ? nullptr : m_Data + m_Offset;
+		m_Offset += size;
+		return reserved;
+	}
+
+	Mode GetMode() const { return m_Mode; }
+	size_t GetOffset() const { return m_Offset; }
+
+private:
+	Mode m_Mode;
+	uint8_t* m_Data;
+	size_t m_Offset = 0;
+};
+
+#endif // SERIALIZER_HPP
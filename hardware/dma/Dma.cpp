@@ -1,5 +1,7 @@
 #include "Dma.hpp"
 #include "../hardware.hpp"
+#include "../IoRegisters.hpp"
+#include "../Serializer.hpp"
 
 static constexpr uint8_t TransferOffsetTable[ 8 ][ 4 ] = {
 	{ 0, 0, 0, 0 }, { 0, 1, 0, 1 }, { 0, 0, 0, 0 }, { 0, 0, 1, 1 },
@@ -20,8 +22,17 @@ DmaController::~DmaController()
 
 }
 
-void DmaController::Write( const uint32_t address, const uint8_t value )
+void DmaController::Serialize( Serializer& serializer )
 {
+	serializer( m_Channels );
+	serializer( m_hdmaChannels );
+}
+
+// Each register gets its own instantiation so the switch folds down to the one case it handles.
+template<uint32_t Address>
+void DmaController::Write( const uint8_t value )
+{
+	constexpr uint32_t address = Address;
 	{
 		switch ( address ) 
 		{
@@ -133,8 +144,10 @@ void DmaController::Write( const uint32_t address, const uint8_t value )
 	}
 }
 
-uint8_t DmaController::Read( const uint32_t address )
+template<uint32_t Address>
+uint8_t DmaController::Read()
 {
+	constexpr uint32_t address = Address;
 	switch ( address )
 	{
 	case 0x4300: case 0x4310: case 0x4320: case 0x4330: case 0x4340: case 0x4350: case 0x4360: case 0x4370:
@@ -221,6 +234,32 @@ uint8_t DmaController::Read( const uint32_t address )
 	return 0;
 }
 
+template<uint32_t Address>
+void DmaController::WriteRegister( void* dma, const uint32_t address, const uint8_t value )
+{
+	static_cast<DmaController*>( dma )->Write<Address>( value );
+}
+
+template<uint32_t Address>
+uint8_t DmaController::ReadRegister( void* dma, const uint32_t address )
+{
+	return static_cast<DmaController*>( dma )->Read<Address>();
+}
+
+template<uint32_t First, uint32_t... Offsets>
+void DmaController::MapRegisters( IoRegisters& registers, std::integer_sequence<uint32_t, Offsets...> )
+{
+	( registers.MapRead( First + Offsets, &DmaController::ReadRegister<First + Offsets>, this ), ... );
+	( registers.MapWrite( First + Offsets, &DmaController::WriteRegister<First + Offsets>, this ), ... );
+}
+
+void DmaController::MapRegisters( IoRegisters& registers )
+{
+	registers.MapWrite( 0x420B, &DmaController::WriteRegister<0x420B>, this );
+	registers.MapWrite( 0x420C, &DmaController::WriteRegister<0x420C>, this );
+	MapRegisters<0x4300>( registers, std::make_integer_sequence<uint32_t, 0x7B>() );
+}
+
 void DmaController::RunHdmaTransfer( DmaChannelConfig& channel )
 {
 	static constexpr uint8_t transferByteCountTable[ 8 ] = { 1, 2, 2, 4, 4, 4, 2, 4 };
@@ -2,6 +2,11 @@
 #define DMA_HPP
 
 #include <array>
+#include <cstdint>
+#include <utility>
+
+class IoRegisters;
+class Serializer;
 
 class DmaController
 {
@@ -31,6 +36,12 @@ private:
 		bool m_UnusedFlag = false;
 	};
 
+	template<uint32_t Address> void Write( const uint8_t value );
+	template<uint32_t Address> uint8_t Read();
+	template<uint32_t Address> static void WriteRegister( void* dma, const uint32_t address, const uint8_t value );
+	template<uint32_t Address> static uint8_t ReadRegister( void* dma, const uint32_t address );
+	template<uint32_t First, uint32_t... Offsets> void MapRegisters( IoRegisters& registers, std::integer_sequence<uint32_t, Offsets...> );
+
 	void RunDma( DmaChannelConfig& channel );
 	void CopyDmaByte( uint32_t addressBusA, uint16_t addressBusB, bool fromBtoA );
 	std::array< DmaChannelConfig, 8 > m_Channels;
@@ -40,8 +51,8 @@ private:
 		DmaController();
 		~DmaController();
 
-		void Write( const uint32_t address, const uint8_t value );
-		uint8_t Read( const uint32_t address );
+		void MapRegisters( IoRegisters& registers );
+		void Serialize( Serializer& serializer );
 
 		void InitHDMAChannels();
 		void ProcessHDMAChannels();
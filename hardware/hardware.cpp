@@ -1,5 +1,8 @@
 #include "hardware.hpp"
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <thread>
 #include "ppu/ppu.hpp"
 #ifdef __EMSCRIPTEN__
 #include <emscripten/emscripten.h>
@@ -174,9 +177,24 @@ extern "C"
 		Hardware::GetInstance().write8( address, value );
 	}
 
-	void doPPUFrame( void )
+	bool blockFill( const uint32_t address, const uint32_t size, const uint16_t value, const uint32_t width, const uint32_t instructionCount )
 	{
-		Hardware::GetInstance().DoPPUFrame();
+		return Hardware::GetInstance().BlockFill( address, size, value, width, instructionCount );
+	}
+
+	bool blockCopy( const uint32_t destination, const uint32_t source, const uint32_t size, const uint32_t instructionCount )
+	{
+		return Hardware::GetInstance().BlockCopy( destination, source, size, instructionCount );
+	}
+
+	bool waitForInterrupt( void )
+	{
+		return Hardware::GetInstance().WaitForInterrupt();
+	}
+
+	bool waitForSpcPort( void )
+	{
+		return Hardware::GetInstance().WaitForSpcPort();
 	}
 
 	
@@ -193,10 +211,16 @@ extern "C"
 
 void Hardware::incrementCycleCount( void )
 {
-	m_SPCTime += 5;
-	if ( m_SPCTime > 1024000 / 2 )
+	advanceSpcTime( SPC_CLOCKS_PER_ACCESS );
+}
+
+void Hardware::advanceSpcTime( const int32_t clocks )
+{
+	m_SPCTime += clocks;
+	if ( m_SPCTime > SPC_CLOCKS_PER_END_FRAME )
 	{
-		m_SPC.end_frame( 1024000 / 2 );
+		FrameProfiler::Scope scope( m_FrameProfiler, FrameProfiler::PHASE_SPC );
+		m_SPC.end_frame( SPC_CLOCKS_PER_END_FRAME );
 		m_SPCTime = 0;
 	}
 }
@@ -247,28 +271,101 @@ void Hardware::ProcessAutoJoyPadRead( void )
 	}
 }
 
-uint8_t Hardware::dspRead( const uint32_t addr )
+// The pads are sampled once a frame so the auto joypad read and any manual $4016/$4017 reads during the frame see
+// the same words, which is all an input movie has to store to replay a run exactly.
+void Hardware::LatchPads( void )
 {
-	return DSP1GetByte( addr );
+	InputMovie::Pads pads = {};
+	if ( m_InputMovie.IsPlaying() )
+	{
+		if ( !m_InputMovie.ReadFrame( pads ) )
+		{
+			std::cout << "Input movie ended after " << m_FrameCount << " frames" << std::endl;
+		}
+	}
+	else
+	{
+		for ( size_t port = 0; port < pads.size(); port++ )
+		{
+			pads[ port ] = m_KeyboardPads[ port ];
+		}
+	}
+
+	if ( m_InputMovie.IsRecording() )
+	{
+		m_InputMovie.WriteFrame( pads );
+	}
+
+	for ( size_t port = 0; port < pads.size(); port++ )
+	{
+		m_SnesControllers[ port ].SetPadState( pads[ port ] );
+	}
+}
+
+// $6000-$7fff of banks $00-$1f and $80-$9f, the DSP-1 only decodes up to $7001.
+// Only the accesses that run a command are timed, the rest just move a byte and would mostly time the clock.
+uint8_t Hardware::dspRead( const uint32_t address )
+{
+	const uint32_t bank_offset = address & 0xffff;
+	// Reading the last output byte of a raster command works out the next line.
+	const bool runsCommand = bank_offset < 0x7000 && DSP1.out_count == 1 && ( DSP1.command == 0x0a || DSP1.command == 0x1a );
+	FrameProfiler::Scope scope( m_FrameProfiler, FrameProfiler::PHASE_DSP, runsCommand );
+	return bank_offset <= 0x7001 ? DSP1GetByte( bank_offset ) : 0;
 }
 
-void Hardware::dspWrite( const uint32_t addr, const uint8_t data )
+void Hardware::dspWrite( const uint32_t address, const uint8_t value )
 {
-	DSP1SetByte( addr, data );
+	const uint32_t bank_offset = address & 0xffff;
+	// The last parameter byte runs the command.
+	const bool runsCommand = bank_offset < 0x7000 && !DSP1.waiting4command && DSP1.in_count == 1;
+	FrameProfiler::Scope scope( m_FrameProfiler, FrameProfiler::PHASE_DSP, runsCommand );
+	if ( bank_offset <= 0x7001 )
+	{
+		DSP1SetByte( bank_offset, value );
+	}
 }
 
-void Hardware::PowerOn()
+void Hardware::PowerOn( const Options& options )
 {
 	std::cout << "Reached Power On" << std::endl;
-	initialiseSDL();
+	m_Headless = options.headless;
+	m_FrameLimit = options.frames;
+	m_BenchmarkPath = options.benchmark;
+	m_RunAheadFrames = options.runAhead;
+	m_FrameSkip = options.frameSkip;
+	if ( options.rewindSeconds > 0 )
+	{
+		m_RewindBuffer.Start( options.rewindSeconds * 60, static_cast<size_t>( options.rewindMegabytes ) << 20, REWIND_KEY_FRAME_INTERVAL );
+	}
+	if ( !m_BenchmarkPath.empty() )
+	{
+		m_FrameProfiler.Enable( m_FrameLimit );
+	}
+	if ( !m_Headless )
+	{
+		initialiseSDL();
+	}
 
 	LoadRom( "Super Mario Kart (USA).sfc" );
 	std::cout << "Loaded Rom" << std::endl;
 	memset( m_wRam, 0x55, sizeof( m_wRam ) );
 	memset( m_sRam, 0xff, sizeof( m_sRam ) );
+	BuildBus();
+	MapIoRegisters();
 
 	m_SnesControllers.push_back( 0 );
 	m_SnesControllers.push_back( 1 );
+
+	if ( !options.recordMovie.empty() && !m_InputMovie.OpenForRecording( options.recordMovie ) )
+	{
+		std::cout << "Can't record input movie " << options.recordMovie << std::endl;
+		std::exit( EXIT_FAILURE );
+	}
+	if ( !options.playMovie.empty() && !m_InputMovie.OpenForPlayback( options.playMovie ) )
+	{
+		std::cout << "Can't play input movie " << options.playMovie << std::endl;
+		std::exit( EXIT_FAILURE );
+	}
  
 	m_SPC.init();
 	m_SPC.init_rom( IPL_ROM );
@@ -276,17 +373,52 @@ void Hardware::PowerOn()
 
 	ResetDSP();
 
-	ppufast.power( false );
+	uint32_t renderThreads = 0;
+	if ( options.renderThreads >= 0 )
+	{
+		renderThreads = options.renderThreads;
+	}
+	else if ( std::thread::hardware_concurrency() > 1 )
+	{
+		renderThreads = std::thread::hardware_concurrency() - 1;
+	}
+	PPUfast::Mode7Options mode7;
+	mode7.scale = options.mode7Scale;
+	mode7.perspective = options.mode7Perspective;
+	mode7.supersample = options.mode7Supersample;
+	ppufast.power( false, renderThreads, options.pipelineRendering, mode7 );
+	if ( !m_Headless )
+	{
+		ppufast.initOpenGL();
+	}
 
 	std::cout << "Reached Start!" << std::endl;
-	start();
 #ifdef __EMSCRIPTEN__
+	start();
 	emscripten_set_main_loop( ::mainLoopFunc, 60, 1 );
 #else
-	while ( 1 )
+	if ( m_Headless )
 	{
-		mainLoopFunc();
+		start();
+		while ( 1 )
+		{
+			mainLoopFunc();
+		}
 	}
+
+	// SDL wants the events handled on the thread that made the window, so the game moves to a thread of its own and
+	// this one stays behind to present. The emulation never waits on the driver and the driver never waits on it.
+	m_ThreadedPresentation = true;
+	std::thread emulation( [ this ]
+	{
+		start();
+		while ( 1 )
+		{
+			mainLoopFunc();
+		}
+	} );
+	emulation.detach();
+	PresentationLoop();
 #endif // __EMSCRIPTEN__
 
 	quit();
@@ -368,7 +500,45 @@ void Hardware::initialiseSDL()
 	SDL_GL_MakeCurrent( m_Window, m_GLContext );
 }
 
-void Hardware::quit()
+void Hardware::quit( int status )
+{
+	ppufast.stopRendering();
+	WriteCallProfile();
+	m_InputMovie.Close();
+
+	if ( m_FrameProfiler.IsEnabled() )
+	{
+		if ( m_FrameProfiler.WriteReport( m_BenchmarkPath ) )
+		{
+			std::cout << "Wrote benchmark results to " << m_BenchmarkPath << std::endl;
+		}
+		else
+		{
+			std::cout << "Can't write benchmark results to " << m_BenchmarkPath << std::endl;
+			status = EXIT_FAILURE;
+		}
+	}
+
+	if ( m_ThreadedPresentation )
+	{
+		// Only the emulation thread quits this way. The window belongs to the presentation thread, so hand it the
+		// status and stop here while it shuts the window down and exits.
+		m_ExitStatus = status;
+		while ( true )
+		{
+			std::this_thread::sleep_for( std::chrono::hours( 1 ) );
+		}
+	}
+
+	if ( !m_Headless )
+	{
+		ShutdownVideo();
+	}
+
+	std::exit( status );
+}
+
+void Hardware::ShutdownVideo()
 {
 	// Cleanup
 	ImGui_ImplOpenGL3_Shutdown();
@@ -378,268 +548,574 @@ void Hardware::quit()
 	SDL_GL_DeleteContext( m_GLContext );
 	SDL_DestroyWindow( m_Window );
 	SDL_Quit();
-
-	std::exit( EXIT_SUCCESS );
 }
 
-Hardware& Hardware::GetInstance()
+// Runs on the main thread for as long as the game runs on the emulation thread. Shows the newest finished frame
+// whenever there is one, frames it didn't get round to are dropped rather than holding the emulation up.
+void Hardware::PresentationLoop()
 {
-	static Hardware instance;
-	return instance;
+	while ( m_ExitStatus < 0 )
+	{
+		PollEvents();
+		if ( m_DebuggerActive.load( std::memory_order_acquire ) )
+		{
+			if ( DrawDebugger() )
+			{
+				m_DebuggerActive.store( false, std::memory_order_release );
+			}
+		}
+		else if ( !PresentFrame() )
+		{
+			std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+		}
+	}
+
+	ShutdownVideo();
+	std::exit( m_ExitStatus );
 }
 
-uint8_t Hardware::read8( const uint32_t address )
+// The emulation thread never touches SDL, it only sees the pads and keys sampled here.
+void Hardware::PollEvents()
 {
-	auto[ bank, bank_offset ] = getBankAndOffset( address );
-
-	if ( bank <= 0x3f && bank_offset <= 0x1fff )
+	SDL_Event event;
+	while ( SDL_PollEvent( &event ) )
 	{
-		return m_wRam[ 0x1fff & address ];
+		ImGui_ImplSDL2_ProcessEvent( &event );
+		if ( event.type == SDL_QUIT )
+		{
+			m_QuitRequested = true;
+		}
+		if ( event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID( m_Window ) )
+		{
+			m_QuitRequested = true;
+		}
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset >= 0x2140 && bank_offset <= 0x217F )
+
+	for ( size_t port = 0; port < m_KeyboardPads.size(); port++ )
 	{
-		return spcReadPort( bank_offset & 0x3 );
+		m_SnesControllers[ port ].UpdateKeyboardState();
+		m_KeyboardPads[ port ] = m_SnesControllers[ port ].ReadKeyboard();
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset == 0x2180 )
+
+	const uint8_t* keyboardState = SDL_GetKeyboardState( nullptr );
+	m_RewindHeld = keyboardState[ SDL_SCANCODE_BACKSPACE ] != 0;
+	m_FastForwardHeld = keyboardState[ SDL_SCANCODE_TAB ] != 0;
+}
+
+bool Hardware::PresentFrame()
+{
+	const VideoFrame* frame = m_FrameQueue.Acquire();
+	if ( frame == nullptr )
 	{
-		uint8_t value = m_wRam[ m_wRamPosition ];
-		m_wRamPosition = ( m_wRamPosition + 1 ) & 0x1FFFF;
-		return value;
+		return false;
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset == 0x4212 )
+
+	ppufast.present( *frame, m_Window );
+	return true;
+}
+
+// Write out the call counts gathered by a --profile-calls build for symbol_order to turn into a link order.
+void Hardware::WriteCallProfile()
+{
+	if ( profileFunctionCount == 0 )
 	{
-		// only thing that checks this register is inside irq to make sure it blocks until the next hblank. So due to way system is implemented
-		// we just return 0x40 indicating that hblank is set.
-		return 0x40;
+		return;
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && (bank_offset == 0x4016 || bank_offset ==0x4017)/*bank_offset >= 0x4016 && bank_offset <= 0x4017*/ )
+
+	std::ofstream callProfile( "smk_call_counts.txt" );
+	callProfile << "frames " << m_FrameCount << std::endl;
+	for ( uint32_t i = 0; i < profileFunctionCount; i++ )
 	{
-		uint8_t value = bank_offset == 0x4016 ? m_SnesControllers[0].read( 0x4016 ) : m_SnesControllers[ 1 ].read( 0x4017 );
-		return value;
+		callProfile << profileCallCounts[ i ] << " " << profileFunctionNames[ i ] << std::endl;
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset >= 0x4214 && bank_offset <= 0x421F )
-	{
-		switch ( bank_offset )
-		{
-		case 0x4214: return m_aluMulDivState.rddiv >> 0;  //RDDIVL
-		case 0x4215: return m_aluMulDivState.rddiv >> 8;  //RDDIVH
-		case 0x4216: return m_aluMulDivState.rdmpy >> 0;  //RDMPYL
-		case 0x4217: return m_aluMulDivState.rdmpy >> 8;  //RDMPYH
 
-		case 0x4218: return (uint8_t)m_InternalRegisterState.controllerData[ 0 ];
-		case 0x4219: return (uint8_t)( m_InternalRegisterState.controllerData[ 0 ] >> 8 );
-		case 0x421A: return (uint8_t)m_InternalRegisterState.controllerData[ 1 ];
-		case 0x421B: return (uint8_t)( m_InternalRegisterState.controllerData[ 1 ] >> 8 );
-		case 0x421C: return (uint8_t)m_InternalRegisterState.controllerData[ 2 ];
-		case 0x421D: return (uint8_t)( m_InternalRegisterState.controllerData[ 2 ] >> 8 );
-		case 0x421E: return (uint8_t)m_InternalRegisterState.controllerData[ 3 ];
-		case 0x421F: return (uint8_t)( m_InternalRegisterState.controllerData[ 3 ] >> 8 );
-		default: return 0;
-		}
+	std::cout << "Wrote call counts for " << profileFunctionCount << " functions to smk_call_counts.txt" << std::endl;
+}
+
+namespace
+{
+	void SaveSpcState( unsigned char** io, void* state, size_t size )
+	{
+		memcpy( *io, state, size );
+		*io += size;
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset >= 0x2104 && bank_offset <= 0x213f )
+
+	void LoadSpcState( unsigned char** io, void* state, size_t size )
 	{
-		uint8_t data = 0;
-		return ppufast.readIO( address, data );
+		memcpy( state, *io, size );
+		*io += size;
 	}
-	else if ( ( bank <= 0x1f || ( bank >= 0x80 && bank <= 0x9f ) ) && ( bank_offset >= 0x6000 && bank_offset <= 0x7001 ) )
+}
+
+size_t Hardware::GetStateSize()
+{
+	if ( m_StateSize == 0 )
 	{
-		return dspRead( address & 0xffff );
+		Serializer serializer( Serializer::Mode::Size );
+		Serialize( serializer );
+		m_StateSize = serializer.GetOffset();
 	}
-	else if ( ( ( bank >= 0x20 && bank <= 0x3f ) || ( bank >= 0xa0 && bank <= 0xbf ) ) && ( bank_offset >= 0x6000 && bank_offset <= 0x7fff ) )
+	return m_StateSize;
+}
+
+void Hardware::SaveState( std::vector<uint8_t>& state )
+{
+	state.resize( GetStateSize() );
+	Serializer serializer( Serializer::Mode::Save, state.data() );
+	Serialize( serializer );
+}
+
+void Hardware::LoadState( const std::vector<uint8_t>& state )
+{
+	assert( state.size() == GetStateSize() );
+	Serializer serializer( Serializer::Mode::Load, const_cast<uint8_t*>( state.data() ) );
+	Serialize( serializer );
+}
+
+void Hardware::Serialize( Serializer& serializer )
+{
+	serializer( m_wRam );
+	serializer( m_sRam );
+	serializer( m_wRamPosition );
+
+	serializer( A.w );
+	serializer( DB );
+	serializer( DP );
+	serializer( SP );
+	serializer( X );
+	serializer( Y );
+	serializer( P );
+	for ( bool* flag : { &CF, &ZF, &IF, &DF, &XF, &MF, &VF, &NF, &EF } )
 	{
-		const uint32_t offset = ( address & 0x7ff );
-		return m_sRam[ offset ];
+		serializer( *flag );
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset >= 0x4300 && bank_offset <= 0x437A )
+
+	serializer( m_aluMulDivState );
+	serializer( m_InternalRegisterState );
+	for ( auto& controller : m_SnesControllers )
 	{
-		return m_dmaController.Read( bank_offset );
+		controller.Serialize( serializer );
 	}
-	else if ( bank <= 0x1f && bank_offset >= 0x8000 && bank_offset <= 0xffff )
+
+	m_dmaController.Serialize( serializer );
+	ppufast.serialize( serializer );
+
+	// The spc saves its time relative to the start of its frame, so end the frame here and the time saved is 0.
+	if ( serializer.GetMode() == Serializer::Mode::Save )
 	{
-		return m_rom[ address & 0x7ffff ];
+		m_SPC.end_frame( m_SPCTime );
+		m_SPCTime = 0;
 	}
-	else if ( bank >= 0x20 && bank <= 0x3f && bank_offset <= 0x1fff )
+	serializer( m_SPCTime );
+	if ( unsigned char* spcState = serializer.Reserve( SNES_SPC::state_size ) )
 	{
-		return m_wRam[ 0x1fff & address ];
+		m_SPC.copy_state( &spcState, serializer.GetMode() == Serializer::Mode::Save ? SaveSpcState : LoadSpcState );
 	}
-	else if ( bank >= 0x20 && bank <= 0x3f && bank_offset >= 0x8000 && bank_offset <= 0xffff )
+
+	serializer( DSP1 );
+}
+
+Hardware& Hardware::GetInstance()
+{
+	static Hardware instance;
+	return instance;
+}
+
+// Point every 4KB page in [bankLow, bankHigh] x [offsetLow, offsetHigh] at memory. The host offset of an address is
+// ( address - base ) wrapped to memorySize, which covers the mirrors; memory smaller than a page (sram) repeats in it.
+void Hardware::MapBusMemory( const uint32_t bankLow, const uint32_t bankHigh, const uint32_t offsetLow, const uint32_t offsetHigh, int8_t* memory, const uint32_t memorySize, const uint32_t base, const bool writable )
+{
+	for ( uint32_t bank = bankLow; bank <= bankHigh; bank++ )
 	{
-		return m_rom[ address - 0x200000 ];
+		for ( uint32_t offset = offsetLow; offset <= offsetHigh; offset += BUS_PAGE_SIZE )
+		{
+			const uint32_t address = ( bank << 16 ) | offset;
+			BusPage page;
+			page.memory = memory + ( ( address - base ) & ( memorySize - 1 ) );
+			page.mask = std::min( memorySize, BUS_PAGE_SIZE ) - 1;
+			m_ReadPages[ address >> BUS_PAGE_SHIFT ] = page;
+			if ( writable )
+			{
+				m_WritePages[ address >> BUS_PAGE_SHIFT ] = page;
+			}
+		}
 	}
-	else if ( bank >= 0x40 && bank <= 0x7d && bank_offset <= 0xffff )
+}
+
+void Hardware::MapBusHandler( const uint32_t bankLow, const uint32_t bankHigh, const uint32_t offsetLow, const uint32_t offsetHigh, const BusHandler handler )
+{
+	for ( uint32_t bank = bankLow; bank <= bankHigh; bank++ )
 	{
-		return m_rom[ address - 0x400000 ];
+		for ( uint32_t offset = offsetLow; offset <= offsetHigh; offset += BUS_PAGE_SIZE )
+		{
+			const uint32_t address = ( bank << 16 ) | offset;
+			BusPage page;
+			page.handler = handler;
+			m_ReadPages[ address >> BUS_PAGE_SHIFT ] = page;
+			m_WritePages[ address >> BUS_PAGE_SHIFT ] = page;
+		}
 	}
-	else if ( bank >= 0x7e && bank <= 0x7f && bank_offset <= 0xffff )
+}
+
+// Build the read and write page tables read8/write8 dispatch through. Anything not mapped here is open bus, rom pages
+// only go in the read table so writes to them are dropped.
+void Hardware::BuildBus()
+{
+	m_BusHandlers[ BUS_HANDLER_OPEN ] = { &Hardware::openBusRead, &Hardware::openBusWrite };
+	m_BusHandlers[ BUS_HANDLER_IO ] = { &Hardware::ioRead, &Hardware::ioWrite };
+	m_BusHandlers[ BUS_HANDLER_DSP ] = { &Hardware::dspRead, &Hardware::dspWrite };
+
+	for ( uint32_t page = 0; page < BUS_PAGE_COUNT; page++ )
 	{
-		return m_wRam[ address - 0x7e0000 ];
+		m_ReadPages[ page ] = BusPage();
+		m_WritePages[ page ] = BusPage();
 	}
-	else if ( bank >= 0xc0 && bank <= 0xfd && bank_offset <= 0xffff )
+
+	const uint32_t romSize = sizeof( m_rom );
+	MapBusMemory( 0x00, 0x1f, 0x8000, 0xffff, m_rom, romSize, 0x000000, false );
+	MapBusMemory( 0x20, 0x3f, 0x8000, 0xffff, m_rom, romSize, 0x200000, false );
+	MapBusMemory( 0x40, 0x7d, 0x0000, 0xffff, m_rom, romSize, 0x400000, false );
+	MapBusMemory( 0x80, 0x9f, 0x8000, 0xffff, m_rom, romSize, 0x800000, false );
+	MapBusMemory( 0xc0, 0xfd, 0x0000, 0xffff, m_rom, romSize, 0xc00000, false );
+	MapBusMemory( 0xfe, 0xff, 0x0000, 0xffff, m_rom, romSize, 0xfe0000, false );
+
+	MapBusMemory( 0x7e, 0x7f, 0x0000, 0xffff, m_wRam, sizeof( m_wRam ), 0x7e0000, true );
+	for ( const auto&[ bankLow, bankHigh ] : { std::make_pair( 0x00u, 0x3fu ), std::make_pair( 0x80u, 0xbfu ) } )
 	{
-		return m_rom[ address - 0xc00000 ];
+		MapBusMemory( bankLow, bankHigh, 0x0000, 0x1fff, m_wRam, 0x2000, 0x000000, true );
+		MapBusHandler( bankLow, bankHigh, 0x2000, 0x2fff, BUS_HANDLER_IO );
+		MapBusHandler( bankLow, bankHigh, 0x4000, 0x4fff, BUS_HANDLER_IO );
 	}
-	else if ( bank >= 0xfe && bank <= 0xff && bank_offset <= 0xffff )
+
+	MapBusHandler( 0x00, 0x1f, 0x6000, 0x7fff, BUS_HANDLER_DSP );
+	MapBusHandler( 0x80, 0x9f, 0x6000, 0x7fff, BUS_HANDLER_DSP );
+	MapBusMemory( 0x20, 0x3f, 0x6000, 0x7fff, m_sRam, sizeof( m_sRam ), 0x000000, true );
+	MapBusMemory( 0xa0, 0xbf, 0x6000, 0x7fff, m_sRam, sizeof( m_sRam ), 0x000000, true );
+}
+
+uint8_t Hardware::read8( const uint32_t address )
+{
+	const BusPage& page = m_ReadPages[ ( address & 0xffffff ) >> BUS_PAGE_SHIFT ];
+	if ( page.memory )
 	{
-		return m_rom[ address - 0xfe0000 ];
+		return page.memory[ address & page.mask ];
 	}
-	else if ( bank >= 0x80 && bank <= 0x9f && bank_offset <= 0x1fff )
+
+	return ( this->*m_BusHandlers[ page.handler ].read )( address );
+}
+
+void Hardware::write8( const uint32_t address, const uint8_t value )
+{
+	const BusPage& page = m_WritePages[ ( address & 0xffffff ) >> BUS_PAGE_SHIFT ];
+	if ( page.memory )
 	{
-		return m_wRam[ 0x1fff & address ];
+		page.memory[ address & page.mask ] = value;
+		return;
 	}
-	else if ( bank >= 0x80 && bank <= 0x9f && bank_offset >= 0x8000 && bank_offset <= 0xffff )
+
+	( this->*m_BusHandlers[ page.handler ].write )( address, value );
+}
+
+uint8_t Hardware::openBusRead( const uint32_t address )
+{
+	return 0;
+}
+
+void Hardware::openBusWrite( const uint32_t address, const uint8_t value )
+{
+}
+
+// $2000-$2fff and $4000-$4fff of the system banks, decoded per register by the handlers in m_IoRegisters.
+uint8_t Hardware::ioRead( const uint32_t address )
+{
+	return m_IoRegisters.Read( address & 0xffff );
+}
+
+void Hardware::ioWrite( const uint32_t address, const uint8_t value )
+{
+	m_IoRegisters.Write( address & 0xffff, value );
+}
+
+// Registers decoded by the cpu side of the system: the spc ports, wram port, joypads, alu and interrupt control. The
+// ppu and dma controller map their own.
+void Hardware::MapIoRegisters()
+{
+	for ( uint32_t address = 0x2140; address <= 0x217f; address++ )
 	{
-		return m_rom[ address - 0x800000 ];
+		m_IoRegisters.MapRead( address, []( void* hardware, const uint32_t address ) -> uint8_t { return static_cast<Hardware*>( hardware )->spcReadPort( address & 0x3 ); }, this );
+		m_IoRegisters.MapWrite( address, []( void* hardware, const uint32_t address, const uint8_t value ) { static_cast<Hardware*>( hardware )->spcWritePort( address & 0x3, value ); }, this );
 	}
-	else if ( bank >= 0xa0 && bank <= 0xbf && bank_offset <= 0x1fff )
+
+	m_IoRegisters.MapRead( 0x2180, []( void* hardware, const uint32_t address ) -> uint8_t
 	{
-		return m_wRam[ 0x1fff & address ];
+		auto& self = *static_cast<Hardware*>( hardware );
+		uint8_t value = self.m_wRam[ self.m_wRamPosition ];
+		self.m_wRamPosition = ( self.m_wRamPosition + 1 ) & 0x1FFFF;
+		return value;
+	}, this );
+	m_IoRegisters.MapWrite( 0x2180, []( void* hardware, const uint32_t address, const uint8_t value )
+	{
+		auto& self = *static_cast<Hardware*>( hardware );
+		self.m_wRam[ self.m_wRamPosition ] = value;
+		self.m_wRamPosition = ( self.m_wRamPosition + 1 ) & 0x1FFFF;
+	}, this );
+	m_IoRegisters.MapWrite( 0x2181, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& self = *static_cast<Hardware*>( hardware ); self.m_wRamPosition = ( self.m_wRamPosition & 0x1FF00 ) | value; }, this );
+	m_IoRegisters.MapWrite( 0x2182, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& self = *static_cast<Hardware*>( hardware ); self.m_wRamPosition = ( self.m_wRamPosition & 0x100FF ) | ( value << 8 ); }, this );
+	m_IoRegisters.MapWrite( 0x2183, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& self = *static_cast<Hardware*>( hardware ); self.m_wRamPosition = ( self.m_wRamPosition & 0xFFFF ) | ( ( value & 0x01 ) << 16 ); }, this );
+
+	m_IoRegisters.MapRead( 0x4016, []( void* hardware, const uint32_t address ) -> uint8_t { return static_cast<Hardware*>( hardware )->m_SnesControllers[ 0 ].read( 0x4016 ); }, this );
+	m_IoRegisters.MapRead( 0x4017, []( void* hardware, const uint32_t address ) -> uint8_t { return static_cast<Hardware*>( hardware )->m_SnesControllers[ 1 ].read( 0x4017 ); }, this );
+	m_IoRegisters.MapWrite( 0x4016, []( void* hardware, const uint32_t address, const uint8_t value )
+	{
+		for ( auto& controller : static_cast<Hardware*>( hardware )->m_SnesControllers )
+		{
+			controller.write( 0x4016, value );
+		}
+	}, this );
+
+	m_IoRegisters.MapWrite( 0x4200, []( void* hardware, const uint32_t address, const uint8_t value )
+	{
+		auto& registerState = static_cast<Hardware*>( hardware )->m_InternalRegisterState;
+		registerState.enableNmi = ( value & 0x80 ) != 0;
+		registerState.enableVerticalIrq = ( value & 0x20 ) != 0;
+		registerState.enableHorizontalIrq = ( value & 0x10 ) != 0;
+		registerState.enableAutoJoypadRead = ( value & 0x01 ) != 0;
+	}, this );
+	m_IoRegisters.MapWrite( 0x4201, []( void* hardware, const uint32_t address, const uint8_t value ) { static_cast<Hardware*>( hardware )->m_InternalRegisterState.ioPortOutput = value; }, this );
+	m_IoRegisters.MapWrite( 0x4207, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& registerState = static_cast<Hardware*>( hardware )->m_InternalRegisterState; registerState.horizontalTimer = ( registerState.horizontalTimer & 0x100 ) | value; }, this );
+	m_IoRegisters.MapWrite( 0x4208, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& registerState = static_cast<Hardware*>( hardware )->m_InternalRegisterState; registerState.horizontalTimer = ( registerState.horizontalTimer & 0xFF ) | ( ( value & 0x01 ) << 8 ); }, this );
+	m_IoRegisters.MapWrite( 0x4209, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& registerState = static_cast<Hardware*>( hardware )->m_InternalRegisterState; registerState.verticalTimer = ( registerState.verticalTimer & 0x100 ) | value; }, this );
+	m_IoRegisters.MapWrite( 0x420A, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& registerState = static_cast<Hardware*>( hardware )->m_InternalRegisterState; registerState.verticalTimer = ( registerState.verticalTimer & 0xFF ) | ( ( value & 0x01 ) << 8 ); }, this );
+
+	// only thing that checks this register is inside irq to make sure it blocks until the next hblank. So due to way system is implemented
+	// we just return 0x40 indicating that hblank is set.
+	m_IoRegisters.MapRead( 0x4212, []( void* hardware, const uint32_t address ) -> uint8_t { return 0x40; }, this );
+
+	//WRMPYA
+	m_IoRegisters.MapWrite( 0x4202, []( void* hardware, const uint32_t address, const uint8_t value ) { static_cast<Hardware*>( hardware )->m_aluMulDivState.wrmpya = value; }, this );
+	//WRMPYB
+	m_IoRegisters.MapWrite( 0x4203, []( void* hardware, const uint32_t address, const uint8_t value )
+	{
+		auto& aluMulDivState = static_cast<Hardware*>( hardware )->m_aluMulDivState;
+		aluMulDivState.rdmpy = 0;
+
+		aluMulDivState.wrmpyb = value;
+		aluMulDivState.rddiv = aluMulDivState.wrmpyb << 8 | aluMulDivState.wrmpya;
+
+		aluMulDivState.rdmpy = aluMulDivState.wrmpya * aluMulDivState.wrmpyb;
+	}, this );
+	//WRDIVL
+	m_IoRegisters.MapWrite( 0x4204, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& aluMulDivState = static_cast<Hardware*>( hardware )->m_aluMulDivState; aluMulDivState.wrdiva = aluMulDivState.wrdiva & 0xff00 | value << 0; }, this );
+	//WRDIVH
+	m_IoRegisters.MapWrite( 0x4205, []( void* hardware, const uint32_t address, const uint8_t value ) { auto& aluMulDivState = static_cast<Hardware*>( hardware )->m_aluMulDivState; aluMulDivState.wrdiva = aluMulDivState.wrdiva & 0x00ff | value << 8; }, this );
+	//WRDIVB
+	m_IoRegisters.MapWrite( 0x4206, []( void* hardware, const uint32_t address, const uint8_t value )
+	{
+		auto& aluMulDivState = static_cast<Hardware*>( hardware )->m_aluMulDivState;
+		aluMulDivState.rdmpy = aluMulDivState.wrdiva;
+		aluMulDivState.wrdivb = value;
+
+		if ( aluMulDivState.wrdivb )
+		{
+			aluMulDivState.rddiv = aluMulDivState.wrdiva / aluMulDivState.wrdivb;
+			aluMulDivState.rdmpy = aluMulDivState.wrdiva % aluMulDivState.wrdivb;
+		}
+		else
+		{
+			aluMulDivState.rddiv = 0xffff;
+			aluMulDivState.rdmpy = aluMulDivState.wrdiva;
+		}
+	}, this );
+
+	m_IoRegisters.MapRead( 0x4214, []( void* hardware, const uint32_t address ) -> uint8_t { return static_cast<Hardware*>( hardware )->m_aluMulDivState.rddiv >> 0; }, this );  //RDDIVL
+	m_IoRegisters.MapRead( 0x4215, []( void* hardware, const uint32_t address ) -> uint8_t { return static_cast<Hardware*>( hardware )->m_aluMulDivState.rddiv >> 8; }, this );  //RDDIVH
+	m_IoRegisters.MapRead( 0x4216, []( void* hardware, const uint32_t address ) -> uint8_t { return static_cast<Hardware*>( hardware )->m_aluMulDivState.rdmpy >> 0; }, this );  //RDMPYL
+	m_IoRegisters.MapRead( 0x4217, []( void* hardware, const uint32_t address ) -> uint8_t { return static_cast<Hardware*>( hardware )->m_aluMulDivState.rdmpy >> 8; }, this );  //RDMPYH
+
+	// $4218-$421f, low then high byte of each controller:
+	for ( uint32_t address = 0x4218; address <= 0x421F; address++ )
+	{
+		m_IoRegisters.MapRead( address, []( void* hardware, const uint32_t address ) -> uint8_t
+		{
+			const auto controllerData = static_cast<Hardware*>( hardware )->m_InternalRegisterState.controllerData[ ( address - 0x4218 ) >> 1 ];
+			return (uint8_t)( controllerData >> ( ( address & 1 ) * 8 ) );
+		}, this );
 	}
 
-	return 0;
+	ppufast.mapIO( m_IoRegisters );
+	m_dmaController.MapRegisters( m_IoRegisters );
 }
 
-void Hardware::write8( const uint32_t address, const uint8_t value )
+// Returns a pointer to size bytes of contiguous work ram starting at address, or nullptr if any of them map elsewhere.
+int8_t* Hardware::GetWRamPointer( const uint32_t address, const uint32_t size )
 {
 	auto[ bank, bank_offset ] = getBankAndOffset( address );
 
-	if ( bank <= 0x3f && bank_offset <= 0x1fff )
+	if ( bank >= 0x7e && bank <= 0x7f )
 	{
-		m_wRam[ 0x1fff & address ] = value;
+		const uint32_t offset = address - 0x7e0000;
+		return offset + size <= sizeof( m_wRam ) ? &m_wRam[ offset ] : nullptr;
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset >= 0x2140 && bank_offset <= 0x217F )
+	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset + size <= 0x2000 )
 	{
-		spcWritePort( bank_offset & 0x3, value );
+		return &m_wRam[ bank_offset ];
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && ( bank_offset >= 0x2180 && bank_offset <= 0x2183 ) )
-	{
-		switch ( address & 0xFFFF ) {
-		case 0x2180:
-			m_wRam[ m_wRamPosition ] = value;
-			m_wRamPosition = ( m_wRamPosition + 1 ) & 0x1FFFF;
-			break;
 
-		case 0x2181: m_wRamPosition = ( m_wRamPosition & 0x1FF00 ) | value; break;
-		case 0x2182: m_wRamPosition = ( m_wRamPosition & 0x100FF ) | ( value << 8 ); break;
-		case 0x2183: m_wRamPosition = ( m_wRamPosition & 0xFFFF ) | ( ( value & 0x01 ) << 16 ); break;
-		}
+	return nullptr;
+}
+
+// As above but also allows rom. Reads wrap within the bank so the range must not cross one.
+const int8_t* Hardware::GetReadPointer( const uint32_t address, const uint32_t size )
+{
+	auto[ bank, bank_offset ] = getBankAndOffset( address );
+
+	if ( bank_offset + size > 0x10000 )
+	{
+		return nullptr;
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset >= 0x2100 && bank_offset <= 0x2133 )
+	else if ( bank <= 0x1f && bank_offset >= 0x8000 )
 	{
-		ppufast.writeIO( address, value );
+		return &m_rom[ address & 0x7ffff ];
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && ( bank_offset >= 0x4202 && bank_offset <= 0x4206 ) )
+	else if ( bank >= 0xc0 && bank <= 0xfd && address - 0xc00000 + size <= sizeof( m_rom ) )
 	{
-		switch ( bank_offset )
-		{
-		case 0x4202:  //WRMPYA
-			m_aluMulDivState.wrmpya = value;
-			return;
-
-		case 0x4203:  //WRMPYB
-			m_aluMulDivState.rdmpy = 0;
-
-			m_aluMulDivState.wrmpyb = value;
-			m_aluMulDivState.rddiv = m_aluMulDivState.wrmpyb << 8 | m_aluMulDivState.wrmpya;
-
-			m_aluMulDivState.rdmpy = m_aluMulDivState.wrmpya * m_aluMulDivState.wrmpyb;
-			return;
-
-		case 0x4204:  //WRDIVL
-			m_aluMulDivState.wrdiva = m_aluMulDivState.wrdiva & 0xff00 | value << 0;
-			return;
+		return &m_rom[ address - 0xc00000 ];
+	}
 
-		case 0x4205:  //WRDIVH
-			m_aluMulDivState.wrdiva = m_aluMulDivState.wrdiva & 0x00ff | value << 8;
-			return;
+	return GetWRamPointer( address, size );
+}
 
-		case 0x4206:  //WRDIVB
-			m_aluMulDivState.rdmpy = m_aluMulDivState.wrdiva;
-			m_aluMulDivState.wrdivb = value;
+bool Hardware::BlockFill( const uint32_t address, const uint32_t size, const uint16_t value, const uint32_t width, const uint32_t instructionCount )
+{
+	auto destination = GetWRamPointer( address, size );
+	if ( !destination )
+	{
+		return false;
+	}
 
-			if ( m_aluMulDivState.wrdivb )
-			{
-				m_aluMulDivState.rddiv = m_aluMulDivState.wrdiva / m_aluMulDivState.wrdivb;
-				m_aluMulDivState.rdmpy = m_aluMulDivState.wrdiva % m_aluMulDivState.wrdivb;
-			}
-			else
-			{
-				m_aluMulDivState.rddiv = 0xffff;
-				m_aluMulDivState.rdmpy = m_aluMulDivState.wrdiva;
-			}
-			return;
-		default:
-			return;
-		}
+	if ( width == 1 )
+	{
+		memset( destination, value & 0xff, size );
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && ( bank_offset == 0x4016 /*|| bank_offset == 0x4017*/ )/*bank_offset >= 0x4016 && bank_offset <= 0x4017*/ )
+	else
 	{
-		for ( auto& controller : m_SnesControllers )
+		for ( uint32_t i = 0; i + 1 < size; i += 2 )
 		{
-			controller.write( bank_offset, value );
+			destination[ i ] = value & 0xff;
+			destination[ i + 1 ] = value >> 8;
 		}
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && bank_offset >= 0x4200 && bank_offset <= 0x420A )
+
+	// Keep the spc in step with the instructions the loop would have executed:
+	for ( uint32_t i = 0; i < instructionCount; i++ )
 	{
-		switch ( bank_offset )
-		{
-		case 0x4200:
-			m_InternalRegisterState.enableNmi = ( value & 0x80 ) != 0;
-			m_InternalRegisterState.enableVerticalIrq = ( value & 0x20 ) != 0;
-			m_InternalRegisterState.enableHorizontalIrq = ( value & 0x10 ) != 0;
-			m_InternalRegisterState.enableAutoJoypadRead = ( value & 0x01 ) != 0;
-			break;
-		case 0x4201:
-			m_InternalRegisterState.ioPortOutput = value;
-			break;
-		case 0x4207: m_InternalRegisterState.horizontalTimer = ( m_InternalRegisterState.horizontalTimer & 0x100 ) | value; break;
-		case 0x4208: m_InternalRegisterState.horizontalTimer = ( m_InternalRegisterState.horizontalTimer & 0xFF ) | ( ( value & 0x01 ) << 8 ); break;
+		incrementCycleCount();
+	}
+	return true;
+}
 
-		case 0x4209: m_InternalRegisterState.verticalTimer = ( m_InternalRegisterState.verticalTimer & 0x100 ) | value; break;
-		case 0x420A: m_InternalRegisterState.verticalTimer = ( m_InternalRegisterState.verticalTimer & 0xFF ) | ( ( value & 0x01 ) << 8 ); break;
-		}
+bool Hardware::BlockCopy( const uint32_t destination, const uint32_t source, const uint32_t size, const uint32_t instructionCount )
+{
+	auto destinationPtr = GetWRamPointer( destination, size );
+	auto sourcePtr = GetReadPointer( source, size );
+	if ( !destinationPtr || !sourcePtr || ( sourcePtr < destinationPtr + size && destinationPtr < sourcePtr + size ) )
+	{
+		return false;
 	}
-	else if ( ( bank <= 0x3f || ( bank >= 0x80 && bank <= 0xbf ) ) && ( bank_offset == 0x420B || bank_offset == 0x420C || ( bank_offset >= 0x4300 && bank_offset <= 0x437A ) ) )
+
+	memcpy( destinationPtr, sourcePtr, size );
+
+	for ( uint32_t i = 0; i < instructionCount; i++ )
+	{
+		incrementCycleCount();
+	}
+	return true;
+}
+
+void Hardware::DoPPUFrame()
+{
+	// Frames emulated ahead are rolled back, they keep the pads of the real frame and don't count.
+	if ( !m_RunningAhead )
 	{
-		m_dmaController.Write( bank_offset, value );
+		PaceFrame();
+		m_FrameProfiler.NextFrame();
+		LatchPads();
+		m_FrameCount++;
 	}
-	else if ( ( bank <= 0x1f || ( bank >= 0x80 && bank <= 0x9f ) ) && ( bank_offset >= 0x6000 && bank_offset <= 0x7001 ) )
+	// Frames that aren't drawn still run HDMA and the IRQ, and the debugger draws over the window itself.
+	const bool render = m_RenderFrame && !m_SkipFrame && m_RenderSnesOutputToScreen;
+	ppufast.doFrame( m_dmaController, m_InternalRegisterState, m_FrameProfiler, render, m_Headless ? nullptr : &m_FrameQueue );
+	if ( !m_RunningAhead && m_FrameLimit && m_FrameCount >= m_FrameLimit )
 	{
-		dspWrite( address & 0xffff, value );
+		std::cout << "Ran " << m_FrameCount << " frames" << std::endl;
+		quit( EXIT_SUCCESS );
 	}
-	else if ( ( ( bank >= 0x20 && bank <= 0x3f ) || ( bank >= 0xa0 && bank <= 0xbf ) ) && ( bank_offset >= 0x6000 && bank_offset <= 0x7fff ) )
+	if ( m_InternalRegisterState.enableAutoJoypadRead )
 	{
-		const uint32_t offset = ( address & 0x7ff );
-		m_sRam[ offset ] = value;
+		ProcessAutoJoyPadRead();
 	}
-	else if ( bank >= 0x20 && bank <= 0x3f && bank_offset <= 0x1fff )
+}
+
+// Without vsync holding it back the emulation thread keeps to 60 frames a second on its own clock. It sleeps until just
+// before the frame is due and spins the rest, a sleep alone oversleeps by a millisecond or more on most systems. Once
+// it's more than a few frames late, after the debugger or a hitch, the clock starts again instead of rushing to catch up.
+void Hardware::PaceFrame()
+{
+	if ( !m_ThreadedPresentation || m_FastForward )
 	{
-		m_wRam[ 0x1fff & address ] = value;
+		return;
 	}
-	else if ( bank >= 0x7e && bank <= 0x7f && bank_offset <= 0xffff )
+
+	const auto now = std::chrono::steady_clock::now();
+	if ( now - m_NextFrameTime > FRAME_DURATION * 4 )
 	{
-		m_wRam[ address - 0x7e0000 ] = value;
+		m_NextFrameTime = now;
 	}
-	else if ( bank >= 0x80 && bank <= 0x9f && bank_offset <= 0x1fff )
+
+	const auto sleepUntil = m_NextFrameTime - std::chrono::milliseconds( 1 );
+	if ( now < sleepUntil )
 	{
-		m_wRam[ 0x1fff & address ] = value;
+		std::this_thread::sleep_until( sleepUntil );
 	}
-	else if ( bank >= 0xa0 && bank <= 0xbf && bank_offset <= 0x1fff )
+	while ( std::chrono::steady_clock::now() < m_NextFrameTime )
 	{
-		m_wRam[ 0x1fff & address ] = value;
+		std::this_thread::yield();
 	}
+	m_NextFrameTime += FRAME_DURATION;
 }
 
-void Hardware::DoPPUFrame()
+// Idle loops and WAI end up here. The next event is the end of the frame, so run it and report whether
+// the recompiled code should service an nmi.
+bool Hardware::WaitForInterrupt()
 {
-	if ( m_RenderSnesOutputToScreen )
+	DoPPUFrame();
+	return m_InternalRegisterState.enableNmi;
+}
+
+// Loops polling the spc ports only need the spc to run until one of them changes. The spc is run a poll interval at a
+// time and the ports checked in between, so the loop sees the change at most that late. If it doesn't answer within a
+// frame treat the loop as waiting on an interrupt instead so the frame still advances.
+bool Hardware::WaitForSpcPort()
+{
+	int32_t ports[ 4 ];
+	for ( int32_t port = 0; port < 4; port++ )
 	{
-		ppufast.doFrame( m_dmaController, m_InternalRegisterState, m_RenderSnesOutputToScreen ? m_Window : nullptr );
+		ports[ port ] = m_SPC.read_port( m_SPCTime, port );
 	}
-	if ( m_InternalRegisterState.enableAutoJoypadRead )
+
+	for ( int32_t clocks = 0; clocks < SPC_CLOCKS_PER_FRAME; clocks += SPC_PORT_POLL_CLOCKS )
 	{
-		ProcessAutoJoyPadRead();
+		advanceSpcTime( SPC_PORT_POLL_CLOCKS );
+		for ( int32_t port = 0; port < 4; port++ )
+		{
+			if ( m_SPC.read_port( m_SPCTime, port ) != ports[ port ] )
+			{
+				return false;
+			}
+		}
 	}
+
+	return WaitForInterrupt();
 }
 
 void Hardware::UpdateInstructionOutput( const uint32_t pc, const char* instructionString )
@@ -655,12 +1131,18 @@ void Hardware::UpdateInstructionOutput( const uint32_t pc, const char* instructi
 
 void Hardware::Panic( void )
 {
+	if ( m_Headless )
+	{
+		std::cout << "Exited with error after " << m_FrameCount << " frames" << std::endl;
+		quit( EXIT_FAILURE );
+	}
+
 	m_AutoStepDebug = false;
 	m_DoDebugRender = true;
 	m_RenderSnesOutputToScreen = false;
 	romCycle();
 	std::cout << "Exited with error" << std::endl;
-	std::exit( EXIT_FAILURE );
+	quit( EXIT_FAILURE );
 }
 
 void mainLoopFunc()
@@ -670,163 +1152,261 @@ void mainLoopFunc()
 
 void Hardware::mainLoopFunc( void )
 {
-	SDL_Event event;
-	while ( SDL_PollEvent( &event ) )
+	// Without threads the events are handled and the frame presented here between passes. Without a window there are
+	// no events and no keyboard state, the pads only come from an input movie.
+	if ( !m_Headless && !m_ThreadedPresentation )
 	{
-		ImGui_ImplSDL2_ProcessEvent( &event );
-		if ( event.type == SDL_QUIT )
+		PollEvents();
+	}
+	if ( m_QuitRequested )
+	{
+		quit();
+	}
+
+	// A movie has to see every frame once, so there's no rewinding while recording or playing one.
+	const bool movieActive = m_InputMovie.IsRecording() || m_InputMovie.IsPlaying();
+	if ( m_RewindBuffer.IsEnabled() && !movieActive && m_RewindHeld )
+	{
+		Rewind();
+	}
+	else
+	{
+		UpdateFrameSkip();
+		if ( m_RunAheadFrames > 0 )
 		{
-			quit();
+			RunAhead();
 		}
-		if ( event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID( m_Window ) )
+		else
 		{
-			quit();
+			mainLoop();
+		}
+
+		if ( m_RewindBuffer.IsEnabled() )
+		{
+			SaveState( m_RewindState );
+			m_RewindBuffer.Push( m_RewindState );
 		}
 	}
 
-	for ( auto& controller : m_SnesControllers )
+	if ( !m_Headless && !m_ThreadedPresentation )
+	{
+		PresentFrame();
+	}
+}
+
+// Holding tab fast forwards as fast as the machine can go. The frames aren't paced and only one every 1/60s is drawn,
+// the presentation thread couldn't show the rest anyway, otherwise --frame-skip decides.
+void Hardware::UpdateFrameSkip()
+{
+	m_FastForward = m_FastForwardHeld;
+	if ( m_FastForward )
+	{
+		const auto now = std::chrono::steady_clock::now();
+		m_SkipFrame = now - m_LastPresent < std::chrono::microseconds( 1000000 / 60 );
+		if ( !m_SkipFrame )
+		{
+			m_LastPresent = now;
+		}
+	}
+	else
 	{
-		controller.UpdateKeyboardState();
+		m_SkipFrame = m_FrameSkip > 0 && m_PassCount % ( m_FrameSkip + 1 ) != 0;
 	}
+	m_PassCount++;
+}
 
+// Step back to the state before the newest one and run a pass from it to have something to show. That pass isn't
+// stored, so holding backspace keeps going back one pass at a time until the oldest state.
+void Hardware::Rewind()
+{
+	if ( m_RewindBuffer.Pop( m_RewindState ) )
+	{
+		LoadState( m_RewindState );
+		mainLoop();
+	}
+}
+
+// The game only reacts to a button a frame or two after it is latched. Run the real pass of the main loop without
+// drawing it, save the state, emulate the passes the game lags by with the same pads, show the last one and roll
+// back. Each pass is normally one frame, the passes ahead only draw the last frame and the roll back is two memcpys
+// of the state. Saving between mainLoop calls is what keeps the native stack out of the state.
+void Hardware::RunAhead()
+{
+	m_RenderFrame = false;
 	mainLoop();
+	SaveState( m_RunAheadState );
+
+	m_RunningAhead = true;
+	for ( uint32_t frame = 1; frame <= m_RunAheadFrames; frame++ )
+	{
+		m_RenderFrame = frame == m_RunAheadFrames;
+		mainLoop();
+	}
+	m_RunningAhead = false;
+	m_RenderFrame = true;
+
+	LoadState( m_RunAheadState );
 }
 
 void Hardware::RomCycle()
 {
 	incrementCycleCount();
-	if ( !m_RenderSnesOutputToScreen )
+	if ( !m_RenderSnesOutputToScreen && !m_Headless )
 	{
-		ImGuiIO& io = ImGui::GetIO();
-
-		ImVec4 clear_color = ImVec4( 0.45f, 0.55f, 0.60f, 1.00f );
+		m_ScrollTraceToBottom = true;
+		if ( m_ThreadedPresentation )
+		{
+			// The presentation thread draws the debugger while this thread waits, so the registers and memory it shows
+			// hold still and whatever it changes is seen once this carries on.
+			if ( m_DoDebugRender )
+			{
+				m_DebuggerActive.store( true, std::memory_order_release );
+				while ( m_DebuggerActive.load( std::memory_order_acquire ) )
+				{
+					if ( m_QuitRequested )
+					{
+						quit();
+					}
+					std::this_thread::yield();
+				}
+			}
+			return;
+		}
 
-		bool scrollToBottom = true;
 		bool done = false;
 		while ( m_DoDebugRender && !done )
 		{
-			SDL_Event event;
-			while ( SDL_PollEvent( &event ) )
+			PollEvents();
+			if ( m_QuitRequested )
 			{
-				ImGui_ImplSDL2_ProcessEvent( &event );
-				if ( event.type == SDL_QUIT )
-					quit();
-				if ( event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID( m_Window ) )
-					quit();
+				quit();
 			}
+			done = DrawDebugger();
+		}
+	}
+}
 
-			// Start the Dear ImGui frame
-			ImGui_ImplOpenGL3_NewFrame();
-			ImGui_ImplSDL2_NewFrame( m_Window );
-			ImGui::NewFrame();
-			{
-				ImGui::Begin( "Register Status" );
-				ImGui::Text( "A = 0x%04hX", A.w );
-				ImGui::Text( "X = 0x%04hX", X );
-				ImGui::Text( "Y = 0x%04hX", Y );
-				ImGui::Text( "DB = 0x%02hhX", DB );
-				ImGui::Text( "DP = 0x%04hX", DP );
-				ImGui::Text( "SP = 0x%04hX", SP );
-
-				ImGui::Text( "P = %c%c%c%c%c%c%c%c", NF ? 'N' : 'n', VF ? 'V' : 'v', MF ? 'M' : 'm',
-					XF ? 'X' : 'x', DF ? 'D' : 'd', IF ? 'I' : 'i',
-					ZF ? 'Z' : 'z', CF ? 'C' : 'c' );
-
-				done = m_AutoStepDebug;
-				if ( ImGui::Button( "Single Step" ) )
-				{
-					done = true;
-				}
+// Draws one frame of the debugger, true once it should carry on to the next instruction.
+bool Hardware::DrawDebugger()
+{
+	ImGuiIO& io = ImGui::GetIO();
 
-				if ( ImGui::Button( "Auto Step" ) )
-				{
-					m_AutoStepDebug = !m_AutoStepDebug;
-					done = m_AutoStepDebug;
-				}
+	ImVec4 clear_color = ImVec4( 0.45f, 0.55f, 0.60f, 1.00f );
 
-				if ( ImGui::Button( "Continue" ) )
-				{
-					m_AutoStepDebug = true;
-					done = true;
-					m_DoDebugRender = false;
-					m_RenderSnesOutputToScreen = true;
-				}
+	bool done = false;
 
-				ImGui::End();
-			}
+	// Start the Dear ImGui frame
+	ImGui_ImplOpenGL3_NewFrame();
+	ImGui_ImplSDL2_NewFrame( m_Window );
+	ImGui::NewFrame();
+	{
+		ImGui::Begin( "Register Status" );
+		ImGui::Text( "A = 0x%04hX", A.w );
+		ImGui::Text( "X = 0x%04hX", X );
+		ImGui::Text( "Y = 0x%04hX", Y );
+		ImGui::Text( "DB = 0x%02hhX", DB );
+		ImGui::Text( "DP = 0x%04hX", DP );
+		ImGui::Text( "SP = 0x%04hX", SP );
 
-			{
-				ImGui::Begin( "wRam" );
-				m_MemoryEditor.DrawContents( m_wRam, sizeof( m_wRam ), static_cast<size_t>( 0x7E0000 ) );
-				ImGui::End();
-			}
+		ImGui::Text( "P = %c%c%c%c%c%c%c%c", NF ? 'N' : 'n', VF ? 'V' : 'v', MF ? 'M' : 'm',
+			XF ? 'X' : 'x', DF ? 'D' : 'd', IF ? 'I' : 'i',
+			ZF ? 'Z' : 'z', CF ? 'C' : 'c' );
 
-			{
-				ImGui::Begin( "rom" );
-				m_MemoryEditor.DrawContents( m_rom, sizeof( m_rom ) );
-				ImGui::End();
-			}
+		done = m_AutoStepDebug;
+		if ( ImGui::Button( "Single Step" ) )
+		{
+			done = true;
+		}
 
-			{
-				ImGui::Begin( "Instruction Trace" );
-				ImGui::Columns( 11, "Instruction Trace columns" );
-				ImGui::Separator();
-				ImGui::SetColumnWidth( -1, 60.0f );
-				ImGui::Text( "A" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 60.0f );
-				ImGui::Text( "X" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 60.0f );
-				ImGui::Text( "Y" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 50.0f );
-				ImGui::Text( "DB" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 60.0f );
-				ImGui::Text( "DP" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 50.0f );
-				ImGui::Text( "PB" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 60.0f );
-				ImGui::Text( "SP" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 75.0f );
-				ImGui::Text( "P" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 75.0f );
-				ImGui::Text( "PC" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 350.0f );
-				ImGui::Text( "Instruction" ); ImGui::NextColumn();
-				ImGui::SetColumnWidth( -1, 150.0f );
-				ImGui::Text( "Implemented" ); ImGui::NextColumn();
-				ImGui::Separator();
-				for ( auto&[ pc, instructionString, rs ] : m_InstructionTrace )
-				{
-					ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.A ); ImGui::NextColumn();
-					ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.X ); ImGui::NextColumn();
-					ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.Y ); ImGui::NextColumn();
-					ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%02hhX", rs.DB ); ImGui::NextColumn();
-					ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.DP ); ImGui::NextColumn();
-					ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.SP ); ImGui::NextColumn();
-					ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "%c%c%c%c%c%c%c%c", rs.NF ? 'N' : 'n', rs.VF ? 'V' : 'v', rs.MF ? 'M' : 'm',
-						rs.XF ? 'X' : 'x', rs.DF ? 'D' : 'd', rs.IF ? 'I' : 'i',
-						rs.ZF ? 'Z' : 'z', rs.CF ? 'C' : 'c' ); ImGui::NextColumn();
-					ImGui::TextColored( ImVec4( 1.0f, 1.0f, 0.0f, 1.0f ), "$%06X", pc ); ImGui::NextColumn();
-					ImGui::TextColored( ImVec4( 1.0f, 1.0f, 0.0f, 1.0f ), "%s", instructionString ); ImGui::NextColumn();
-					ImGui::Separator();
-				}
-				ImGui::Columns( 1 );
-				if ( scrollToBottom )
-				{
-					ImGui::SetScrollHere( 1.0f );
-				}
-				scrollToBottom = false;
-				ImGui::End();
-			}
+		if ( ImGui::Button( "Auto Step" ) )
+		{
+			m_AutoStepDebug = !m_AutoStepDebug;
+			done = m_AutoStepDebug;
+		}
+
+		if ( ImGui::Button( "Continue" ) )
+		{
+			m_AutoStepDebug = true;
+			done = true;
+			m_DoDebugRender = false;
+			m_RenderSnesOutputToScreen = true;
+		}
 
-			// Rendering
-			ImGui::Render();
-			glViewport( 0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y );
-			glClearColor( clear_color.x, clear_color.y, clear_color.z, clear_color.w );
-			glClear( GL_COLOR_BUFFER_BIT );
-			ImGui_ImplOpenGL3_RenderDrawData( ImGui::GetDrawData() );
-			SDL_GL_SwapWindow( m_Window );
+		ImGui::End();
+	}
+
+	{
+		ImGui::Begin( "wRam" );
+		m_MemoryEditor.DrawContents( m_wRam, sizeof( m_wRam ), static_cast<size_t>( 0x7E0000 ) );
+		ImGui::End();
+	}
+
+	{
+		ImGui::Begin( "rom" );
+		m_MemoryEditor.DrawContents( m_rom, sizeof( m_rom ) );
+		ImGui::End();
+	}
+
+	{
+		ImGui::Begin( "Instruction Trace" );
+		ImGui::Columns( 11, "Instruction Trace columns" );
+		ImGui::Separator();
+		ImGui::SetColumnWidth( -1, 60.0f );
+		ImGui::Text( "A" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 60.0f );
+		ImGui::Text( "X" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 60.0f );
+		ImGui::Text( "Y" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 50.0f );
+		ImGui::Text( "DB" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 60.0f );
+		ImGui::Text( "DP" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 50.0f );
+		ImGui::Text( "PB" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 60.0f );
+		ImGui::Text( "SP" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 75.0f );
+		ImGui::Text( "P" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 75.0f );
+		ImGui::Text( "PC" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 350.0f );
+		ImGui::Text( "Instruction" ); ImGui::NextColumn();
+		ImGui::SetColumnWidth( -1, 150.0f );
+		ImGui::Text( "Implemented" ); ImGui::NextColumn();
+		ImGui::Separator();
+		for ( auto&[ pc, instructionString, rs ] : m_InstructionTrace )
+		{
+			ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.A ); ImGui::NextColumn();
+			ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.X ); ImGui::NextColumn();
+			ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.Y ); ImGui::NextColumn();
+			ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%02hhX", rs.DB ); ImGui::NextColumn();
+			ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.DP ); ImGui::NextColumn();
+			ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "0x%04hX", rs.SP ); ImGui::NextColumn();
+			ImGui::TextColored( ImVec4( 0.8f, 0.8f, 0.8f, 1.0f ), "%c%c%c%c%c%c%c%c", rs.NF ? 'N' : 'n', rs.VF ? 'V' : 'v', rs.MF ? 'M' : 'm',
+				rs.XF ? 'X' : 'x', rs.DF ? 'D' : 'd', rs.IF ? 'I' : 'i',
+				rs.ZF ? 'Z' : 'z', rs.CF ? 'C' : 'c' ); ImGui::NextColumn();
+			ImGui::TextColored( ImVec4( 1.0f, 1.0f, 0.0f, 1.0f ), "$%06X", pc ); ImGui::NextColumn();
+			ImGui::TextColored( ImVec4( 1.0f, 1.0f, 0.0f, 1.0f ), "%s", instructionString ); ImGui::NextColumn();
+			ImGui::Separator();
 		}
+		ImGui::Columns( 1 );
+		if ( m_ScrollTraceToBottom )
+		{
+			ImGui::SetScrollHere( 1.0f );
+		}
+		m_ScrollTraceToBottom = false;
+		ImGui::End();
 	}
+
+	// Rendering
+	ImGui::Render();
+	glViewport( 0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y );
+	glClearColor( clear_color.x, clear_color.y, clear_color.z, clear_color.w );
+	glClear( GL_COLOR_BUFFER_BIT );
+	ImGui_ImplOpenGL3_RenderDrawData( ImGui::GetDrawData() );
+	SDL_GL_SwapWindow( m_Window );
+
+	return done;
 }
 
 Hardware::SnesController::SnesController( const uint8_t port )
@@ -844,15 +1424,19 @@ bool Hardware::SnesController::IsCurrentPort( const uint32_t address )
 }
 
 void Hardware::SnesController::RefreshStateBuffer()
+{
+	m_StateBuffer = m_PadState;
+}
+
+uint16_t Hardware::SnesController::ReadKeyboard() const
 {
 	if ( !m_KeyboardState )
 	{
-		return;
+		return 0;
 	}
 	if ( m_Port == 0 )
 	{
-		m_StateBuffer = 0;
-		m_StateBuffer = m_KeyboardState[ SDL_SCANCODE_Z ] |
+		return m_KeyboardState[ SDL_SCANCODE_Z ] |
 			( m_KeyboardState[ SDL_SCANCODE_X ] << 1 ) |
 			( m_KeyboardState[ SDL_SCANCODE_D ] << 2 ) |
 			( m_KeyboardState[ SDL_SCANCODE_F ] << 3 ) |
@@ -867,8 +1451,7 @@ void Hardware::SnesController::RefreshStateBuffer()
 	}
 	else if ( m_Port == 1 )
 	{
-		m_StateBuffer = 0;
-		m_StateBuffer = m_KeyboardState[ SDL_SCANCODE_Y ] |
+		return m_KeyboardState[ SDL_SCANCODE_Y ] |
 			( m_KeyboardState[ SDL_SCANCODE_U ] << 1 ) |
 			( m_KeyboardState[ SDL_SCANCODE_I ] << 2 ) |
 			( m_KeyboardState[ SDL_SCANCODE_O ] << 3 ) |
@@ -881,6 +1464,7 @@ void Hardware::SnesController::RefreshStateBuffer()
 			( m_KeyboardState[ SDL_SCANCODE_N ] << 10 ) |
 			( m_KeyboardState[ SDL_SCANCODE_M ] << 11 );
 	}
+	return 0;
 }
 
 uint8_t Hardware::SnesController::read( const uint32_t address )
@@ -923,6 +1507,13 @@ void Hardware::SnesController::write( const uint32_t address, const uint8_t data
 	}
 }
 
+void Hardware::SnesController::Serialize( Serializer& serializer )
+{
+	serializer( m_Strobe );
+	serializer( m_StateBuffer );
+	serializer( m_PadState );
+}
+
 void Hardware::SnesController::UpdateKeyboardState()
 {
 	m_KeyboardState = SDL_GetKeyboardState( nullptr );
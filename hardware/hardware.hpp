@@ -1,7 +1,12 @@
 #ifndef HARDWARE_HPP
 #define HARDWARE_HPP
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <string>
 #include <tuple>
 #include <vector>
 #include "SDL_video.h"
@@ -11,6 +16,12 @@
 #include "spc/SNES_SPC.h"
 #include "dsp/dsp.h"
 #include "dma/Dma.hpp"
+#include "IoRegisters.hpp"
+#include "FrameProfiler.hpp"
+#include "InputMovie.hpp"
+#include "Serializer.hpp"
+#include "RewindBuffer.hpp"
+#include "FrameQueue.hpp"
 
 std::tuple<uint32_t, uint32_t> getBankAndOffset( uint32_t addr );
 
@@ -26,9 +37,17 @@ extern "C"
 
 	uint8_t read8( const uint32_t address );
 	void write8( const uint32_t address, const uint8_t value );
-	void doPPUFrame( void );
+	bool blockFill( const uint32_t address, const uint32_t size, const uint16_t value, const uint32_t width, const uint32_t instructionCount );
+	bool blockCopy( const uint32_t destination, const uint32_t source, const uint32_t size, const uint32_t instructionCount );
+	bool waitForInterrupt( void );
+	bool waitForSpcPort( void );
 	void updateInstructionOutput( const uint32_t pc, const char* instructionString );
 	void romCycle( void );
+
+	// Emitted by the recompiler, profileFunctionCount is 0 unless it was run with --profile-calls:
+	extern uint64_t profileCallCounts[];
+	extern const char* const profileFunctionNames[];
+	extern const uint32_t profileFunctionCount;
 }
 
 struct InternalRegisterState
@@ -52,8 +71,45 @@ class Hardware
 {
 	public:
 		static Hardware& GetInstance();
-		void PowerOn();
-		void quit();
+
+		struct Options
+		{
+			// Run without a window, GL context or ImGui, the frames are only rendered into ppufast.output.
+			bool headless = false;
+			// Quit with EXIT_SUCCESS after this many frames, 0 runs until the window is closed.
+			uint64_t frames = 0;
+			// Time every frame and write the frame time and per subsystem statistics here as JSON on quit.
+			std::string benchmark;
+			// Record the pads of every frame to this input movie, or play one back in place of the keyboard.
+			std::string recordMovie;
+			std::string playMovie;
+			// Passes of the main loop to emulate ahead of the one the game is really at before presenting, see RunAhead.
+			uint32_t runAhead = 0;
+			// Keep this many seconds of states in at most rewindMegabytes to rewind through while backspace is held.
+			uint32_t rewindSeconds = 0;
+			uint32_t rewindMegabytes = 64;
+			// Draw only one in every frameSkip + 1 passes of the main loop, the skipped ones still run exactly.
+			uint32_t frameSkip = 0;
+			// Threads rendering lines alongside the one running the game, -1 uses one for every other core. The frames
+			// come out exactly the same for any count.
+			int32_t renderThreads = -1;
+			// Draw each frame while the game runs the next one, at the cost of showing it a frame later.
+			bool pipelineRendering = false;
+			// Draw the mode 7 track this many times finer (1 to 4), optionally averaged back down to the normal
+			// resolution, with the matrix interpolated between lines unless mode7Perspective is off.
+			uint32_t mode7Scale = 1;
+			bool mode7Perspective = true;
+			bool mode7Supersample = false;
+		};
+
+		void PowerOn( const Options& options );
+		void quit( const int status = EXIT_SUCCESS );
+
+		// Save states are a flat copy of every component. The native stack of the recompiled code isn't part of them,
+		// so they can only be taken and restored between calls to mainLoop where none of it is live.
+		size_t GetStateSize();
+		void SaveState( std::vector<uint8_t>& state );
+		void LoadState( const std::vector<uint8_t>& state );
 		void mainLoopFunc();
 
 	struct AluMulDivState
@@ -72,6 +128,7 @@ class Hardware
 	};
 
 	void incrementCycleCount( void );
+	void advanceSpcTime( const int32_t clocks );
 	void spcWritePort( const int32_t port, const int32_t data );
 	int32_t spcReadPort( const int32_t port );
 
@@ -84,19 +141,28 @@ class Hardware
 		uint8_t read( const uint32_t address );
 		void write( const uint32_t address, const uint8_t data );
 		void UpdateKeyboardState();
+		uint16_t ReadKeyboard() const;
+		void SetPadState( const uint16_t padState ) { m_PadState = padState; }
+		void Serialize( Serializer& serializer );
 
 	private:
 		bool m_Strobe = false;
 		uint8_t m_Port = 0;
 		uint32_t m_StateBuffer = 0;
+		uint16_t m_PadState = 0;
 		const uint8_t* m_KeyboardState = nullptr;
 	};
 
 	void ProcessAutoJoyPadRead( void );
+	void LatchPads( void );
 	
 	uint8_t read8( const uint32_t address );
 	void write8( const uint32_t address, const uint8_t value );
+	bool BlockFill( const uint32_t address, const uint32_t size, const uint16_t value, const uint32_t width, const uint32_t instructionCount );
+	bool BlockCopy( const uint32_t destination, const uint32_t source, const uint32_t size, const uint32_t instructionCount );
 	void DoPPUFrame();
+	bool WaitForInterrupt();
+	bool WaitForSpcPort();
 	void UpdateInstructionOutput( const uint32_t pc, const char* instructionString );
 	void Panic();
 	void RomCycle( void );
@@ -107,10 +173,60 @@ private:
 	Hardware( Hardware&& other ) = delete;
 
 	void initialiseSDL();
+	void ShutdownVideo();
+	void PollEvents();
+	bool PresentFrame();
+	void PresentationLoop();
+	bool DrawDebugger();
+	void PaceFrame();
+	void Serialize( Serializer& serializer );
+	void RunAhead();
+	void Rewind();
+	void UpdateFrameSkip();
+	void WriteCallProfile();
 	void LoadRom( const char* romPath );
 
-	uint8_t dspRead( const uint32_t addr );
-	void dspWrite( const uint32_t addr, const uint8_t data );
+	int8_t* GetWRamPointer( const uint32_t address, const uint32_t size );
+	const int8_t* GetReadPointer( const uint32_t address, const uint32_t size );
+
+	// 4KB pages over the 24 bit address space. A page either points straight at host memory or names the handler that
+	// decodes it, read and write have separate tables so rom has no write mapping.
+	static constexpr uint32_t BUS_PAGE_SHIFT = 12;
+	static constexpr uint32_t BUS_PAGE_SIZE = 1 << BUS_PAGE_SHIFT;
+	static constexpr uint32_t BUS_PAGE_COUNT = 0x1000000 >> BUS_PAGE_SHIFT;
+
+	enum BusHandler : uint8_t
+	{
+		BUS_HANDLER_OPEN,
+		BUS_HANDLER_IO,
+		BUS_HANDLER_DSP,
+		BUS_HANDLER_COUNT
+	};
+
+	struct BusPage
+	{
+		int8_t* memory = nullptr;
+		uint32_t mask = 0;
+		BusHandler handler = BUS_HANDLER_OPEN;
+	};
+
+	struct BusHandlerFunctions
+	{
+		uint8_t ( Hardware::*read )( const uint32_t address );
+		void ( Hardware::*write )( const uint32_t address, const uint8_t value );
+	};
+
+	void BuildBus();
+	void MapBusMemory( const uint32_t bankLow, const uint32_t bankHigh, const uint32_t offsetLow, const uint32_t offsetHigh, int8_t* memory, const uint32_t memorySize, const uint32_t base, const bool writable );
+	void MapBusHandler( const uint32_t bankLow, const uint32_t bankHigh, const uint32_t offsetLow, const uint32_t offsetHigh, const BusHandler handler );
+
+	uint8_t openBusRead( const uint32_t address );
+	void openBusWrite( const uint32_t address, const uint8_t value );
+	uint8_t ioRead( const uint32_t address );
+	void ioWrite( const uint32_t address, const uint8_t value );
+	void MapIoRegisters();
+	uint8_t dspRead( const uint32_t address );
+	void dspWrite( const uint32_t address, const uint8_t value );
 
 	static constexpr uint8_t IPL_ROM[] = { 0xCD, 0xEF, 0xBD, 0xE8, 0x00, 0xC6, 0x1D, 0xD0, 0xFC, 0x8F, 0xAA, 0xF4, 0x8F, 0xBB, 0xF5, 0x78,
 																				 0xCC, 0xF4, 0xD0, 0xFB, 0x2F, 0x19, 0xEB, 0xF4, 0xD0, 0xFC, 0x7E, 0xF4, 0xD0, 0x0B, 0xE4, 0xF5,
@@ -121,6 +237,10 @@ private:
 	int8_t m_rom[ 0x80000 ] = { 0 };
 	int8_t m_sRam[ 0x800 ] = { 0 };
 
+	BusPage m_ReadPages[ BUS_PAGE_COUNT ];
+	BusPage m_WritePages[ BUS_PAGE_COUNT ];
+	BusHandlerFunctions m_BusHandlers[ BUS_HANDLER_COUNT ] = {};
+
 	SDL_Window* m_Window;
 	SDL_GLContext m_GLContext;
 
@@ -129,13 +249,55 @@ private:
 	InternalRegisterState m_InternalRegisterState;
 	SNES_SPC m_SPC;
 	int32_t m_SPCTime = 0;
+	// m_SPCTime counts the spc's 1.024MHz clock. Every cpu access to the bus moves it on by SPC_CLOCKS_PER_ACCESS and
+	// the spc's own frame is ended every half a second to keep its timestamps small.
+	static constexpr int32_t SPC_CLOCK_RATE = SNES_SPC::clock_rate;
+	static constexpr int32_t SPC_CLOCKS_PER_ACCESS = 5;
+	static constexpr int32_t SPC_CLOCKS_PER_END_FRAME = SPC_CLOCK_RATE / 2;
+	static constexpr int32_t SPC_CLOCKS_PER_FRAME = SPC_CLOCK_RATE / 60;
+	// How far WaitForSpcPort runs the spc between looking at the ports, a few spc instructions.
+	static constexpr int32_t SPC_PORT_POLL_CLOCKS = SPC_CLOCKS_PER_ACCESS * 32;
+	static constexpr uint32_t REWIND_KEY_FRAME_INTERVAL = 60;
+	static constexpr std::chrono::nanoseconds FRAME_DURATION{ 1000000000 / 60 };
 
 	uint32_t m_wRamPosition = 0;
 	DmaController m_dmaController;
+	IoRegisters m_IoRegisters;
+	FrameProfiler m_FrameProfiler;
+	std::string m_BenchmarkPath;
+	InputMovie m_InputMovie;
+	size_t m_StateSize = 0;
+	uint32_t m_RunAheadFrames = 0;
+	bool m_RunningAhead = false;
+	bool m_RenderFrame = true;
+	std::vector<uint8_t> m_RunAheadState;
+	RewindBuffer m_RewindBuffer;
+	std::vector<uint8_t> m_RewindState;
+	uint32_t m_FrameSkip = 0;
+	uint64_t m_PassCount = 0;
+	bool m_FastForward = false;
+	bool m_SkipFrame = false;
+	std::chrono::steady_clock::time_point m_LastPresent;
+	std::chrono::steady_clock::time_point m_NextFrameTime;
+
+	// With a window the emulation runs on its own thread and the main thread owns SDL, GL and ImGui. They only share
+	// the frame queue and these.
+	bool m_ThreadedPresentation = false;
+	FrameQueue m_FrameQueue;
+	std::array<std::atomic<uint16_t>, 2> m_KeyboardPads = {};
+	std::atomic<bool> m_RewindHeld{ false };
+	std::atomic<bool> m_FastForwardHeld{ false };
+	std::atomic<bool> m_QuitRequested{ false };
+	std::atomic<bool> m_DebuggerActive{ false };
+	std::atomic<int> m_ExitStatus{ -1 };
 
 	bool m_AutoStepDebug = false;
 	bool m_DoDebugRender = false;
 	bool m_RenderSnesOutputToScreen = true;
+	bool m_ScrollTraceToBottom = false;
+	bool m_Headless = false;
+	uint64_t m_FrameLimit = 0;
+	uint64_t m_FrameCount = 0;
 
 	struct RegisterState
 	{
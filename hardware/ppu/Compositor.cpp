@@ -0,0 +1,321 @@
+#include "Compositor.hpp"
+#include <cstring>
+#include <vector>
+#ifdef SMK_X86_64
+#include <immintrin.h>
+#endif // SMK_X86_64
+
+namespace Compositor
+{
+	namespace
+	{
+		// RGB555 add and subtract clamping each channel, the carries and borrows out of a channel are turned into a
+		// mask that saturates it instead.
+		uint16_t Blend( const uint32_t x, const uint32_t y, const bool subtract, const bool halve )
+		{
+			if ( !subtract )
+			{
+				if ( !halve )
+				{
+					const uint32_t sum = x + y;
+					const uint32_t carry = ( sum - ( ( x ^ y ) & 0x0421 ) ) & 0x8420;
+					return ( sum - carry ) | ( carry - ( carry >> 5 ) );
+				}
+				return ( x + y - ( ( x ^ y ) & 0x0421 ) ) >> 1;
+			}
+
+			const uint32_t diff = x - y + 0x8420;
+			const uint32_t borrow = ( diff - ( ( x ^ y ) & 0x8420 ) ) & 0x8420;
+			if ( !halve )
+			{
+				return ( diff - borrow ) & ( borrow - ( borrow >> 5 ) );
+			}
+			return ( ( ( diff - borrow ) & ( borrow - ( borrow >> 5 ) ) ) & 0x7bde ) >> 1;
+		}
+
+		uint16_t ComposePixel( const uint32_t x, const Pixel above, const Pixel below, const uint64_t* windowAbove,
+			const uint64_t* windowBelow, const Params& params )
+		{
+			const bool insideAbove = windowAbove[ x >> 6 ] >> ( x & 63 ) & 1;
+			const bool insideBelow = windowBelow[ x >> 6 ] >> ( x & 63 ) & 1;
+			const uint16_t color = insideAbove ? above.color : 0x0000;
+			if ( !insideBelow || !( params.enable >> above.source & 1 ) )
+			{
+				return color;
+			}
+			if ( !params.blendMode )
+			{
+				return Blend( color, params.fixedColor, params.subtract, params.halve && insideAbove );
+			}
+			return Blend( color, below.color, params.subtract, params.halve && insideAbove && below.source != SourceCOL );
+		}
+	}
+
+	void ComposeScalar( const Pixel* above, const Pixel* below, const uint64_t* windowAbove, const uint64_t* windowBelow,
+		const uint32_t count, const Params& params, uint16_t* output )
+	{
+		for ( uint32_t x = 0; x < count; x++ )
+		{
+			output[ x ] = params.luma[ ComposePixel( x, above[ x ], below[ x ], windowAbove, windowBelow, params ) ];
+		}
+	}
+
+#ifdef SMK_X86_64
+	namespace
+	{
+		// The window bits of the pixels from x on as a mask per 16 bit lane, bits holds each lane's bit.
+		SMK_TARGET( "sse4.1" ) __m128i WindowSSE41( const uint64_t* mask, const uint32_t x, const __m128i bits )
+		{
+			const __m128i set = _mm_set1_epi16( static_cast<int16_t>( mask[ x >> 6 ] >> ( x & 63 ) & 0xff ) );
+			return _mm_cmpeq_epi16( _mm_and_si128( set, bits ), bits );
+		}
+
+		SMK_TARGET( "avx2" ) __m256i WindowAVX2( const uint64_t* mask, const uint32_t x, const __m256i bits )
+		{
+			const __m256i set = _mm256_set1_epi16( static_cast<int16_t>( mask[ x >> 6 ] >> ( x & 63 ) & 0xffff ) );
+			return _mm256_cmpeq_epi16( _mm256_and_si256( set, bits ), bits );
+		}
+
+		// Two sets of eight 32 bit lanes to sixteen 16 bit lanes in order.
+		SMK_TARGET( "avx2" ) __m256i PackAVX2( const __m256i low, const __m256i high )
+		{
+			return _mm256_permute4x64_epi64( _mm256_packus_epi32( low, high ), 0xd8 );
+		}
+	}
+
+	// Eight pixels at a time in 16 bit lanes. There's no gather before AVX2, so the brightness is still looked up one
+	// pixel at a time.
+	SMK_TARGET( "sse4.1" ) void ComposeSSE41( const Pixel* above, const Pixel* below, const uint64_t* windowAbove,
+		const uint64_t* windowBelow, const uint32_t count, const Params& params, uint16_t* output )
+	{
+		static_assert( sizeof( Pixel ) == 4, "a pixel is read as one 32 bit lane, source in the low byte and color in the high half" );
+
+		uint8_t enable[ 16 ] = {};
+		for ( uint32_t source = 0; source < 8; source++ )
+		{
+			enable[ source ] = params.enable >> source & 1 ? 0xff : 0x00;
+		}
+		const __m128i enableTable = _mm_loadu_si128( reinterpret_cast<const __m128i*>( enable ) );
+		const __m128i bits = _mm_setr_epi16( 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 );
+		const __m128i sourceMask = _mm_set1_epi32( 0xff );
+		const __m128i colorSource = _mm_set1_epi16( SourceCOL );
+		const __m128i fixedColor = _mm_set1_epi16( static_cast<int16_t>( params.fixedColor ) );
+		const __m128i halveAll = params.halve ? _mm_set1_epi32( -1 ) : _mm_setzero_si128();
+		const __m128i lowBits = _mm_set1_epi16( 0x0421 );
+		const __m128i highBits = _mm_set1_epi16( static_cast<int16_t>( 0x8420 ) );
+		const __m128i halveMask = _mm_set1_epi16( 0x7bde );
+
+		for ( uint32_t x = 0; x < count; x += 8 )
+		{
+			const __m128i above0 = _mm_loadu_si128( reinterpret_cast<const __m128i*>( above + x ) );
+			const __m128i above1 = _mm_loadu_si128( reinterpret_cast<const __m128i*>( above + x + 4 ) );
+			const __m128i below0 = _mm_loadu_si128( reinterpret_cast<const __m128i*>( below + x ) );
+			const __m128i below1 = _mm_loadu_si128( reinterpret_cast<const __m128i*>( below + x + 4 ) );
+			const __m128i aboveColor = _mm_packus_epi32( _mm_srli_epi32( above0, 16 ), _mm_srli_epi32( above1, 16 ) );
+			const __m128i belowColor = _mm_packus_epi32( _mm_srli_epi32( below0, 16 ), _mm_srli_epi32( below1, 16 ) );
+			const __m128i aboveSource = _mm_packus_epi32( _mm_and_si128( above0, sourceMask ), _mm_and_si128( above1, sourceMask ) );
+			const __m128i belowSource = _mm_packus_epi32( _mm_and_si128( below0, sourceMask ), _mm_and_si128( below1, sourceMask ) );
+
+			// The lookup puts the source's entry in the low byte of each lane, shifting it up and back sign extends it.
+			const __m128i enabled = _mm_srai_epi16( _mm_slli_epi16( _mm_shuffle_epi8( enableTable, aboveSource ), 8 ), 8 );
+			const __m128i insideAbove = WindowSSE41( windowAbove, x, bits );
+			const __m128i math = _mm_and_si128( WindowSSE41( windowBelow, x, bits ), enabled );
+			const __m128i a = _mm_and_si128( aboveColor, insideAbove );
+			__m128i b = fixedColor;
+			__m128i halve = _mm_and_si128( halveAll, insideAbove );
+			if ( params.blendMode )
+			{
+				b = belowColor;
+				halve = _mm_andnot_si128( _mm_cmpeq_epi16( belowSource, colorSource ), halve );
+			}
+
+			__m128i full, half;
+			if ( !params.subtract )
+			{
+				const __m128i sum = _mm_add_epi16( a, b );
+				const __m128i exact = _mm_sub_epi16( sum, _mm_and_si128( _mm_xor_si128( a, b ), lowBits ) );
+				const __m128i carry = _mm_and_si128( exact, highBits );
+				full = _mm_or_si128( _mm_sub_epi16( sum, carry ), _mm_sub_epi16( carry, _mm_srli_epi16( carry, 5 ) ) );
+				half = _mm_srli_epi16( exact, 1 );
+			}
+			else
+			{
+				const __m128i diff = _mm_add_epi16( _mm_sub_epi16( a, b ), highBits );
+				const __m128i borrow = _mm_and_si128( _mm_sub_epi16( diff, _mm_and_si128( _mm_xor_si128( a, b ), highBits ) ), highBits );
+				full = _mm_and_si128( _mm_sub_epi16( diff, borrow ), _mm_sub_epi16( borrow, _mm_srli_epi16( borrow, 5 ) ) );
+				half = _mm_srli_epi16( _mm_and_si128( full, halveMask ), 1 );
+			}
+			const __m128i color = _mm_blendv_epi8( a, _mm_blendv_epi8( full, half, halve ), math );
+
+			alignas( 16 ) uint16_t colors[ 8 ];
+			_mm_store_si128( reinterpret_cast<__m128i*>( colors ), color );
+			for ( uint32_t n = 0; n < 8; n++ )
+			{
+				output[ x + n ] = params.luma[ colors[ n ] ];
+			}
+		}
+	}
+
+	// Sixteen pixels at a time in 16 bit lanes with the brightness gathered. The packs work within each 128 bit half,
+	// so pixels 0-3 and 8-11 end up in one and 4-7 and 12-15 in the other until a permute puts them back in order.
+	SMK_TARGET( "avx2" ) void ComposeAVX2( const Pixel* above, const Pixel* below, const uint64_t* windowAbove,
+		const uint64_t* windowBelow, const uint32_t count, const Params& params, uint16_t* output )
+	{
+		uint8_t enable[ 16 ] = {};
+		for ( uint32_t source = 0; source < 8; source++ )
+		{
+			enable[ source ] = params.enable >> source & 1 ? 0xff : 0x00;
+		}
+		const __m256i enableTable = _mm256_broadcastsi128_si256( _mm_loadu_si128( reinterpret_cast<const __m128i*>( enable ) ) );
+		const __m256i bits = _mm256_setr_epi16( 0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+			0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, static_cast<int16_t>( 0x8000 ) );
+		const __m256i sourceMask = _mm256_set1_epi32( 0xff );
+		const __m256i lumaMask = _mm256_set1_epi32( 0xffff );
+		const __m256i colorSource = _mm256_set1_epi16( SourceCOL );
+		const __m256i fixedColor = _mm256_set1_epi16( static_cast<int16_t>( params.fixedColor ) );
+		const __m256i halveAll = params.halve ? _mm256_set1_epi32( -1 ) : _mm256_setzero_si256();
+		const __m256i lowBits = _mm256_set1_epi16( 0x0421 );
+		const __m256i highBits = _mm256_set1_epi16( static_cast<int16_t>( 0x8420 ) );
+		const __m256i halveMask = _mm256_set1_epi16( 0x7bde );
+		const int* luma = reinterpret_cast<const int*>( params.luma );
+
+		for ( uint32_t x = 0; x < count; x += 16 )
+		{
+			const __m256i above0 = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( above + x ) );
+			const __m256i above1 = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( above + x + 8 ) );
+			const __m256i below0 = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( below + x ) );
+			const __m256i below1 = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( below + x + 8 ) );
+			const __m256i aboveColor = PackAVX2( _mm256_srli_epi32( above0, 16 ), _mm256_srli_epi32( above1, 16 ) );
+			const __m256i belowColor = PackAVX2( _mm256_srli_epi32( below0, 16 ), _mm256_srli_epi32( below1, 16 ) );
+			const __m256i aboveSource = PackAVX2( _mm256_and_si256( above0, sourceMask ), _mm256_and_si256( above1, sourceMask ) );
+			const __m256i belowSource = PackAVX2( _mm256_and_si256( below0, sourceMask ), _mm256_and_si256( below1, sourceMask ) );
+
+			const __m256i enabled = _mm256_srai_epi16( _mm256_slli_epi16( _mm256_shuffle_epi8( enableTable, aboveSource ), 8 ), 8 );
+			const __m256i insideAbove = WindowAVX2( windowAbove, x, bits );
+			const __m256i math = _mm256_and_si256( WindowAVX2( windowBelow, x, bits ), enabled );
+			const __m256i a = _mm256_and_si256( aboveColor, insideAbove );
+			__m256i b = fixedColor;
+			__m256i halve = _mm256_and_si256( halveAll, insideAbove );
+			if ( params.blendMode )
+			{
+				b = belowColor;
+				halve = _mm256_andnot_si256( _mm256_cmpeq_epi16( belowSource, colorSource ), halve );
+			}
+
+			__m256i full, half;
+			if ( !params.subtract )
+			{
+				const __m256i sum = _mm256_add_epi16( a, b );
+				const __m256i exact = _mm256_sub_epi16( sum, _mm256_and_si256( _mm256_xor_si256( a, b ), lowBits ) );
+				const __m256i carry = _mm256_and_si256( exact, highBits );
+				full = _mm256_or_si256( _mm256_sub_epi16( sum, carry ), _mm256_sub_epi16( carry, _mm256_srli_epi16( carry, 5 ) ) );
+				half = _mm256_srli_epi16( exact, 1 );
+			}
+			else
+			{
+				const __m256i diff = _mm256_add_epi16( _mm256_sub_epi16( a, b ), highBits );
+				const __m256i borrow = _mm256_and_si256( _mm256_sub_epi16( diff, _mm256_and_si256( _mm256_xor_si256( a, b ), highBits ) ), highBits );
+				full = _mm256_and_si256( _mm256_sub_epi16( diff, borrow ), _mm256_sub_epi16( borrow, _mm256_srli_epi16( borrow, 5 ) ) );
+				half = _mm256_srli_epi16( _mm256_and_si256( full, halveMask ), 1 );
+			}
+			const __m256i color = _mm256_blendv_epi8( a, _mm256_blendv_epi8( full, half, halve ), math );
+
+			// The gathers read a 32 bit lane at each 16 bit entry, which is what the spare entry at the end is for.
+			const __m256i low = _mm256_i32gather_epi32( luma, _mm256_cvtepu16_epi32( _mm256_castsi256_si128( color ) ), 2 );
+			const __m256i high = _mm256_i32gather_epi32( luma, _mm256_cvtepu16_epi32( _mm256_extracti128_si256( color, 1 ) ), 2 );
+			_mm256_storeu_si256( reinterpret_cast<__m256i*>( output + x ), PackAVX2( _mm256_and_si256( low, lumaMask ), _mm256_and_si256( high, lumaMask ) ) );
+		}
+	}
+#endif // SMK_X86_64
+
+	Kernel Select()
+	{
+#ifdef SMK_X86_64
+		const CpuFeatures& features = CpuFeatures::Get();
+		if ( features.avx2 )
+		{
+			return ComposeAVX2;
+		}
+		if ( features.sse41 )
+		{
+			return ComposeSSE41;
+		}
+#endif // SMK_X86_64
+		return ComposeScalar;
+	}
+
+	bool Verify()
+	{
+		std::vector<Kernel> kernels;
+#ifdef SMK_X86_64
+		const CpuFeatures& features = CpuFeatures::Get();
+		if ( features.sse41 )
+		{
+			kernels.push_back( ComposeSSE41 );
+		}
+		if ( features.avx2 )
+		{
+			kernels.push_back( ComposeAVX2 );
+		}
+#endif // SMK_X86_64
+
+		uint64_t random = 0x9e3779b97f4a7c15ull;
+		const auto next = [ &random ]() -> uint32_t
+		{
+			random ^= random << 13;
+			random ^= random >> 7;
+			random ^= random << 17;
+			return static_cast<uint32_t>( random >> 16 );
+		};
+
+		std::vector<uint16_t> luma( 32768 + 1 );
+		for ( uint16_t& color : luma )
+		{
+			color = static_cast<uint16_t>( next() );
+		}
+
+		// A whole 4x hd line, with white and black well represented so every channel saturates somewhere.
+		constexpr uint32_t count = 1024;
+		std::vector<Pixel> above( count );
+		std::vector<Pixel> below( count );
+		uint64_t windowAbove[ count / 64 ];
+		uint64_t windowBelow[ count / 64 ];
+		std::vector<uint16_t> expected( count );
+		std::vector<uint16_t> actual( count );
+		for ( uint32_t i = 0; i < 256; i++ )
+		{
+			static const uint16_t extremes[] = { 0x0000, 0x7fff, 0x001f, 0x03e0, 0x7c00, 0x4210 };
+			for ( uint32_t x = 0; x < count; x++ )
+			{
+				above[ x ] = { static_cast<uint8_t>( next() % 7 ), static_cast<uint8_t>( next() ),
+					static_cast<uint16_t>( next() & 3 ? next() & 0x7fff : extremes[ next() % 6 ] ) };
+				below[ x ] = { static_cast<uint8_t>( next() % 7 ), static_cast<uint8_t>( next() ),
+					static_cast<uint16_t>( next() & 3 ? next() & 0x7fff : extremes[ next() % 6 ] ) };
+			}
+			for ( uint32_t n = 0; n < count / 64; n++ )
+			{
+				windowAbove[ n ] = static_cast<uint64_t>( next() ) << 32 | next();
+				windowBelow[ n ] = static_cast<uint64_t>( next() ) << 32 | next();
+			}
+
+			Params params;
+			params.enable = static_cast<uint8_t>( next() & 0x7f );
+			params.blendMode = i & 1;
+			params.subtract = i & 2;
+			params.halve = i & 4;
+			params.fixedColor = static_cast<uint16_t>( next() & 0x7fff );
+			params.luma = luma.data();
+
+			ComposeScalar( above.data(), below.data(), windowAbove, windowBelow, count, params, expected.data() );
+			for ( const Kernel kernel : kernels )
+			{
+				kernel( above.data(), below.data(), windowAbove, windowBelow, count, params, actual.data() );
+				if ( memcmp( expected.data(), actual.data(), count * sizeof( uint16_t ) ) != 0 )
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef COMPOSITOR_HPP
+#define COMPOSITOR_HPP
+
+#include <cstdint>
+#include "CpuFeatures.hpp"
+
+// Turns the above and below layers of a line into output colors. The above pixel is blacked out outside the above
+// window, and inside the below window color math adds or subtracts the below pixel or the fixed color to it when it's
+// enabled for the above pixel's source, halving the result inside the above window unless the below pixel is the
+// backdrop. The result goes through the brightness table. Bit x of the window masks is pixel x.
+namespace Compositor
+{
+	struct Pixel
+	{
+		uint8_t source = 0;
+		uint8_t priority = 0;
+		uint16_t color = 0;
+	};
+
+	// The backdrop's source, the last of BG1-4, OBJ1, OBJ2.
+	constexpr uint8_t SourceCOL = 6;
+
+	struct Params
+	{
+		uint8_t enable;       // bit n set when color math applies to source n
+		bool blendMode;       // false for the fixed color, true for the below pixel
+		bool subtract;
+		bool halve;
+		uint16_t fixedColor;
+		const uint16_t* luma; // 32768 colors and one spare entry, so the last can be read 32 bits at a time
+	};
+
+	// count is a multiple of 16.
+	using Kernel = void (*)( const Pixel* above, const Pixel* below, const uint64_t* windowAbove, const uint64_t* windowBelow,
+		const uint32_t count, const Params& params, uint16_t* output );
+
+	// One pixel at a time, kept as the reference the others have to match.
+	void ComposeScalar( const Pixel* above, const Pixel* below, const uint64_t* windowAbove, const uint64_t* windowBelow,
+		const uint32_t count, const Params& params, uint16_t* output );
+#ifdef SMK_X86_64
+	void ComposeSSE41( const Pixel* above, const Pixel* below, const uint64_t* windowAbove, const uint64_t* windowBelow,
+		const uint32_t count, const Params& params, uint16_t* output );
+	void ComposeAVX2( const Pixel* above, const Pixel* below, const uint64_t* windowAbove, const uint64_t* windowBelow,
+		const uint32_t count, const Params& params, uint16_t* output );
+#endif // SMK_X86_64
+
+	// The fastest version this machine runs.
+	Kernel Select();
+	// Runs every version this machine supports against ComposeScalar, false if any of them differs.
+	bool Verify();
+
+	inline void Compose( const Pixel* above, const Pixel* below, const uint64_t* windowAbove, const uint64_t* windowBelow,
+		const uint32_t count, const Params& params, uint16_t* output )
+	{
+		static const Kernel kernel = Select();
+		kernel( above, below, windowAbove, windowBelow, count, params, output );
+	}
+}
+
+#endif // COMPOSITOR_HPP
@@ -0,0 +1,62 @@
+#ifndef CPU_FEATURES_HPP
+#define CPU_FEATURES_HPP
+
+#include <cstdint>
+
+// The PPU kernels are built for every instruction set they have a version for and pick one at run time, so one binary
+// runs everywhere and still uses AVX2 where there is one. SSE2 is always there on x86-64.
+#if defined( __x86_64__ ) || defined( _M_X64 )
+#define SMK_X86_64 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SMK_TARGET( features )
+#else
+#include <cpuid.h>
+#define SMK_TARGET( features ) __attribute__( ( target( features ) ) )
+#endif // _MSC_VER
+#endif // __x86_64__ || _M_X64
+
+struct CpuFeatures
+{
+	bool sse41 = false;
+	bool avx2 = false;
+	bool bmi2 = false;
+
+	static const CpuFeatures& Get()
+	{
+		static const CpuFeatures features = Detect();
+		return features;
+	}
+
+private:
+	static CpuFeatures Detect()
+	{
+		CpuFeatures features;
+#ifdef SMK_X86_64
+		uint32_t leaf1[ 4 ] = {};
+		uint32_t leaf7[ 4 ] = {};
+#ifdef _MSC_VER
+		__cpuidex( reinterpret_cast<int*>( leaf1 ), 1, 0 );
+		__cpuidex( reinterpret_cast<int*>( leaf7 ), 7, 0 );
+		const uint64_t xcr0 = leaf1[ 2 ] & ( 1u << 27 ) ? _xgetbv( 0 ) : 0;
+#else
+		__cpuid_count( 1, 0, leaf1[ 0 ], leaf1[ 1 ], leaf1[ 2 ], leaf1[ 3 ] );
+		__cpuid_count( 7, 0, leaf7[ 0 ], leaf7[ 1 ], leaf7[ 2 ], leaf7[ 3 ] );
+		uint32_t xcr0Low = 0, xcr0High = 0;
+		if ( leaf1[ 2 ] & ( 1u << 27 ) )
+		{
+			__asm__( "xgetbv" : "=a"( xcr0Low ), "=d"( xcr0High ) : "c"( 0 ) );
+		}
+		const uint64_t xcr0 = static_cast<uint64_t>( xcr0High ) << 32 | xcr0Low;
+#endif // _MSC_VER
+		// AVX2 also needs the OS to save the upper halves of the ymm registers.
+		const bool ymmSaved = ( xcr0 & 0x6 ) == 0x6;
+		features.sse41 = leaf1[ 2 ] & ( 1u << 19 );
+		features.avx2 = ymmSaved && ( leaf7[ 1 ] & ( 1u << 5 ) );
+		features.bmi2 = leaf7[ 1 ] & ( 1u << 8 );
+#endif // SMK_X86_64
+		return features;
+	}
+};
+
+#endif // CPU_FEATURES_HPP
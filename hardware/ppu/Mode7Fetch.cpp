@@ -0,0 +1,194 @@
+#include "Mode7Fetch.hpp"
+#include <cstring>
+#include <vector>
+#ifdef SMK_X86_64
+#include <immintrin.h>
+#endif // SMK_X86_64
+
+namespace Mode7Fetch
+{
+	void FetchScalar( const uint16_t* vram, const Params& params, uint8_t* palettes )
+	{
+		for ( int32_t X = 0; X < 256; X++ )
+		{
+			const int32_t x = !params.hflip ? X : 255 - X;
+			const int32_t pixelX = ( params.originX + params.a * x ) >> 8;
+			const int32_t pixelY = ( params.originY + params.c * x ) >> 8;
+			const int32_t tileX = pixelX >> 3 & 127;
+			const int32_t tileY = pixelY >> 3 & 127;
+			const bool outOfBounds = ( pixelX | pixelY ) & ~1023;
+			const uint16_t tileAddress = tileY * 128 + tileX;
+			const uint16_t paletteAddress = ( ( pixelY & 7 ) << 3 ) + ( pixelX & 7 );
+			const uint8_t tile = params.repeat == 3 && outOfBounds ? 0 : vram[ tileAddress ] >> 0;
+			palettes[ X ] = params.repeat == 2 && outOfBounds ? 0 : vram[ tile << 6 | paletteAddress ] >> 8;
+		}
+	}
+
+#ifdef SMK_X86_64
+	// Four pixels at a time. There's no gather before AVX2, so the vram reads are still one lane at a time.
+	SMK_TARGET( "sse4.1" ) void FetchSSE41( const uint16_t* vram, const Params& params, uint8_t* palettes )
+	{
+		const __m128i originX = _mm_set1_epi32( params.originX );
+		const __m128i originY = _mm_set1_epi32( params.originY );
+		const __m128i a = _mm_set1_epi32( params.a );
+		const __m128i c = _mm_set1_epi32( params.c );
+		const __m128i tileMask = _mm_set1_epi32( 127 );
+		const __m128i pixelMask = _mm_set1_epi32( 7 );
+		const __m128i planeMask = _mm_set1_epi32( ~1023 );
+		const __m128i step = _mm_set1_epi32( !params.hflip ? 4 : -4 );
+		__m128i x = !params.hflip ? _mm_setr_epi32( 0, 1, 2, 3 ) : _mm_setr_epi32( 255, 254, 253, 252 );
+
+		for ( uint32_t X = 0; X < 256; X += 4 )
+		{
+			const __m128i pixelX = _mm_srai_epi32( _mm_add_epi32( originX, _mm_mullo_epi32( a, x ) ), 8 );
+			const __m128i pixelY = _mm_srai_epi32( _mm_add_epi32( originY, _mm_mullo_epi32( c, x ) ), 8 );
+			const __m128i inBounds = _mm_cmpeq_epi32( _mm_and_si128( _mm_or_si128( pixelX, pixelY ), planeMask ), _mm_setzero_si128() );
+			const __m128i tileAddress = _mm_or_si128( _mm_slli_epi32( _mm_and_si128( _mm_srai_epi32( pixelY, 3 ), tileMask ), 7 ),
+				_mm_and_si128( _mm_srai_epi32( pixelX, 3 ), tileMask ) );
+			const __m128i paletteAddress = _mm_or_si128( _mm_slli_epi32( _mm_and_si128( pixelY, pixelMask ), 3 ), _mm_and_si128( pixelX, pixelMask ) );
+
+			__m128i tile = _mm_setr_epi32( vram[ _mm_extract_epi32( tileAddress, 0 ) ], vram[ _mm_extract_epi32( tileAddress, 1 ) ],
+				vram[ _mm_extract_epi32( tileAddress, 2 ) ], vram[ _mm_extract_epi32( tileAddress, 3 ) ] );
+			tile = _mm_and_si128( tile, _mm_set1_epi32( 0xff ) );
+			if ( params.repeat == 3 )
+			{
+				tile = _mm_and_si128( tile, inBounds );
+			}
+
+			const __m128i address = _mm_or_si128( _mm_slli_epi32( tile, 6 ), paletteAddress );
+			__m128i palette = _mm_setr_epi32( vram[ _mm_extract_epi32( address, 0 ) ], vram[ _mm_extract_epi32( address, 1 ) ],
+				vram[ _mm_extract_epi32( address, 2 ) ], vram[ _mm_extract_epi32( address, 3 ) ] );
+			palette = _mm_srli_epi32( palette, 8 );
+			if ( params.repeat == 2 )
+			{
+				palette = _mm_and_si128( palette, inBounds );
+			}
+
+			palette = _mm_packus_epi16( _mm_packus_epi32( palette, palette ), palette );
+			const uint32_t packed = _mm_cvtsi128_si32( palette );
+			memcpy( palettes + X, &packed, sizeof( packed ) );
+			x = _mm_add_epi32( x, step );
+		}
+	}
+
+	// Eight pixels at a time with both vram reads gathered. The gathers read a 32 bit lane at each 16 bit word, the
+	// addresses never go past 0x3fff so the extra half is always still inside vram.
+	SMK_TARGET( "avx2" ) void FetchAVX2( const uint16_t* vram, const Params& params, uint8_t* palettes )
+	{
+		const int* base = reinterpret_cast<const int*>( vram );
+		const __m256i originX = _mm256_set1_epi32( params.originX );
+		const __m256i originY = _mm256_set1_epi32( params.originY );
+		const __m256i a = _mm256_set1_epi32( params.a );
+		const __m256i c = _mm256_set1_epi32( params.c );
+		const __m256i tileMask = _mm256_set1_epi32( 127 );
+		const __m256i pixelMask = _mm256_set1_epi32( 7 );
+		const __m256i byteMask = _mm256_set1_epi32( 0xff );
+		const __m256i planeMask = _mm256_set1_epi32( ~1023 );
+		const __m256i step = _mm256_set1_epi32( !params.hflip ? 8 : -8 );
+		__m256i x = !params.hflip ? _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ) : _mm256_setr_epi32( 255, 254, 253, 252, 251, 250, 249, 248 );
+
+		for ( uint32_t X = 0; X < 256; X += 8 )
+		{
+			const __m256i pixelX = _mm256_srai_epi32( _mm256_add_epi32( originX, _mm256_mullo_epi32( a, x ) ), 8 );
+			const __m256i pixelY = _mm256_srai_epi32( _mm256_add_epi32( originY, _mm256_mullo_epi32( c, x ) ), 8 );
+			const __m256i inBounds = _mm256_cmpeq_epi32( _mm256_and_si256( _mm256_or_si256( pixelX, pixelY ), planeMask ), _mm256_setzero_si256() );
+			const __m256i tileAddress = _mm256_or_si256( _mm256_slli_epi32( _mm256_and_si256( _mm256_srai_epi32( pixelY, 3 ), tileMask ), 7 ),
+				_mm256_and_si256( _mm256_srai_epi32( pixelX, 3 ), tileMask ) );
+			const __m256i paletteAddress = _mm256_or_si256( _mm256_slli_epi32( _mm256_and_si256( pixelY, pixelMask ), 3 ),
+				_mm256_and_si256( pixelX, pixelMask ) );
+
+			__m256i tile = _mm256_and_si256( _mm256_i32gather_epi32( base, tileAddress, 2 ), byteMask );
+			if ( params.repeat == 3 )
+			{
+				tile = _mm256_and_si256( tile, inBounds );
+			}
+
+			const __m256i address = _mm256_or_si256( _mm256_slli_epi32( tile, 6 ), paletteAddress );
+			__m256i palette = _mm256_and_si256( _mm256_srli_epi32( _mm256_i32gather_epi32( base, address, 2 ), 8 ), byteMask );
+			if ( params.repeat == 2 )
+			{
+				palette = _mm256_and_si256( palette, inBounds );
+			}
+
+			// The packs work within each 128 bit half, pixels 0-3 end up at the bottom of one and 4-7 of the other.
+			palette = _mm256_packus_epi16( _mm256_packus_epi32( palette, palette ), palette );
+			const uint32_t packed[ 2 ] = { static_cast<uint32_t>( _mm256_extract_epi32( palette, 0 ) ), static_cast<uint32_t>( _mm256_extract_epi32( palette, 4 ) ) };
+			memcpy( palettes + X, packed, sizeof( packed ) );
+			x = _mm256_add_epi32( x, step );
+		}
+	}
+#endif // SMK_X86_64
+
+	Kernel Select()
+	{
+#ifdef SMK_X86_64
+		const CpuFeatures& features = CpuFeatures::Get();
+		if ( features.avx2 )
+		{
+			return FetchAVX2;
+		}
+		if ( features.sse41 )
+		{
+			return FetchSSE41;
+		}
+#endif // SMK_X86_64
+		return FetchScalar;
+	}
+
+	bool Verify()
+	{
+		std::vector<Kernel> kernels;
+#ifdef SMK_X86_64
+		const CpuFeatures& features = CpuFeatures::Get();
+		if ( features.sse41 )
+		{
+			kernels.push_back( FetchSSE41 );
+		}
+		if ( features.avx2 )
+		{
+			kernels.push_back( FetchAVX2 );
+		}
+#endif // SMK_X86_64
+
+		uint64_t random = 0x9e3779b97f4a7c15ull;
+		const auto next = [ &random ]() -> uint32_t
+		{
+			random ^= random << 13;
+			random ^= random >> 7;
+			random ^= random << 17;
+			return static_cast<uint32_t>( random >> 16 );
+		};
+
+		std::vector<uint16_t> vram( 32 * 1024 );
+		for ( uint16_t& word : vram )
+		{
+			word = static_cast<uint16_t>( next() );
+		}
+
+		// Matrices from shrunk to hugely zoomed, with origins anywhere the 13 bit registers can put them, so plenty of
+		// lines leave the plane on one side or both.
+		uint8_t expected[ 256 ];
+		uint8_t actual[ 256 ];
+		for ( uint32_t i = 0; i < 4096; i++ )
+		{
+			Params params;
+			params.a = static_cast<int16_t>( next() ) >> ( next() & 7 );
+			params.c = static_cast<int16_t>( next() ) >> ( next() & 7 );
+			params.originX = ( static_cast<int32_t>( next() ) >> 8 ) * ( i & 1 ? 1 : 16 );
+			params.originY = ( static_cast<int32_t>( next() ) >> 8 ) * ( i & 2 ? 1 : 16 );
+			params.hflip = i & 4;
+			params.repeat = i >> 3 & 3;
+
+			FetchScalar( vram.data(), params, expected );
+			for ( const Kernel kernel : kernels )
+			{
+				kernel( vram.data(), params, actual );
+				if ( memcmp( expected, actual, sizeof( actual ) ) != 0 )
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+}
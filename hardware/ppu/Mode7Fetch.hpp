@@ -0,0 +1,44 @@
+#ifndef MODE7_FETCH_HPP
+#define MODE7_FETCH_HPP
+
+#include <cstdint>
+#include "CpuFeatures.hpp"
+
+// Looks up the palette index of every pixel of a mode 7 line. Pixel X of the line samples the 1024x1024 plane at
+// ( originX + a * x ) >> 8, ( originY + c * x ) >> 8 where x is X, or 255 - X when the line is flipped. Outside the
+// plane repeat 2 is transparent, repeat 3 is tile 0 and the others wrap. Priority, mosaic and color are left to the
+// caller, they're cheap next to the two dependent vram reads per pixel.
+namespace Mode7Fetch
+{
+	struct Params
+	{
+		int32_t originX;
+		int32_t originY;
+		int32_t a;
+		int32_t c;
+		bool hflip;
+		uint32_t repeat;
+	};
+
+	using Kernel = void (*)( const uint16_t* vram, const Params& params, uint8_t* palettes );
+
+	// One pixel at a time, kept as the reference the others have to match.
+	void FetchScalar( const uint16_t* vram, const Params& params, uint8_t* palettes );
+#ifdef SMK_X86_64
+	void FetchSSE41( const uint16_t* vram, const Params& params, uint8_t* palettes );
+	void FetchAVX2( const uint16_t* vram, const Params& params, uint8_t* palettes );
+#endif // SMK_X86_64
+
+	// The fastest version this machine runs.
+	Kernel Select();
+	// Runs every version this machine supports against FetchScalar, false if any of them differs.
+	bool Verify();
+
+	inline void Fetch( const uint16_t* vram, const Params& params, uint8_t* palettes )
+	{
+		static const Kernel kernel = Select();
+		kernel( vram, params, palettes );
+	}
+}
+
+#endif // MODE7_FETCH_HPP
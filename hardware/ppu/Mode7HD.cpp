@@ -0,0 +1,234 @@
+#include "Mode7HD.hpp"
+#include <climits>
+#include <cstring>
+#include <vector>
+#ifdef SMK_X86_64
+#include <immintrin.h>
+#endif // SMK_X86_64
+
+namespace Mode7HD
+{
+	void DrawRowScalar( const uint16_t* vram, const uint16_t* cgram, const Params& params, const uint8_t* enable,
+		const float* subpixelX, const uint32_t count, Compositor::Pixel* above, Compositor::Pixel* below )
+	{
+		Compositor::Pixel pixel;
+		bool visible = false;
+		int32_t pixelXp = INT_MIN;
+		int32_t pixelYp = INT_MIN;
+		for ( uint32_t p = 0; p < count; p++ )
+		{
+			const int32_t pixelX = static_cast<int32_t>( ( params.originX + params.a * subpixelX[ p ] ) / 256 );
+			const int32_t pixelY = static_cast<int32_t>( ( params.originY + params.c * subpixelX[ p ] ) / 256 );
+
+			if ( pixelX != pixelXp || pixelY != pixelYp )
+			{
+				const bool outOfBounds = ( pixelX | pixelY ) & ~1023;
+				const uint32_t tile = params.repeat == 3 && outOfBounds ? 0 : vram[ ( pixelY >> 3 & 127 ) * 128 + ( pixelX >> 3 & 127 ) ] & 0xff;
+				uint32_t palette = params.repeat == 2 && outOfBounds ? 0 : vram[ ( ( pixelY & 7 ) << 3 ) + ( pixelX & 7 ) + ( tile << 6 ) ] >> 8;
+
+				uint8_t priority = params.priority[ 0 ];
+				if ( params.extbg )
+				{
+					priority = params.priority[ palette >> 7 ];
+					palette &= 0x7f;
+				}
+
+				visible = palette != 0;
+				pixel = { params.source, priority, cgram[ palette ] };
+				pixelXp = pixelX;
+				pixelYp = pixelY;
+			}
+			if ( !visible )
+			{
+				continue;
+			}
+
+			if ( enable[ p ] & 1 && ( !params.extbg || pixel.priority > above[ p ].priority ) )
+			{
+				above[ p ] = pixel;
+			}
+			if ( enable[ p ] & 2 && ( !params.extbg || pixel.priority > below[ p ].priority ) )
+			{
+				below[ p ] = pixel;
+			}
+		}
+	}
+
+#ifdef SMK_X86_64
+	// Eight subpixels at a time with the vram and cgram reads gathered. Every subpixel looks its color up again, which
+	// comes out the same as DrawRowScalar only doing so when the coordinates change.
+	SMK_TARGET( "avx2" ) void DrawRowAVX2( const uint16_t* vram, const uint16_t* cgram, const Params& params, const uint8_t* enable,
+		const float* subpixelX, const uint32_t count, Compositor::Pixel* above, Compositor::Pixel* below )
+	{
+		static_assert( sizeof( Compositor::Pixel ) == 4, "a pixel is written as one 32 bit lane" );
+		const int* vramWords = reinterpret_cast<const int*>( vram );
+		const int* palette = reinterpret_cast<const int*>( cgram );
+
+		const __m256 originX = _mm256_set1_ps( params.originX );
+		const __m256 originY = _mm256_set1_ps( params.originY );
+		const __m256 a = _mm256_set1_ps( params.a );
+		const __m256 c = _mm256_set1_ps( params.c );
+		const __m256 divisor = _mm256_set1_ps( 1.0f / 256 );
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i byteMask = _mm256_set1_epi32( 0xff );
+		const __m256i tileMask = _mm256_set1_epi32( 127 );
+		const __m256i pixelMask = _mm256_set1_epi32( 7 );
+		const __m256i planeMask = _mm256_set1_epi32( ~1023 );
+		const __m256i priority0 = _mm256_set1_epi32( params.priority[ 0 ] );
+		const __m256i priority1 = _mm256_set1_epi32( params.priority[ 1 ] );
+		const __m256i sourceBits = _mm256_set1_epi32( params.source );
+		const __m256i aboveBit = _mm256_set1_epi32( 1 );
+		const __m256i belowBit = _mm256_set1_epi32( 2 );
+
+		for ( uint32_t p = 0; p < count; p += 8 )
+		{
+			// Float multiply and add, then truncate, exactly like ( originX + a * x ) / 256.
+			const __m256 x = _mm256_loadu_ps( subpixelX + p );
+			const __m256i pixelX = _mm256_cvttps_epi32( _mm256_mul_ps( _mm256_add_ps( originX, _mm256_mul_ps( a, x ) ), divisor ) );
+			const __m256i pixelY = _mm256_cvttps_epi32( _mm256_mul_ps( _mm256_add_ps( originY, _mm256_mul_ps( c, x ) ), divisor ) );
+			const __m256i inBounds = _mm256_cmpeq_epi32( _mm256_and_si256( _mm256_or_si256( pixelX, pixelY ), planeMask ), zero );
+
+			const __m256i tileAddress = _mm256_or_si256( _mm256_slli_epi32( _mm256_and_si256( _mm256_srai_epi32( pixelY, 3 ), tileMask ), 7 ),
+				_mm256_and_si256( _mm256_srai_epi32( pixelX, 3 ), tileMask ) );
+			__m256i tile = _mm256_and_si256( _mm256_i32gather_epi32( vramWords, tileAddress, 2 ), byteMask );
+			if ( params.repeat == 3 )
+			{
+				tile = _mm256_and_si256( tile, inBounds );
+			}
+
+			const __m256i paletteAddress = _mm256_or_si256( _mm256_slli_epi32( tile, 6 ),
+				_mm256_or_si256( _mm256_slli_epi32( _mm256_and_si256( pixelY, pixelMask ), 3 ), _mm256_and_si256( pixelX, pixelMask ) ) );
+			__m256i index = _mm256_and_si256( _mm256_srli_epi32( _mm256_i32gather_epi32( vramWords, paletteAddress, 2 ), 8 ), byteMask );
+			if ( params.repeat == 2 )
+			{
+				index = _mm256_and_si256( index, inBounds );
+			}
+
+			__m256i priority = priority0;
+			if ( params.extbg )
+			{
+				priority = _mm256_blendv_epi8( priority0, priority1, _mm256_cmpgt_epi32( index, _mm256_set1_epi32( 0x7f ) ) );
+				index = _mm256_and_si256( index, _mm256_set1_epi32( 0x7f ) );
+			}
+			const __m256i visible = _mm256_xor_si256( _mm256_cmpeq_epi32( index, zero ), _mm256_set1_epi32( -1 ) );
+
+			// The 32 bits ending at cgram[ index ], so index 255 doesn't read past the end. Transparent lanes read nothing.
+			const __m256i colorOffset = _mm256_sub_epi32( _mm256_slli_epi32( index, 1 ), belowBit );
+			const __m256i color = _mm256_srli_epi32( _mm256_mask_i32gather_epi32( zero, palette, colorOffset, visible, 1 ), 16 );
+			const __m256i pixel = _mm256_or_si256( sourceBits, _mm256_or_si256( _mm256_slli_epi32( priority, 8 ), _mm256_slli_epi32( color, 16 ) ) );
+
+			const __m256i enabled = _mm256_cvtepu8_epi32( _mm_loadl_epi64( reinterpret_cast<const __m128i*>( enable + p ) ) );
+			__m256i aboveMask = _mm256_and_si256( visible, _mm256_cmpeq_epi32( _mm256_and_si256( enabled, aboveBit ), aboveBit ) );
+			__m256i belowMask = _mm256_and_si256( visible, _mm256_cmpeq_epi32( _mm256_and_si256( enabled, belowBit ), belowBit ) );
+			if ( params.extbg )
+			{
+				// Only over what has a lower priority, the priority is the second byte of a pixel.
+				const __m256i abovePixels = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( above + p ) );
+				const __m256i belowPixels = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( below + p ) );
+				aboveMask = _mm256_and_si256( aboveMask, _mm256_cmpgt_epi32( priority, _mm256_and_si256( _mm256_srli_epi32( abovePixels, 8 ), byteMask ) ) );
+				belowMask = _mm256_and_si256( belowMask, _mm256_cmpgt_epi32( priority, _mm256_and_si256( _mm256_srli_epi32( belowPixels, 8 ), byteMask ) ) );
+			}
+			_mm256_maskstore_epi32( reinterpret_cast<int*>( above + p ), aboveMask, pixel );
+			_mm256_maskstore_epi32( reinterpret_cast<int*>( below + p ), belowMask, pixel );
+		}
+	}
+#endif // SMK_X86_64
+
+	Kernel Select()
+	{
+#ifdef SMK_X86_64
+		if ( CpuFeatures::Get().avx2 )
+		{
+			return DrawRowAVX2;
+		}
+#endif // SMK_X86_64
+		return DrawRowScalar;
+	}
+
+	bool Verify()
+	{
+		std::vector<Kernel> kernels;
+#ifdef SMK_X86_64
+		if ( CpuFeatures::Get().avx2 )
+		{
+			kernels.push_back( DrawRowAVX2 );
+		}
+#endif // SMK_X86_64
+
+		uint64_t random = 0x9e3779b97f4a7c15ull;
+		const auto next = [ &random ]() -> uint32_t
+		{
+			random ^= random << 13;
+			random ^= random >> 7;
+			random ^= random << 17;
+			return static_cast<uint32_t>( random >> 16 );
+		};
+		const auto nextFloat = [ &next ]( const float range ) -> float
+		{
+			return ( static_cast<float>( next() & 0xffff ) / 32768.0f - 1.0f ) * range;
+		};
+
+		std::vector<uint16_t> vram( 32 * 1024 );
+		for ( uint16_t& word : vram )
+		{
+			word = static_cast<uint16_t>( next() );
+		}
+		uint16_t cgram[ 256 ];
+		for ( uint16_t& color : cgram )
+		{
+			color = static_cast<uint16_t>( next() & 0x7fff );
+		}
+
+		// Rows of every hd scale, zoomed in and out and rotated, with origins that leave the plane on either side.
+		constexpr uint32_t maxCount = 256 * 4;
+		uint8_t enable[ maxCount ];
+		float subpixelX[ maxCount ];
+		std::vector<Compositor::Pixel> initial( 2 * maxCount );
+		std::vector<Compositor::Pixel> expected( 2 * maxCount );
+		std::vector<Compositor::Pixel> actual( 2 * maxCount );
+		for ( uint32_t i = 0; i < 1024; i++ )
+		{
+			const uint32_t scale = 1 + ( i & 3 );
+			const uint32_t count = 256 * scale;
+			const bool hflip = i & 4;
+			for ( uint32_t x = 0; x < 256; x++ )
+			{
+				const uint8_t enabled = static_cast<uint8_t>( next() & 3 );
+				for ( uint32_t xs = 0; xs < scale; xs++ )
+				{
+					const float xf = x + xs * 1.0 / scale - 0.5;
+					enable[ x * scale + xs ] = enabled;
+					subpixelX[ x * scale + xs ] = hflip ? 255 - xf : xf;
+				}
+			}
+			for ( Compositor::Pixel& pixel : initial )
+			{
+				pixel = { static_cast<uint8_t>( next() % 7 ), static_cast<uint8_t>( next() & 3 ), static_cast<uint16_t>( next() & 0x7fff ) };
+			}
+
+			Params params;
+			params.a = nextFloat( 1024.0f );
+			params.c = nextFloat( 1024.0f );
+			params.originX = nextFloat( 1 << 19 );
+			params.originY = nextFloat( 1 << 19 );
+			params.repeat = i >> 3 & 3;
+			params.extbg = i & 32;
+			params.source = params.extbg ? 1 : 0;
+			params.priority[ 0 ] = static_cast<uint8_t>( next() & 3 );
+			params.priority[ 1 ] = static_cast<uint8_t>( next() & 3 );
+
+			expected = initial;
+			DrawRowScalar( vram.data(), cgram, params, enable, subpixelX, count, expected.data(), expected.data() + maxCount );
+			for ( const Kernel kernel : kernels )
+			{
+				actual = initial;
+				kernel( vram.data(), cgram, params, enable, subpixelX, count, actual.data(), actual.data() + maxCount );
+				if ( memcmp( expected.data(), actual.data(), actual.size() * sizeof( Compositor::Pixel ) ) != 0 )
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+}
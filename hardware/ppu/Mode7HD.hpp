@@ -0,0 +1,52 @@
+#ifndef MODE7_HD_HPP
+#define MODE7_HD_HPP
+
+#include <cstdint>
+#include "CpuFeatures.hpp"
+#include "Compositor.hpp"
+
+// Draws one row of HD mode 7 subpixels. Subpixel p samples the plane at ( originX + a * x ) / 256,
+// ( originY + c * x ) / 256 in floats, where x is subpixelX[ p ]. Outside the plane repeat 2 is transparent, repeat 3
+// is tile 0 and the others wrap. Opaque subpixels are drawn above where bit 0 of enable[ p ] is set and below where bit
+// 1 is, with EXTBG only over pixels of a lower priority. Direct color is left to the caller.
+namespace Mode7HD
+{
+	struct Params
+	{
+		float originX;
+		float originY;
+		float a;
+		float c;
+		uint32_t repeat;
+		bool extbg;          // BG2, bit 7 of the palette index picks the priority
+		uint8_t source;
+		uint8_t priority[ 2 ];
+	};
+
+	// count is a multiple of 8.
+	using Kernel = void (*)( const uint16_t* vram, const uint16_t* cgram, const Params& params, const uint8_t* enable,
+		const float* subpixelX, const uint32_t count, Compositor::Pixel* above, Compositor::Pixel* below );
+
+	// One subpixel at a time, only looking the color up again when the coordinates change. Kept as the reference the
+	// others have to match.
+	void DrawRowScalar( const uint16_t* vram, const uint16_t* cgram, const Params& params, const uint8_t* enable,
+		const float* subpixelX, const uint32_t count, Compositor::Pixel* above, Compositor::Pixel* below );
+#ifdef SMK_X86_64
+	void DrawRowAVX2( const uint16_t* vram, const uint16_t* cgram, const Params& params, const uint8_t* enable,
+		const float* subpixelX, const uint32_t count, Compositor::Pixel* above, Compositor::Pixel* below );
+#endif // SMK_X86_64
+
+	// The fastest version this machine runs.
+	Kernel Select();
+	// Runs every version this machine supports against DrawRowScalar, false if any of them differs.
+	bool Verify();
+
+	inline void DrawRow( const uint16_t* vram, const uint16_t* cgram, const Params& params, const uint8_t* enable,
+		const float* subpixelX, const uint32_t count, Compositor::Pixel* above, Compositor::Pixel* below )
+	{
+		static const Kernel kernel = Select();
+		kernel( vram, cgram, params, enable, subpixelX, count, above, below );
+	}
+}
+
+#endif // MODE7_HD_HPP
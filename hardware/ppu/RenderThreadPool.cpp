@@ -0,0 +1,102 @@
+#include "RenderThreadPool.hpp"
+#include <algorithm>
+
+RenderThreadPool::~RenderThreadPool()
+{
+	Stop();
+}
+
+void RenderThreadPool::Start( const uint32_t workers )
+{
+	Stop();
+#ifndef __EMSCRIPTEN__
+	m_Stop = false;
+	for ( uint32_t worker = 1; worker <= workers; worker++ )
+	{
+		m_Workers.emplace_back( &RenderThreadPool::WorkerThread, this, worker );
+	}
+#endif // __EMSCRIPTEN__
+}
+
+void RenderThreadPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_Stop = true;
+	}
+	m_Started.notify_all();
+	for ( auto& worker : m_Workers )
+	{
+		worker.join();
+	}
+	m_Workers.clear();
+}
+
+void RenderThreadPool::Run( const Job job, const uint32_t count )
+{
+	if ( m_Workers.empty() )
+	{
+		for ( uint32_t index = 0; index < count; index++ )
+		{
+			job( index, 0 );
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_Job = job;
+		m_Count = count;
+		m_Next.store( 0, std::memory_order_relaxed );
+		m_Running = GetWorkerCount();
+		m_Generation++;
+	}
+	m_Started.notify_all();
+
+	Work( 0 );
+
+	std::unique_lock<std::mutex> lock( m_Mutex );
+	m_Finished.wait( lock, [ this ] { return m_Running == 0; } );
+}
+
+void RenderThreadPool::WorkerThread( const uint32_t worker )
+{
+	uint64_t generation = 0;
+	std::unique_lock<std::mutex> lock( m_Mutex );
+	while ( true )
+	{
+		m_Started.wait( lock, [ this, generation ] { return m_Stop || m_Generation != generation; } );
+		if ( m_Stop )
+		{
+			return;
+		}
+
+		generation = m_Generation;
+		lock.unlock();
+		Work( worker );
+		lock.lock();
+
+		if ( --m_Running == 0 )
+		{
+			m_Finished.notify_one();
+		}
+	}
+}
+
+void RenderThreadPool::Work( const uint32_t worker )
+{
+	while ( true )
+	{
+		const uint32_t first = m_Next.fetch_add( INDICES_PER_TAKE, std::memory_order_relaxed );
+		if ( first >= m_Count )
+		{
+			return;
+		}
+
+		const uint32_t last = std::min( first + INDICES_PER_TAKE, m_Count );
+		for ( uint32_t index = first; index < last; index++ )
+		{
+			m_Job( index, worker );
+		}
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef RENDER_THREAD_POOL_HPP
+#define RENDER_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent threads the PPU hands its lines to at every flush. The thread calling Run works through the indices along
+// with them, taking a few at a time, so with no workers everything simply runs on that thread in order. Jobs must only
+// write to what belongs to their own index, or to their thread's scratch space picked by worker, for the result not to
+// depend on the number of threads. The calling thread is worker 0 and the others 1 to GetWorkerCount().
+class RenderThreadPool
+{
+public:
+	using Job = void (*)( const uint32_t index, const uint32_t worker );
+
+	RenderThreadPool() = default;
+	RenderThreadPool( const RenderThreadPool& other ) = delete;
+	RenderThreadPool& operator=( const RenderThreadPool& other ) = delete;
+	~RenderThreadPool();
+
+	void Start( const uint32_t workers );
+	void Stop();
+	uint32_t GetWorkerCount() const { return static_cast<uint32_t>( m_Workers.size() ); }
+
+	// Calls job for every index below count and returns once they have all finished.
+	void Run( const Job job, const uint32_t count );
+
+private:
+	void WorkerThread( const uint32_t worker );
+	void Work( const uint32_t worker );
+
+	// Big enough that the workers don't fight over m_Next, small enough to even out lines that take longer.
+	static constexpr uint32_t INDICES_PER_TAKE = 4;
+
+	std::vector<std::thread> m_Workers;
+	std::mutex m_Mutex;
+	std::condition_variable m_Started;
+	std::condition_variable m_Finished;
+	uint64_t m_Generation = 0;
+	uint32_t m_Running = 0;
+	bool m_Stop = false;
+
+	Job m_Job = nullptr;
+	uint32_t m_Count = 0;
+	std::atomic<uint32_t> m_Next{ 0 };
+};
+
+#endif // RENDER_THREAD_POOL_HPP
@@ -0,0 +1,192 @@
+#include "TileDecode.hpp"
+#include <cstring>
+#include <vector>
+#ifdef SMK_X86_64
+#include <immintrin.h>
+#endif // SMK_X86_64
+
+namespace
+{
+	void StoreRow( uint64_t row, const bool hflip, uint8_t* colors )
+	{
+		// Built with the leftmost pixel in the lowest byte, mirroring the row is reversing its bytes.
+		if ( hflip )
+		{
+#ifdef _MSC_VER
+			row = _byteswap_uint64( row );
+#else
+			row = __builtin_bswap64( row );
+#endif // _MSC_VER
+		}
+		memcpy( colors, &row, sizeof( row ) );
+	}
+}
+
+namespace TileDecode
+{
+	void DecodeScalar( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors )
+	{
+		for ( uint32_t n = 0; n < count; n++ )
+		{
+			const uint64_t data = rows[ n ];
+			for ( uint32_t tileX = 0; tileX < 8; tileX++ )
+			{
+				uint32_t color, shift = hflip[ n ] ? tileX : 7 - tileX;
+				color = data >> ( shift + 0 ) & 1;
+				color += data >> ( shift + 7 ) & 2;
+				color += data >> ( shift + 14 ) & 4;
+				color += data >> ( shift + 21 ) & 8;
+				color += data >> ( shift + 28 ) & 16;
+				color += data >> ( shift + 35 ) & 32;
+				color += data >> ( shift + 42 ) & 64;
+				color += data >> ( shift + 49 ) & 128;
+				colors[ n * 8 + tileX ] = color;
+			}
+		}
+	}
+
+#ifdef SMK_X86_64
+	// With a plane in every byte, movemask gathers the top bit of each plane, which is the palette index of the leftmost
+	// pixel. Adding the planes to themselves moves the next pixel up to the top bit. Two rows fill the 16 bytes.
+	void DecodeSSE2( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors )
+	{
+		uint32_t n = 0;
+		for ( ; n + 2 <= count; n += 2 )
+		{
+			__m128i planes = _mm_loadu_si128( reinterpret_cast<const __m128i*>( rows + n ) );
+			uint64_t first = 0, second = 0;
+			for ( uint32_t tileX = 0; tileX < 8; tileX++ )
+			{
+				const uint32_t mask = _mm_movemask_epi8( planes );
+				first |= static_cast<uint64_t>( mask & 0xff ) << tileX * 8;
+				second |= static_cast<uint64_t>( mask >> 8 ) << tileX * 8;
+				planes = _mm_add_epi8( planes, planes );
+			}
+			StoreRow( first, hflip[ n ], colors + n * 8 );
+			StoreRow( second, hflip[ n + 1 ], colors + n * 8 + 8 );
+		}
+		if ( n < count )
+		{
+			__m128i planes = _mm_loadl_epi64( reinterpret_cast<const __m128i*>( rows + n ) );
+			uint64_t row = 0;
+			for ( uint32_t tileX = 0; tileX < 8; tileX++ )
+			{
+				row |= static_cast<uint64_t>( _mm_movemask_epi8( planes ) & 0xff ) << tileX * 8;
+				planes = _mm_add_epi8( planes, planes );
+			}
+			StoreRow( row, hflip[ n ], colors + n * 8 );
+		}
+	}
+
+	// pdep scatters the 8 bits of a plane to the same bit of 8 bytes, rightmost pixel first.
+	SMK_TARGET( "bmi2" ) void DecodeBMI2( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors )
+	{
+		for ( uint32_t n = 0; n < count; n++ )
+		{
+			const uint64_t data = rows[ n ];
+			uint64_t row = 0;
+			for ( uint32_t plane = 0; plane < 8; plane++ )
+			{
+				row |= _pdep_u64( data >> plane * 8, 0x0101010101010101ull << plane );
+			}
+			StoreRow( row, !hflip[ n ], colors + n * 8 );
+		}
+	}
+
+	// Four rows at a time, each transposed as an 8x8 bit matrix in three steps that swap 1x1, 2x2 and 4x4 blocks. That
+	// leaves pixel x in byte 7 - x, so the rows that aren't flipped have their bytes reversed by the shuffle.
+	SMK_TARGET( "avx2" ) void DecodeAVX2( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors )
+	{
+		const __m256i swap1 = _mm256_set1_epi64x( 0x00aa00aa00aa00aall );
+		const __m256i swap2 = _mm256_set1_epi64x( 0x0000cccc0000ccccll );
+		const __m256i swap4 = _mm256_set1_epi64x( 0x00000000f0f0f0f0ll );
+		const __m256i inOrder = _mm256_setr_epi8( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 );
+		const __m256i reversed = _mm256_setr_epi8( 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 );
+		uint32_t n = 0;
+		for ( ; n + 4 <= count; n += 4 )
+		{
+			__m256i x = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( rows + n ) );
+			__m256i t = _mm256_and_si256( _mm256_xor_si256( x, _mm256_srli_epi64( x, 7 ) ), swap1 );
+			x = _mm256_xor_si256( x, _mm256_xor_si256( t, _mm256_slli_epi64( t, 7 ) ) );
+			t = _mm256_and_si256( _mm256_xor_si256( x, _mm256_srli_epi64( x, 14 ) ), swap2 );
+			x = _mm256_xor_si256( x, _mm256_xor_si256( t, _mm256_slli_epi64( t, 14 ) ) );
+			t = _mm256_and_si256( _mm256_xor_si256( x, _mm256_srli_epi64( x, 28 ) ), swap4 );
+			x = _mm256_xor_si256( x, _mm256_xor_si256( t, _mm256_slli_epi64( t, 28 ) ) );
+
+			uint32_t flips;
+			memcpy( &flips, hflip + n, sizeof( flips ) );
+			const __m256i unflipped = _mm256_cmpeq_epi64( _mm256_cvtepu8_epi64( _mm_cvtsi32_si128( flips ) ), _mm256_setzero_si256() );
+			const __m256i order = _mm256_blendv_epi8( inOrder, reversed, unflipped );
+			_mm256_storeu_si256( reinterpret_cast<__m256i*>( colors + n * 8 ), _mm256_shuffle_epi8( x, order ) );
+		}
+		if ( n < count )
+		{
+			DecodeSSE2( rows + n, hflip + n, count - n, colors + n * 8 );
+		}
+	}
+#endif // SMK_X86_64
+
+	Kernel Select()
+	{
+#ifdef SMK_X86_64
+		// Not DecodeBMI2, see TileDecode.hpp.
+		if ( CpuFeatures::Get().avx2 )
+		{
+			return DecodeAVX2;
+		}
+		return DecodeSSE2;
+#else
+		return DecodeScalar;
+#endif // SMK_X86_64
+	}
+
+	bool Verify()
+	{
+		std::vector<Kernel> kernels;
+#ifdef SMK_X86_64
+		const CpuFeatures& features = CpuFeatures::Get();
+		kernels.push_back( DecodeSSE2 );
+		if ( features.bmi2 )
+		{
+			kernels.push_back( DecodeBMI2 );
+		}
+		if ( features.avx2 )
+		{
+			kernels.push_back( DecodeAVX2 );
+		}
+#endif // SMK_X86_64
+
+		// Every 2bpp row, then a fixed pseudo random spread of 4bpp and 8bpp ones, in odd sized batches so the tails of
+		// the wider kernels run too.
+		constexpr uint32_t BATCH = 7;
+		uint64_t rows[ BATCH ];
+		uint8_t hflip[ BATCH ];
+		uint8_t expected[ BATCH * 8 ];
+		uint8_t actual[ BATCH * 8 ];
+		uint64_t random = 0x9e3779b97f4a7c15ull;
+		for ( uint32_t i = 0; i < 0x10000 + 0x40000; i += BATCH )
+		{
+			for ( uint32_t n = 0; n < BATCH; n++ )
+			{
+				random ^= random << 13;
+				random ^= random >> 7;
+				random ^= random << 17;
+				rows[ n ] = i + n < 0x10000 ? i + n : random >> ( ( i + n ) & 1 ? 32 : 0 );
+				hflip[ n ] = ( i + n ) >> 1 & 1;
+			}
+
+			DecodeScalar( rows, hflip, BATCH, expected );
+			for ( const Kernel kernel : kernels )
+			{
+				kernel( rows, hflip, BATCH, actual );
+				if ( memcmp( expected, actual, sizeof( actual ) ) != 0 )
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+}
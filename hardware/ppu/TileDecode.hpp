@@ -0,0 +1,37 @@
+#ifndef TILE_DECODE_HPP
+#define TILE_DECODE_HPP
+
+#include <cstdint>
+#include "CpuFeatures.hpp"
+
+// Turns rows of SNES tile bitplanes into palette indices. A row is a uint64_t holding bitplane p in byte p, so
+// vram[ address + 0 ] | vram[ address + 8 ] << 16 | ... with the planes past the tile's bpp zeroed. Each row comes
+// out as 8 indices in screen order, left to right or right to left when hflip is set for it.
+namespace TileDecode
+{
+	using Kernel = void (*)( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors );
+
+	// The plain shift and mask version, kept as the reference the others have to match.
+	void DecodeScalar( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors );
+#ifdef SMK_X86_64
+	void DecodeSSE2( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors );
+	// Eight pdeps a row come out no faster than DecodeSSE2 in ppu_kernels, so Select never picks it. It's only kept to be
+	// checked and timed.
+	void DecodeBMI2( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors );
+	void DecodeAVX2( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors );
+#endif // SMK_X86_64
+
+	// DecodeAVX2 where the CPU has it, which decodes a tile about five times as fast as DecodeSSE2 in ppu_kernels, otherwise
+	// DecodeSSE2.
+	Kernel Select();
+	// Runs every version this machine supports against DecodeScalar, false if any of them differs.
+	bool Verify();
+
+	inline void Decode( const uint64_t* rows, const uint8_t* hflip, const uint32_t count, uint8_t* colors )
+	{
+		static const Kernel kernel = Select();
+		kernel( rows, hflip, count, colors );
+	}
+}
+
+#endif // TILE_DECODE_HPP
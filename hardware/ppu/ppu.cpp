@@ -1,4 +1,7 @@
 #include "ppu.hpp"
+#include "../IoRegisters.hpp"
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 #include <limits>
 #include <utility>
@@ -12,6 +15,13 @@
 #include <SDL_video.h>
 #include "../dma/Dma.hpp"
 #include "../hardware.hpp"
+#include "../FrameProfiler.hpp"
+#include "../Serializer.hpp"
+#include "../FrameQueue.hpp"
+#include "TileDecode.hpp"
+#include "Mode7Fetch.hpp"
+#include "Compositor.hpp"
+#include "Mode7HD.hpp"
 #include <iostream>
 
 struct range_t {
@@ -119,6 +129,7 @@ auto PPU::writeVRAM( uint8 data ) -> void {
 	if ( !io.displayDisable /*&& cpu.vcounter() < vdisp()*/ && !noVRAMBlocking() ) return;
 	//Line::flush();
 	auto address = vramAddress();
+	vramDirty[ address >> 9 ] |= 1ull << ( address >> 3 & 63 );
 	if constexpr ( Byte == 0 ) {
 		vram[ address ] = vram[ address ] & 0xff00 | data << 0;
 	}
@@ -162,8 +173,11 @@ auto PPU::writeCGRAM( uint8 address, uint15 data ) -> void {
 	cgram[ address ] = data;
 }
 
-auto PPU::readIO( uint address, uint8 data ) -> uint8 {
+//each register gets its own instantiation of readIO/writeIO, see mapIO
+template<uint Address>
+auto PPU::readIO( uint8 data ) -> uint8 {
 	//cpu.synchronizePPU();
+	constexpr uint address = Address;
 
 	switch ( address & 0xffff ) {
 
@@ -282,8 +296,10 @@ auto PPU::readIO( uint address, uint8 data ) -> uint8 {
 	return data;
 }
 
-auto PPU::writeIO( uint address, uint8 data ) -> void {
+template<uint Address>
+auto PPU::writeIO( uint8 data ) -> void {
 	//cpu.synchronizePPU();
+	constexpr uint address = Address;
 
 	switch ( address & 0xffff ) {
 
@@ -684,6 +700,27 @@ auto PPU::writeIO( uint address, uint8 data ) -> void {
 	}
 }
 
+template<uint Address>
+static auto readRegister( void* ppu, uint32 address ) -> uint8 {
+	return static_cast<PPU*>( ppu )->readIO<Address>( 0 );
+}
+
+template<uint Address>
+static auto writeRegister( void* ppu, uint32 address, uint8 data ) -> void {
+	static_cast<PPU*>( ppu )->writeIO<Address>( data );
+}
+
+template<uint First, uint... Offsets>
+static auto mapRegisters( IoRegisters& registers, PPU* ppu, std::integer_sequence<uint, Offsets...> ) -> void {
+	( registers.MapRead( First + Offsets, &readRegister<First + Offsets>, ppu ), ... );
+	( registers.MapWrite( First + Offsets, &writeRegister<First + Offsets>, ppu ), ... );
+}
+
+//$2100-$2103 are write only and $2134-$213f read only, readIO/writeIO fall back to open bus for those
+auto PPU::mapIO( IoRegisters& registers ) -> void {
+	mapRegisters<0x2100>( registers, this, std::make_integer_sequence<uint, 0x40>() );
+}
+
 auto PPU::updateVideoMode() -> void {
 	/*ppubase.display.vdisp = !io.overscan ? 225 : 240;*/
 
@@ -793,33 +830,102 @@ auto PPU::updateVideoMode() -> void {
 
 uint PPU::Line::start = 0;
 uint PPU::Line::count = 0;
+const PPU::RenderSegment* PPU::Line::segment = nullptr;
+
+//cpu side. drawing the lines needs the vram and oam as they are now, so a copy of them goes with the lines.
+//skipped frames, and pipelined ones that will only be drawn later, evaluate the objects here for the STAT77
+//range and time over flags so they are there for the cpu to read at the same time either way.
+auto PPU::Line::flush(bool render) -> void {
+	if ( !Line::count ) return;
+
+	auto& frame = ppu.renderFrames[ ppu.renderFilling ];
+	const bool pipelined = ppu.renderFrames.size() > 1;
+
+	//bucketed for the object size of the first line, a line with another one falls back to looking at all of oam
+	const auto& obj = frame.lines[ Line::start ].io.obj;
+	if ( ppu.objectsDirty || !ppu.objectBuckets.matches( obj ) ) {
+		ppu.objectBuckets.build( ppu.objects, obj.baseSize, obj.interlace );
+		ppu.objectsDirty = false;
+	}
+
+	if ( !render || pipelined ) {
+		for ( uint y = Line::start; y < Line::start + Line::count; y++ ) {
+			bool rangeOver = false, timeOver = false;
+			evaluateFlags( frame.lines[ y ].io.obj, y, ppu.objects, ppu.objectBuckets, rangeOver, timeOver );
+			ppu.io.obj.rangeOver |= rangeOver;
+			ppu.io.obj.timeOver |= timeOver;
+		}
+	}
 
-auto PPU::Line::flush() -> void {
-	if ( Line::count ) {
-		if ( ppu.hdScale() > 1 ) cacheMode7HD();
-#pragma omp parallel for if(Line::count >= 8)
-		for ( uint y = 0; y < Line::count; y++ ) {
-			if ( ppu.deinterlace() ) {
-				if ( !ppu.interlace() ) {
-					//some games enable interlacing in 240p mode, just force these to even fields
-					ppu.lines[ Line::start + y ].render( 0 );
-				}
-				else {
-					//for actual interlaced frames, render both fields every farme for 480i -> 480p
-					ppu.lines[ Line::start + y ].render( 0 );
-					ppu.lines[ Line::start + y ].render( 1 );
-				}
-			}
-			else {
-				//standard 240p (progressive) and 480i (interlaced) rendering
-				ppu.lines[ Line::start + y ].render( 0/*ppu.field()*/ );
+	if ( render ) {
+		auto& segment = frame.segments[ frame.segmentCount++ ];
+		segment.start = Line::start;
+		segment.count = Line::count;
+		segment.latch = ppu.latch;
+		memcpy( segment.vram, ppu.vram, sizeof( segment.vram ) );
+		memcpy( segment.vramDirty, ppu.vramDirty, sizeof( segment.vramDirty ) );
+		memset( ppu.vramDirty, 0, sizeof( ppu.vramDirty ) );
+		memcpy( segment.objects, ppu.objects, sizeof( segment.objects ) );
+		segment.objectBuckets = ppu.objectBuckets;
+		if ( !pipelined ) {
+			ppu.renderSegment( frame, segment );
+			for ( uint y = segment.start; y < segment.start + segment.count; y++ ) {
+				ppu.io.obj.rangeOver |= ppu.lines[ y ].rangeOver;
+				ppu.io.obj.timeOver |= ppu.lines[ y ].timeOver;
 			}
 		}
-		Line::start = 0;
-		Line::count = 0;
 	}
+
+	Line::start = 0;
+	Line::count = 0;
+}
+
+//runs on any of the render threads, only writes to its own line and its own rows of output
+auto PPU::Line::renderLine( uint index, uint worker ) -> void {
+	auto& line = ppu.lines[ Line::segment->start + index ];
+	line.above = &ppu.lineScratch[ worker * 2 * ppu.lineScratchSize ];
+	line.below = line.above + ppu.lineScratchSize;
+	line.rangeOver = false;
+	line.timeOver = false;
+	if ( ppu.deinterlace() ) {
+		if ( !ppu.interlace() ) {
+			//some games enable interlacing in 240p mode, just force these to even fields
+			line.render( 0 );
+		}
+		else {
+			//for actual interlaced frames, render both fields every farme for 480i -> 480p
+			line.render( 0 );
+			line.render( 1 );
+		}
+	}
+	else {
+		//standard 240p (progressive) and 480i (interlaced) rendering
+		line.render( 0/*ppu.field()*/ );
+	}
+}
+
+auto PPU::Line::evaluateFlags( const PPU::IO::Object& self, uint y, const Object* objects, const ObjectBuckets& buckets, bool& rangeOver, bool& timeOver ) -> void {
+	if ( !self.aboveEnable && !self.belowEnable ) return;
+
+	ObjectItem items[ 128 ];
+	uint itemCount = evaluateObjects( self, y, objects, buckets, items );
+	uint tileCount = 0;
+	for ( uint n : range( std::min( itemCount, ppu.ItemLimit ) ) ) {
+		const auto& item = items[ n ];
+
+		uint x = objects[ item.index ].x & 511;
+		for ( uint tileX : range( item.width >> 3 ) ) {
+			uint objectX = x + ( tileX << 3 ) & 511;
+			if ( x != 256 && objectX >= 256 && objectX + 7 < 512 ) continue;
+			if ( tileCount++ >= ppu.TileLimit ) break;
+		}
+	}
+
+	rangeOver = itemCount > ppu.ItemLimit;
+	timeOver = tileCount > ppu.TileLimit;
 }
 
+//cpu side, into the frame being filled
 auto PPU::Line::cache() -> void {
 	cacheBackground( ppu.io.bg1 );
 	cacheBackground( ppu.io.bg2 );
@@ -832,8 +938,20 @@ auto PPU::Line::cache() -> void {
 	//}
 	//else 
 	{
-		memcpy( &io, &ppu.io, sizeof( io ) );
-		memcpy( &cgram, &ppu.cgram, sizeof( cgram ) );
+		auto& line = ppu.renderFrames[ ppu.renderFilling ].lines[ y ];
+		memcpy( &line.io, &ppu.io, sizeof( line.io ) );
+		memcpy( &line.cgram, &ppu.cgram, sizeof( line.cgram ) );
+
+		auto& window = ppu.windowCache;
+		const uint8 edges[ 4 ] = { ppu.io.window.oneLeft, ppu.io.window.oneRight, ppu.io.window.twoLeft, ppu.io.window.twoRight };
+		if ( !window.valid || memcmp( window.edges, edges, sizeof( edges ) ) != 0 ) {
+			memcpy( window.edges, edges, sizeof( edges ) );
+			window.one = windowRange( edges[ 0 ], edges[ 1 ] );
+			window.two = windowRange( edges[ 2 ], edges[ 3 ] );
+			window.valid = true;
+		}
+		line.windowOne = window.one;
+		line.windowTwo = window.two;
 	}
 	if ( !Line::count ) Line::start = y;
 	Line::count++;
@@ -841,17 +959,18 @@ auto PPU::Line::cache() -> void {
 
 auto PPU::Line::render( bool fieldID ) -> void {
 	this->fieldID = fieldID;
-	uint y = this->y + ( !ppu.latch.overscan ? 7 : 0 );
+	const auto& latch = Line::segment->latch;
+	uint y = this->y + ( !latch.overscan ? 7 : 0 );
 
-	auto hd = ppu.hd();
-	auto ss = ppu.ss();
+	auto hd = latch.hd;
+	auto ss = latch.ss;
 	auto scale = ppu.hdScale();
 	auto output = ppu.output + ( !hd
 		? ( y * 1024 + ( ppu.interlace() && field() ? 512 : 0 ) )
 		: ( y * 256 * scale * scale )
 		);
 	auto width = ( !hd
-		? ( !ppu.hires() ? 256 : 512 )
+		? ( !latch.hires ? 256 : 512 )
 		: ( 256 * scale * scale ) );
 
 	if ( io.displayDisable ) {
@@ -882,60 +1001,54 @@ auto PPU::Line::render( bool fieldID ) -> void {
 	renderWindow( io.col.window, io.col.window.aboveMask, windowAbove );
 	renderWindow( io.col.window, io.col.window.belowMask, windowBelow );
 
-	auto luma = ppu.lightTable[ io.displayBrightness ];
-	uint curr = 0, prev = 0;
-	if ( hd ) for ( uint x : range( 256 * scale * scale ) ) {
-		*output++ = luma[ pixel( x / scale & 255, above[ x ], below[ x ] ) ];
-	}
-	else if ( width == 256 ) for ( uint x : range( 256 ) ) {
-		*output++ = luma[ pixel( x, above[ x ], below[ x ] ) ];
-	}
-	else if ( !hires ) for ( uint x : range( 256 ) ) {
-		auto color = luma[ pixel( x, above[ x ], below[ x ] ) ];
-		*output++ = color;
-		*output++ = color;
-	}
-	/*else if ( !configuration.video.blurEmulation ) for ( uint x : range( 256 ) ) {
-		*output++ = luma[ pixel( x, below[ x ], above[ x ] ) ];
-		*output++ = luma[ pixel( x, above[ x ], below[ x ] ) ];
-	}*/
-	else for ( uint x : range( 256 ) ) {
-		curr = luma[ pixel( x, below[ x ], above[ x ] ) ];
-		*output++ = ( prev + curr - ( ( prev ^ curr ) & 0x0421 ) ) >> 1;
-		prev = curr;
-		curr = luma[ pixel( x, above[ x ], below[ x ] ) ];
-		*output++ = ( prev + curr - ( ( prev ^ curr ) & 0x0421 ) ) >> 1;
-		prev = curr;
-	}
-}
-
-auto PPU::Line::pixel( uint x, Pixel above, Pixel below ) const -> uint16 {
-	if ( !windowAbove[ x ] ) above.color = 0x0000;
-	if ( !windowBelow[ x ] ) return above.color;
-	if ( !io.col.enable[ above.source ] ) return above.color;
-	if ( !io.col.blendMode ) return blend( above.color, io.col.fixedColor, io.col.halve && windowAbove[ x ] );
-	return blend( above.color, below.color, io.col.halve && windowAbove[ x ] && below.source != Source::COL );
-}
-
-auto PPU::Line::blend( uint x, uint y, bool halve ) const -> uint16 {
-	if ( !io.col.mathMode ) {  //add
-		if ( !halve ) {
-			uint sum = x + y;
-			uint carry = ( sum - ( ( x ^ y ) & 0x0421 ) ) & 0x8420;
-			return ( sum - carry ) | ( carry - ( carry >> 5 ) );
+	static_assert( Source::COL == Compositor::SourceCOL, "the compositor tells the backdrop apart by its source" );
+	Compositor::Params params;
+	params.enable = 0;
+	for ( uint source : range( 7 ) ) params.enable |= io.col.enable[ source ] << source;
+	params.blendMode = io.col.blendMode;
+	params.subtract = io.col.mathMode;
+	params.halve = io.col.halve;
+	params.fixedColor = io.col.fixedColor;
+	params.luma = ppu.lightTable[ io.displayBrightness ];
+
+	if ( hd ) {
+		//every row is 256 * scale pixels wide, each window bit covers scale of them
+		uint rowWidth = 256 * scale;
+		uint64 aboveMask[ 4 * Mode7Options::MaxScale ] = {};
+		uint64 belowMask[ 4 * Mode7Options::MaxScale ] = {};
+		for ( uint x : range( rowWidth ) ) {
+			aboveMask[ x >> 6 ] |= ( uint64 )windowAbove[ x / scale ] << ( x & 63 );
+			belowMask[ x >> 6 ] |= ( uint64 )windowBelow[ x / scale ] << ( x & 63 );
 		}
-		else {
-			return ( x + y - ( ( x ^ y ) & 0x0421 ) ) >> 1;
+		for ( uint row : range( scale ) ) {
+			Compositor::Compose( above + row * rowWidth, below + row * rowWidth, aboveMask, belowMask, rowWidth, params, output + row * rowWidth );
 		}
 	}
-	else {  //sub
-		uint diff = x - y + 0x8420;
-		uint borrow = ( diff - ( ( x ^ y ) & 0x8420 ) ) & 0x8420;
-		if ( !halve ) {
-			return   ( diff - borrow ) & ( borrow - ( borrow >> 5 ) );
+	else if ( width == 256 ) {
+		Compositor::Compose( above, below, windowAbove.bits, windowBelow.bits, 256, params, output );
+	}
+	else if ( !hires ) {
+		uint16 colors[ 256 ];
+		Compositor::Compose( above, below, windowAbove.bits, windowBelow.bits, 256, params, colors );
+		for ( uint x : range( 256 ) ) {
+			*output++ = colors[ x ];
+			*output++ = colors[ x ];
 		}
-		else {
-			return ( ( ( diff - borrow ) & ( borrow - ( borrow >> 5 ) ) ) & 0x7bde ) >> 1;
+	}
+	else {
+		//the below screen's pixels come first, each averaged with the one to its left
+		uint16 aboveColors[ 256 ];
+		uint16 belowColors[ 256 ];
+		Compositor::Compose( below, above, windowAbove.bits, windowBelow.bits, 256, params, belowColors );
+		Compositor::Compose( above, below, windowAbove.bits, windowBelow.bits, 256, params, aboveColors );
+		uint curr = 0, prev = 0;
+		for ( uint x : range( 256 ) ) {
+			curr = belowColors[ x ];
+			*output++ = ( prev + curr - ( ( prev ^ curr ) & 0x0421 ) ) >> 1;
+			prev = curr;
+			curr = aboveColors[ x ];
+			*output++ = ( prev + curr - ( ( prev ^ curr ) & 0x0421 ) ) >> 1;
+			prev = curr;
 		}
 	}
 }
@@ -950,12 +1063,12 @@ auto PPU::Line::directColor( uint paletteIndex, uint paletteColor ) const -> uin
 }
 
 auto PPU::Line::plotAbove( uint x, uint8 source, uint8 priority, uint16 color ) -> void {
-	if ( ppu.hd() ) return plotHD( above, x, source, priority, color, false, false );
+	if ( Line::segment->latch.hd ) return plotHD( above, x, source, priority, color, false, false );
 	if ( priority > above[ x ].priority ) above[ x ] = { source, priority, color };
 }
 
 auto PPU::Line::plotBelow( uint x, uint8 source, uint8 priority, uint16 color ) -> void {
-	if ( ppu.hd() ) return plotHD( below, x, source, priority, color, false, false );
+	if ( Line::segment->latch.hd ) return plotHD( below, x, source, priority, color, false, false );
 	if ( priority > below[ x ].priority ) below[ x ] = { source, priority, color };
 }
 
@@ -997,8 +1110,8 @@ auto PPU::Line::renderBackground( PPU::IO::Background& self, uint8 source ) -> v
 	if ( self.tileMode == TileMode::Mode7 ) return renderMode7( self, source );
 	if ( self.tileMode == TileMode::Inactive ) return;
 
-	bool windowAbove[ 256 ];
-	bool windowBelow[ 256 ];
+	WindowMask windowAbove;
+	WindowMask windowBelow;
 	renderWindow( self.window, self.window.aboveEnable, windowAbove );
 	renderWindow( self.window, self.window.belowEnable, windowBelow );
 
@@ -1079,33 +1192,13 @@ auto PPU::Line::renderBackground( PPU::IO::Background& self, uint8 source ) -> v
 		uint16 address;
 		address = ( tileNumber << colorShift ) + ( voffset & 7 ^ mirrorY ) & 0x7fff;
 
-		uint64 data;
-		data = (uint64)ppu.vram[ address + 0 ] << 0;
-		data |= (uint64)ppu.vram[ address + 8 ] << 16;
-		data |= (uint64)ppu.vram[ address + 16 ] << 32;
-		data |= (uint64)ppu.vram[ address + 24 ] << 48;
+		const uint8* row = ppu.tileCache.row( self.tileMode, address );
 
 		for ( uint tileX = 0; tileX < 8; tileX++, x++ ) {
 			if ( x & width ) continue;  //x < 0 || x >= width
 			if ( !self.mosaicEnable || --mosaicCounter == 0 ) {
-				uint color, shift = mirrorX ? tileX : 7 - tileX;
-				/*if(self.tileMode >= TileMode::BPP2)*/ {
-					color = data >> shift + 0 & 1;
-					color += data >> shift + 7 & 2;
-				}
-				if ( self.tileMode >= TileMode::BPP4 ) {
-					color += data >> shift + 14 & 4;
-					color += data >> shift + 21 & 8;
-				}
-				if ( self.tileMode >= TileMode::BPP8 ) {
-					color += data >> shift + 28 & 16;
-					color += data >> shift + 35 & 32;
-					color += data >> shift + 42 & 64;
-					color += data >> shift + 49 & 128;
-				}
-
 				mosaicCounter = 1 + io.mosaicSize;
-				mosaicPalette = color;
+				mosaicPalette = row[ tileX ^ mirrorX ];
 				mosaicPriority = tilePriority;
 				if ( directColorMode ) {
 					mosaicColor = directColor( paletteNumber, mosaicPalette );
@@ -1122,7 +1215,7 @@ auto PPU::Line::renderBackground( PPU::IO::Background& self, uint8 source ) -> v
 			}
 			else {
 				uint X = x >> 1;
-				if ( !ppu.hd() ) {
+				if ( !Line::segment->latch.hd ) {
 					if ( x & 1 ) {
 						if ( self.aboveEnable && !windowAbove[ X ] ) plotAbove( X, source, mosaicPriority, mosaicColor );
 					}
@@ -1150,7 +1243,7 @@ auto PPU::Line::getTile( PPU::IO::Background& self, uint hoffset, uint voffset )
 	uint offset = ( tileY & 0x1f ) << 5 | ( tileX & 0x1f );
 	if ( tileX & 0x20 ) offset += screenX;
 	if ( tileY & 0x20 ) offset += screenY;
-	return ppu.vram[ self.screenAddress + offset & 0x7fff ];
+	return Line::segment->vram[ self.screenAddress + offset & 0x7fff ];
 }
 
 auto PPU::Line::renderMode7( PPU::IO::Background& self, uint8 source ) -> void {
@@ -1180,22 +1273,16 @@ auto PPU::Line::renderMode7( PPU::IO::Background& self, uint8 source ) -> void {
 	int originX = ( a * clip( hoffset - hcenter ) & ~63 ) + ( b * clip( voffset - vcenter ) & ~63 ) + ( b * y & ~63 ) + ( hcenter << 8 );
 	int originY = ( c * clip( hoffset - hcenter ) & ~63 ) + ( d * clip( voffset - vcenter ) & ~63 ) + ( d * y & ~63 ) + ( vcenter << 8 );
 
-	bool windowAbove[ 256 ];
-	bool windowBelow[ 256 ];
+	WindowMask windowAbove;
+	WindowMask windowBelow;
 	renderWindow( self.window, self.window.aboveEnable, windowAbove );
 	renderWindow( self.window, self.window.belowEnable, windowBelow );
 
+	uint8 palettes[ 256 ];
+	Mode7Fetch::Fetch( Line::segment->vram, { originX, originY, a, c, io.mode7.hflip, io.mode7.repeat }, palettes );
+
 	for ( int X : range( 256 ) ) {
-		int x = !io.mode7.hflip ? X : 255 - X;
-		int pixelX = originX + a * x >> 8;
-		int pixelY = originY + c * x >> 8;
-		int tileX = pixelX >> 3 & 127;
-		int tileY = pixelY >> 3 & 127;
-		bool outOfBounds = ( pixelX | pixelY ) & ~1023;
-		uint15 tileAddress = tileY * 128 + tileX;
-		uint15 paletteAddress = ( ( pixelY & 7 ) << 3 ) + ( pixelX & 7 );
-		uint8 tile = io.mode7.repeat == 3 && outOfBounds ? 0 : ppu.vram[ tileAddress ] >> 0;
-		uint8 palette = io.mode7.repeat == 2 && outOfBounds ? 0 : ppu.vram[ tile << 6 | paletteAddress ] >> 8;
+		uint8 palette = palettes[ X ];
 
 		uint8 priority;
 		if ( source == Source::BG1 ) {
@@ -1234,14 +1321,14 @@ auto PPU::Line::cacheMode7HD() -> void {
 		bool state = false;
 		uint y;
 		//find the moe 7 groups
-		for ( y = 0; y < Line::count; y++ ) {
-			if ( state != isLineMode7( ppu.lines[ Line::start + y ] ) ) {
+		for ( y = 0; y < Line::segment->count; y++ ) {
+			if ( state != isLineMode7( ppu.lines[ Line::segment->start + y ] ) ) {
 				state = !state;
 				if ( state ) {
-					ppu.mode7LineGroups.startLine[ ppu.mode7LineGroups.count ] = ppu.lines[ Line::start + y ].y;
+					ppu.mode7LineGroups.startLine[ ppu.mode7LineGroups.count ] = ppu.lines[ Line::segment->start + y ].y;
 				}
 				else {
-					ppu.mode7LineGroups.endLine[ ppu.mode7LineGroups.count ] = ppu.lines[ Line::start + y ].y - 1;
+					ppu.mode7LineGroups.endLine[ ppu.mode7LineGroups.count ] = ppu.lines[ Line::segment->start + y ].y - 1;
 					//the lines at the edges of mode 7 groups may be erroneous, so start and end lines for interpolation are moved inside
 					int offset = ( ppu.mode7LineGroups.endLine[ ppu.mode7LineGroups.count ] - ppu.mode7LineGroups.startLine[ ppu.mode7LineGroups.count ] ) / 8;
 					ppu.mode7LineGroups.startLerpLine[ ppu.mode7LineGroups.count ] = ppu.mode7LineGroups.startLine[ ppu.mode7LineGroups.count ] + offset;
@@ -1253,7 +1340,7 @@ auto PPU::Line::cacheMode7HD() -> void {
 #undef isLineMode7
 		if ( state ) {
 			//close the last group if necessary
-			ppu.mode7LineGroups.endLine[ ppu.mode7LineGroups.count ] = ppu.lines[ Line::start + y ].y - 1;
+			ppu.mode7LineGroups.endLine[ ppu.mode7LineGroups.count ] = ppu.lines[ Line::segment->start + y ].y - 1;
 			int offset = ( ppu.mode7LineGroups.endLine[ ppu.mode7LineGroups.count ] - ppu.mode7LineGroups.startLine[ ppu.mode7LineGroups.count ] ) / 8;
 			ppu.mode7LineGroups.startLerpLine[ ppu.mode7LineGroups.count ] = ppu.mode7LineGroups.startLine[ ppu.mode7LineGroups.count ] + offset;
 			ppu.mode7LineGroups.endLerpLine[ ppu.mode7LineGroups.count ] = ppu.mode7LineGroups.endLine[ ppu.mode7LineGroups.count ] - offset;
@@ -1359,17 +1446,18 @@ auto PPU::Line::renderMode7HD( PPU::IO::Background& self, uint8 source ) -> void
 	}
 #undef isLineMode7
 
-	Line line_a = ppu.lines[ y_a ];
-	float a_a = (int16)line_a.io.mode7.a;
-	float b_a = (int16)line_a.io.mode7.b;
-	float c_a = (int16)line_a.io.mode7.c;
-	float d_a = (int16)line_a.io.mode7.d;
+	//only the registers, the rest of those lines belongs to whichever threads are drawing them
+	const auto& mode7_a = ppu.lines[ y_a ].io.mode7;
+	float a_a = (int16)mode7_a.a;
+	float b_a = (int16)mode7_a.b;
+	float c_a = (int16)mode7_a.c;
+	float d_a = (int16)mode7_a.d;
 
-	Line line_b = ppu.lines[ y_b ];
-	float a_b = (int16)line_b.io.mode7.a;
-	float b_b = (int16)line_b.io.mode7.b;
-	float c_b = (int16)line_b.io.mode7.c;
-	float d_b = (int16)line_b.io.mode7.d;
+	const auto& mode7_b = ppu.lines[ y_b ].io.mode7;
+	float a_b = (int16)mode7_b.a;
+	float b_b = (int16)mode7_b.b;
+	float c_b = (int16)mode7_b.c;
+	float d_b = (int16)mode7_b.d;
 
 	int hcenter = (int13)io.mode7.x;
 	int vcenter = (int13)io.mode7.y;
@@ -1381,11 +1469,27 @@ auto PPU::Line::renderMode7HD( PPU::IO::Background& self, uint8 source ) -> void
 		y_b = 255 - y_b;
 	}
 
-	bool windowAbove[ 256 ];
-	bool windowBelow[ 256 ];
+	WindowMask windowAbove;
+	WindowMask windowBelow;
 	renderWindow( self.window, self.window.aboveEnable, windowAbove );
 	renderWindow( self.window, self.window.belowEnable, windowBelow );
 
+	//the same for every row of subpixels, so worked out once for the line. direct color stays on the plain path.
+	const bool kernel = !( io.col.directColor && !extbg );
+	uint8 enable[ 256 * Mode7Options::MaxScale ];
+	float subpixelX[ 256 * Mode7Options::MaxScale ];
+	if ( kernel ) {
+		for ( int x : range( 256 ) ) {
+			uint8 enabled = ( self.aboveEnable && !windowAbove[ x ] ) | ( self.belowEnable && !windowBelow[ x ] ) << 1;
+			for ( int xs : range( scale ) ) {
+				float xf = x + xs * 1.0 / scale - 0.5;
+				if ( io.mode7.hflip ) xf = 255 - xf;
+				enable[ x * scale + xs ] = enabled;
+				subpixelX[ x * scale + xs ] = xf;
+			}
+		}
+	}
+
 	int pixelYp = INT_MIN;
 	for ( int ys : range( scale ) ) {
 		float yf = y + ys * 1.0 / scale - 0.5;
@@ -1401,6 +1505,14 @@ auto PPU::Line::renderMode7HD( PPU::IO::Background& self, uint8 source ) -> void
 		float originX = ( a * ht ) + ( b * vty ) + ( hcenter << 8 );
 		float originY = ( c * ht ) + ( d * vty ) + ( vcenter << 8 );
 
+		if ( kernel ) {
+			Mode7HD::Params params = { originX, originY, a, c, io.mode7.repeat, extbg, source, { self.priority[ 0 ], self.priority[ 1 ] } };
+			Mode7HD::DrawRow( Line::segment->vram, cgram, params, enable, subpixelX, 256 * scale, above + 1, below + 1 );
+			above += 256 * scale;
+			below += 256 * scale;
+			continue;
+		}
+
 		int pixelXp = INT_MIN;
 		for ( int x : range( 256 ) ) {
 			bool doAbove = self.aboveEnable && !windowAbove[ x ];
@@ -1418,8 +1530,8 @@ auto PPU::Line::renderMode7HD( PPU::IO::Background& self, uint8 source ) -> void
 
 				//only compute color again when coordinates have changed
 				if ( pixelX != pixelXp || pixelY != pixelYp ) {
-					uint tile = io.mode7.repeat == 3 && ( ( pixelX | pixelY ) & ~1023 ) ? 0 : ( ppu.vram[ ( pixelY >> 3 & 127 ) * 128 + ( pixelX >> 3 & 127 ) ] & 0xff );
-					uint palette = io.mode7.repeat == 2 && ( ( pixelX | pixelY ) & ~1023 ) ? 0 : ( ppu.vram[ ( ( ( pixelY & 7 ) << 3 ) + ( pixelX & 7 ) ) + ( tile << 6 ) ] >> 8 );
+					uint tile = io.mode7.repeat == 3 && ( ( pixelX | pixelY ) & ~1023 ) ? 0 : ( Line::segment->vram[ ( pixelY >> 3 & 127 ) * 128 + ( pixelX >> 3 & 127 ) ] & 0xff );
+					uint palette = io.mode7.repeat == 2 && ( ( pixelX | pixelY ) & ~1023 ) ? 0 : ( Line::segment->vram[ ( ( ( pixelY & 7 ) << 3 ) + ( pixelX & 7 ) ) + ( tile << 6 ) ] >> 8 );
 
 					uint8 priority;
 					if ( !extbg ) {
@@ -1450,7 +1562,7 @@ auto PPU::Line::renderMode7HD( PPU::IO::Background& self, uint8 source ) -> void
 		}
 	}
 
-	if ( ppu.ss() ) {
+	if ( Line::segment->latch.ss ) {
 		uint divisor = scale * scale;
 		for ( uint p : range( 256 ) ) {
 			uint ab = 0, bb = 0;
@@ -1485,36 +1597,75 @@ auto PPU::Line::lerp( float pa, float va, float pb, float vb, float pr ) -> floa
 	return va + ( vb - va ) / ( pb - pa ) * ( pr - pa );
 }
 
-auto PPU::Line::renderObject( PPU::IO::Object& self ) -> void {
-	if ( !self.aboveEnable && !self.belowEnable ) return;
+auto PPU::Line::objectItem( uint8 baseSize, bool interlace, const Object& object, uint8 index ) -> ObjectItem {
+	ObjectItem item{ true, index };
+	if ( object.size == 0 ) {
+		static const uint widths[] = { 8,  8,  8, 16, 16, 32, 16, 16 };
+		static const uint heights[] = { 8,  8,  8, 16, 16, 32, 32, 32 };
+		item.width = widths[ baseSize ];
+		item.height = heights[ baseSize ];
+		if ( interlace && baseSize >= 6 ) item.height = 16;  //hardware quirk
+	}
+	else {
+		static const uint widths[] = { 16, 32, 64, 32, 64, 64, 32, 32 };
+		static const uint heights[] = { 16, 32, 64, 32, 64, 64, 64, 32 };
+		item.width = widths[ baseSize ];
+		item.height = heights[ baseSize ];
+	}
+	return item;
+}
 
-	bool windowAbove[ 256 ];
-	bool windowBelow[ 256 ];
-	renderWindow( self.window, self.window.aboveEnable, windowAbove );
-	renderWindow( self.window, self.window.belowEnable, windowBelow );
+//cpu side, a counting sort of the objects by the lines they cover
+auto PPU::ObjectBuckets::build( const Object* objects, uint8 baseSize, bool interlace ) -> void {
+	this->valid = true;
+	this->baseSize = baseSize;
+	this->interlace = interlace;
 
-	uint itemCount = 0;
-	uint tileCount = 0;
-	for ( uint n : range( ppu.ItemLimit ) ) items[ n ].valid = false;
-	for ( uint n : range( ppu.TileLimit ) ) tiles[ n ].valid = false;
+	uint16 count[ 256 ] = {};
+	ObjectItem items[ 128 ];
+	for ( uint n : range( 128 ) ) {
+		const auto& object = objects[ n ];
+		items[ n ] = Line::objectItem( baseSize, interlace, object, n );
+		if ( object.x > 256 && object.x + items[ n ].width - 1 < 512 ) items[ n ].valid = false;
+		if ( !items[ n ].valid ) continue;
+		uint height = items[ n ].height >> interlace;
+		for ( uint y : range( height ) ) count[ object.y + y & 255 ]++;
+	}
+
+	start[ 0 ] = 0;
+	for ( uint y : range( 256 ) ) start[ y + 1 ] = start[ y ] + count[ y ];
+	for ( uint y : range( 256 ) ) count[ y ] = start[ y ];
 
 	for ( uint n : range( 128 ) ) {
-		ObjectItem item{ true, uint8_t( self.first + n & 127 ) };
-		const auto& object = ppu.objects[ item.index ];
-
-		if ( object.size == 0 ) {
-			static const uint widths[] = { 8,  8,  8, 16, 16, 32, 16, 16 };
-			static const uint heights[] = { 8,  8,  8, 16, 16, 32, 32, 32 };
-			item.width = widths[ self.baseSize ];
-			item.height = heights[ self.baseSize ];
-			if ( self.interlace && self.baseSize >= 6 ) item.height = 16;  //hardware quirk
-		}
-		else {
-			static const uint widths[] = { 16, 32, 64, 32, 64, 64, 32, 32 };
-			static const uint heights[] = { 16, 32, 64, 32, 64, 64, 64, 32 };
-			item.width = widths[ self.baseSize ];
-			item.height = heights[ self.baseSize ];
+		if ( !items[ n ].valid ) continue;
+		uint height = items[ n ].height >> interlace;
+		for ( uint y : range( height ) ) indices[ count[ objects[ n ].y + y & 255 ]++ ] = n;
+	}
+}
+
+//fills items with the objects on this line, returns how many there were including any past ItemLimit.
+//only the first min(count, ItemLimit) items are written.
+auto PPU::Line::evaluateObjects( const PPU::IO::Object& self, uint y, const Object* objects, const ObjectBuckets& buckets, ObjectItem* items ) -> uint {
+	uint itemCount = 0;
+
+	if ( buckets.matches( self ) ) {
+		//the line's objects in index order, starting from the first object and wrapping around
+		const uint8* begin = &buckets.indices[ buckets.start[ y & 255 ] ];
+		const uint8* end = &buckets.indices[ buckets.start[ ( y & 255 ) + 1 ] ];
+		const uint8* split = std::lower_bound( begin, end, self.first );
+		for ( const uint8* index : { split, begin } ) {
+			for ( const uint8* last = index == split ? end : split; index != last; index++ ) {
+				if ( itemCount++ >= ppu.ItemLimit ) return itemCount;
+				items[ itemCount - 1 ] = objectItem( self.baseSize, self.interlace, objects[ *index ], *index );
+			}
 		}
+		return itemCount;
+	}
+
+	for ( uint n : range( 128 ) ) {
+		uint8 index = self.first + n & 127;
+		const auto& object = objects[ index ];
+		ObjectItem item = objectItem( self.baseSize, self.interlace, object, index );
 
 		if ( object.x > 256 && object.x + item.width - 1 < 512 ) continue;
 		uint height = item.height >> self.interlace;
@@ -1526,11 +1677,24 @@ auto PPU::Line::renderObject( PPU::IO::Object& self ) -> void {
 		}
 	}
 
-	for ( int n = ppu.ItemLimit - 1; n >= 0; n--) {
+	return itemCount;
+}
+
+auto PPU::Line::renderObject( PPU::IO::Object& self ) -> void {
+	if ( !self.aboveEnable && !self.belowEnable ) return;
+
+	WindowMask windowAbove;
+	WindowMask windowBelow;
+	renderWindow( self.window, self.window.aboveEnable, windowAbove );
+	renderWindow( self.window, self.window.belowEnable, windowBelow );
+
+	uint itemCount = evaluateObjects( self, y, Line::segment->objects, Line::segment->objectBuckets, items );
+	uint tileCount = 0;
+
+	for ( int n = std::min( itemCount, ppu.ItemLimit ) - 1; n >= 0; n--) {
 		const auto& item = items[ n ];
-		if ( !item.valid ) continue;
 
-		const auto& object = ppu.objects[ item.index ];
+		const auto& object = Line::segment->objects[ item.index ];
 		uint tileWidth = item.width >> 3;
 		int x = object.x;
 		int y = this->y - object.y & 0xff;
@@ -1574,33 +1738,28 @@ auto PPU::Line::renderObject( PPU::IO::Object& self ) -> void {
 			uint mirrorX = !object.hflip ? tileX : tileWidth - 1 - tileX;
 			uint address = tiledataAddress + ( ( characterY + ( characterX + mirrorX & 15 ) ) << 4 );
 			address = ( address & 0x7ff0 ) + ( y & 7 );
-			tile.data = ppu.vram[ address + 0 ] << 0;
-			tile.data |= ppu.vram[ address + 8 ] << 16;
+			tile.row = ppu.tileCache.row( TileMode::BPP4, address );
 
 			if ( tileCount++ >= ppu.TileLimit ) break;
 			tiles[ tileCount - 1 ] = tile;
 		}
 	}
 
-	ppu.io.obj.rangeOver |= itemCount > ppu.ItemLimit;
-	ppu.io.obj.timeOver |= tileCount > ppu.TileLimit;
+	rangeOver = itemCount > ppu.ItemLimit;
+	timeOver = tileCount > ppu.TileLimit;
 
 	uint8_t palette[ 256 ] = {};
 	uint8_t priority[ 256 ] = {};
 
-	for ( uint n : range( ppu.TileLimit ) ) {
+	for ( uint n : range( std::min( tileCount, ppu.TileLimit ) ) ) {
 		auto& tile = tiles[ n ];
-		if ( !tile.valid ) continue;
 
 		uint tileX = tile.x;
+		uint mirrorX = tile.hflip ? 7 : 0;
 		for ( uint x : range( 8 ) ) {
 			tileX &= 511;
 			if ( tileX < 256 ) {
-				uint color, shift = tile.hflip ? x : 7 - x;
-				color = tile.data >> shift + 0 & 1;
-				color += tile.data >> shift + 7 & 2;
-				color += tile.data >> shift + 14 & 4;
-				color += tile.data >> shift + 21 & 8;
+				uint color = tile.row[ x ^ mirrorX ];
 				if ( color ) {
 					palette[ tileX ] = tile.palette + color;
 					priority[ tileX ] = self.priority[ tile.priority ];
@@ -1661,8 +1820,8 @@ auto PPU::writeObject( uint10 address, uint8 data ) -> void {
 	if ( !( address & 0x200 ) ) {
 		uint n = address >> 2;  //object#
 		address &= 3;
-		if ( address == 0 ) { objects[ n ].x = objects[ n ].x & 0x100 | data; return; }
-		if ( address == 1 ) { objects[ n ].y = data + 1; return; }  //+1 => rendering happens one scanline late
+		if ( address == 0 ) { objects[ n ].x = objects[ n ].x & 0x100 | data; objectsDirty = true; return; }
+		if ( address == 1 ) { objects[ n ].y = data + 1; objectsDirty = true; return; }  //+1 => rendering happens one scanline late
 		if ( address == 2 ) { objects[ n ].character = data; return; }
 		objects[ n ].nameselect = data >> 0 & 1;
 		objects[ n ].palette = data >> 1 & 7;
@@ -1680,82 +1839,72 @@ auto PPU::writeObject( uint10 address, uint8 data ) -> void {
 		objects[ n + 1 ].size = data >> 3 & 1;
 		objects[ n + 2 ].size = data >> 5 & 1;
 		objects[ n + 3 ].size = data >> 7 & 1;
+		objectsDirty = true;
 	}
 }
 
-auto PPU::Line::renderWindow( PPU::IO::WindowLayer& self, bool enable, bool output[ 256 ] ) -> void {
-	if ( !enable || ( !self.oneEnable && !self.twoEnable ) ) {
-		memory::fill<bool>( output, 256, 0 );
-		return;
-	}
-
-	if ( self.oneEnable && !self.twoEnable ) {
-		bool set = 1 ^ self.oneInvert, clear = !set;
-		for ( uint x : range( 256 ) ) {
-			output[ x ] = x >= io.window.oneLeft && x <= io.window.oneRight ? set : clear;
-		}
-		return;
+//the pixels from left to right, none when left is past right
+auto PPU::Line::windowRange( uint left, uint right ) -> WindowMask {
+	WindowMask mask{};
+	for ( uint n : range( 4 ) ) {
+		int first = std::max( int( left ) - int( n * 64 ), 0 );
+		int last = std::min( int( right ) - int( n * 64 ), 63 );
+		if ( first <= last ) mask.bits[ n ] = ~0ull >> ( 63 - last ) & ~0ull << first;
 	}
+	return mask;
+}
 
-	if ( self.twoEnable && !self.oneEnable ) {
-		bool set = 1 ^ self.twoInvert, clear = !set;
-		for ( uint x : range( 256 ) ) {
-			output[ x ] = x >= io.window.twoLeft && x <= io.window.twoRight ? set : clear;
-		}
+auto PPU::Line::renderWindow( PPU::IO::WindowLayer& self, bool enable, WindowMask& output ) -> void {
+	if ( !enable || ( !self.oneEnable && !self.twoEnable ) ) {
+		output = {};
 		return;
 	}
 
-	for ( uint x : range( 256 ) ) {
-		bool oneMask = ( x >= io.window.oneLeft && x <= io.window.oneRight ) ^ self.oneInvert;
-		bool twoMask = ( x >= io.window.twoLeft && x <= io.window.twoRight ) ^ self.twoInvert;
-		switch ( self.mask ) {
-		case 0: output[ x ] = ( oneMask | twoMask ) == 1; break;
-		case 1: output[ x ] = ( oneMask & twoMask ) == 1; break;
-		case 2: output[ x ] = ( oneMask ^ twoMask ) == 1; break;
-		case 3: output[ x ] = ( oneMask ^ twoMask ) == 0; break;
+	uint64 oneInvert = self.oneInvert ? ~0ull : 0;
+	uint64 twoInvert = self.twoInvert ? ~0ull : 0;
+	for ( uint n : range( 4 ) ) {
+		uint64 oneMask = windowOne.bits[ n ] ^ oneInvert;
+		uint64 twoMask = windowTwo.bits[ n ] ^ twoInvert;
+		if ( !self.twoEnable ) output.bits[ n ] = oneMask;
+		else if ( !self.oneEnable ) output.bits[ n ] = twoMask;
+		else switch ( self.mask ) {
+		case 0: output.bits[ n ] = oneMask | twoMask; break;
+		case 1: output.bits[ n ] = oneMask & twoMask; break;
+		case 2: output.bits[ n ] = oneMask ^ twoMask; break;
+		case 3: output.bits[ n ] = ~( oneMask ^ twoMask ); break;
 		}
 	}
 }
 
-auto PPU::Line::renderWindow( PPU::IO::WindowColor& self, uint mask, bool output[ 256 ] ) -> void {
-	bool set, clear;
+auto PPU::Line::renderWindow( PPU::IO::WindowColor& self, uint mask, WindowMask& output ) -> void {
+	uint64 clear;
 	switch ( mask ) {
-	case 0: memory::fill<bool>( output, 256, 1 ); return;  //always
-	case 1: set = 1, clear = 0; break;  //inside
-	case 2: set = 0, clear = 1; break;  //outside
-	case 3: memory::fill<bool>( output, 256, 0 ); return;  //never
+	case 0: output = { ~0ull, ~0ull, ~0ull, ~0ull }; return;  //always
+	case 1: clear = 0; break;  //inside
+	case 2: clear = ~0ull; break;  //outside
+	case 3: output = {}; return;  //never
 	}
 
 	if ( !self.oneEnable && !self.twoEnable ) {
-		memory::fill<bool>( output, 256, clear );
-		return;
-	}
-
-	if ( self.oneEnable && !self.twoEnable ) {
-		if ( self.oneInvert ) set ^= 1, clear ^= 1;
-		for ( uint x : range( 256 ) ) {
-			output[ x ] = x >= io.window.oneLeft && x <= io.window.oneRight ? set : clear;
-		}
-		return;
-	}
-
-	if ( self.twoEnable && !self.oneEnable ) {
-		if ( self.twoInvert ) set ^= 1, clear ^= 1;
-		for ( uint x : range( 256 ) ) {
-			output[ x ] = x >= io.window.twoLeft && x <= io.window.twoRight ? set : clear;
-		}
+		output = { clear, clear, clear, clear };
 		return;
 	}
 
-	for ( uint x : range( 256 ) ) {
-		bool oneMask = ( x >= io.window.oneLeft && x <= io.window.oneRight ) ^ self.oneInvert;
-		bool twoMask = ( x >= io.window.twoLeft && x <= io.window.twoRight ) ^ self.twoInvert;
-		switch ( self.mask ) {
-		case 0: output[ x ] = ( oneMask | twoMask ) == 1 ? set : clear; break;
-		case 1: output[ x ] = ( oneMask & twoMask ) == 1 ? set : clear; break;
-		case 2: output[ x ] = ( oneMask ^ twoMask ) == 1 ? set : clear; break;
-		case 3: output[ x ] = ( oneMask ^ twoMask ) == 0 ? set : clear; break;
+	uint64 oneInvert = self.oneInvert ? ~0ull : 0;
+	uint64 twoInvert = self.twoInvert ? ~0ull : 0;
+	for ( uint n : range( 4 ) ) {
+		uint64 oneMask = windowOne.bits[ n ] ^ oneInvert;
+		uint64 twoMask = windowTwo.bits[ n ] ^ twoInvert;
+		uint64 inside;
+		if ( !self.twoEnable ) inside = oneMask;
+		else if ( !self.oneEnable ) inside = twoMask;
+		else switch ( self.mask ) {
+		case 0: inside = oneMask | twoMask; break;
+		case 1: inside = oneMask & twoMask; break;
+		case 2: inside = oneMask ^ twoMask; break;
+		case 3: inside = ~( oneMask ^ twoMask ); break;
 		}
+		output.bits[ n ] = inside ^ clear;
 	}
 }
 
@@ -1767,9 +1916,9 @@ auto PPU::hires() const -> bool { return latch.hires; }
 auto PPU::hd() const -> bool { return latch.hd; }
 auto PPU::ss() const -> bool { return latch.ss; }
 #undef ppu
-auto PPU::hdScale() const -> uint { return 1;/*return configuration.hacks.ppu.mode7.scale;*/ }
-auto PPU::hdPerspective() const -> bool { return true;/*return configuration.hacks.ppu.mode7.perspective;*/ }
-auto PPU::hdSupersample() const -> bool { return true;/*return configuration.hacks.ppu.mode7.supersample;*/ }
+auto PPU::hdScale() const -> uint { return mode7Options.scale; }
+auto PPU::hdPerspective() const -> bool { return mode7Options.perspective; }
+auto PPU::hdSupersample() const -> bool { return mode7Options.supersample; }
 auto PPU::hdMosaic() const -> bool { return false;/*return configuration.hacks.ppu.mode7.mosaic;*/ }
 auto PPU::deinterlace() const -> bool { return false;/*return configuration.hacks.ppu.deinterlace;*/ }
 auto PPU::renderCycle() const -> uint { return 0;/*return configuration.hacks.ppu.renderCycle;*/ }
@@ -1777,10 +1926,11 @@ auto PPU::noVRAMBlocking() const -> bool { return true;/*return configuration.ha
 #define ppu ppufast
 
 PPU::PPU() {
-  output = new uint16_t[2304 * 2160]();
+  resizeOutput();
 
   for(uint l : range(16)) {
-    lightTable[l] = new uint16_t[32768];
+    //one spare entry so the compositor can gather the last color 32 bits at a time
+    lightTable[l] = new uint16_t[32768 + 1]();
     for(uint r : range(32)) {
       for(uint g : range(32)) {
         for(uint b : range(32)) {
@@ -1800,6 +1950,8 @@ PPU::PPU() {
 }
 
 PPU::~PPU() {
+  stopRendering();
+  renderThreads.Stop();
   delete[] output;
   for(uint l : range(16)) delete[] lightTable[l];
 }
@@ -1840,15 +1992,28 @@ extern "C"
 	void FUNC_80FF8A();
 }
 
-void PPU::doFrame( DmaController& dmaController, const InternalRegisterState& registerState, SDL_Window* window )
+//without render the frame runs exactly the same, hdma, irq, line caches and object flags, but nothing is drawn or queued
+void PPU::doFrame( DmaController& dmaController, const InternalRegisterState& registerState, FrameProfiler& profiler, const bool render, FrameQueue* frames )
 {
+	{
+		//pipelined, this is where the cpu waits if the frame before last still isn't drawn
+		FrameProfiler::Scope scope( profiler, FrameProfiler::PHASE_RENDER );
+		beginRenderFrame();
+	}
+
 	dmaController.InitHDMAChannels();
 	for ( uint lineIndex = 0; lineIndex < 262; lineIndex++ )
 	{
-		dmaController.ProcessHDMAChannels();
+		{
+			FrameProfiler::Scope scope( profiler, FrameProfiler::PHASE_HDMA );
+			dmaController.ProcessHDMAChannels();
+		}
 		if ( registerState.enableVerticalIrq && registerState.verticalTimer == lineIndex )
 		{
-			Line::flush();
+			{
+				FrameProfiler::Scope scope( profiler, FrameProfiler::PHASE_RENDER );
+				Line::flush( render );
+			}
 			FUNC_80FF8A();
 		}
 		if ( lineIndex < 225 )
@@ -1858,14 +2023,142 @@ void PPU::doFrame( DmaController& dmaController, const InternalRegisterState& re
 		}
 	}
 
-	Line::flush();
+	{
+		FrameProfiler::Scope scope( profiler, FrameProfiler::PHASE_RENDER );
+		Line::flush( render );
+	}
 
-	if ( window )
+	if ( render && renderFrames.size() > 1 )
+	{
+		submitRenderFrame( frames );
+	}
+	else if ( render && frames )
 	{
-		refresh( window );
+		FrameProfiler::Scope scope( profiler, FrameProfiler::PHASE_PRESENT );
+		refresh( frames->GetBackFrame(), latch );
+		frames->Publish();
 	}
 }
 
+//cpu side, picks the frame the lines are cached into
+auto PPU::beginRenderFrame() -> RenderFrame& {
+  if(renderFrames.size() > 1) {
+    //the frame being filled must not be the one still being drawn
+    std::unique_lock<std::mutex> lock(renderMutex);
+    renderCondition.wait(lock, [this] { return renderSubmitted - renderCompleted < renderFrames.size(); });
+    renderFilling = renderSubmitted % renderFrames.size();
+  }
+  auto& frame = renderFrames[renderFilling];
+  frame.segmentCount = 0;
+  frame.frames = nullptr;
+  return frame;
+}
+
+auto PPU::submitRenderFrame(FrameQueue* frames) -> void {
+  {
+    std::lock_guard<std::mutex> lock(renderMutex);
+    renderFrames[renderFilling].frames = frames;
+    renderSubmitted++;
+  }
+  renderCondition.notify_all();
+}
+
+//renderThread: draws the submitted frames in order while the cpu carries on with the next one
+auto PPU::renderMain() -> void {
+  std::unique_lock<std::mutex> lock(renderMutex);
+  while(true) {
+    renderCondition.wait(lock, [this] { return renderStop || renderCompleted < renderSubmitted; });
+    if(renderCompleted == renderSubmitted) return;
+
+    auto& frame = renderFrames[renderCompleted % renderFrames.size()];
+    lock.unlock();
+    renderFrame(frame);
+    lock.lock();
+
+    renderCompleted++;
+    renderCondition.notify_all();
+  }
+}
+
+auto PPU::renderFrame(RenderFrame& frame) -> void {
+  for(uint n : range(frame.segmentCount)) {
+    renderSegment(frame, frame.segments[n]);
+  }
+  if(frame.frames && frame.segmentCount) {
+    refresh(frame.frames->GetBackFrame(), frame.segments[frame.segmentCount - 1].latch);
+    frame.frames->Publish();
+  }
+}
+
+auto PPU::renderSegment(RenderFrame& frame, const RenderSegment& segment) -> void {
+  for(uint y = segment.start; y < segment.start + segment.count; y++) {
+    memcpy(&lines[y].io, &frame.lines[y].io, sizeof(lines[y].io));
+    memcpy(&lines[y].cgram, &frame.lines[y].cgram, sizeof(lines[y].cgram));
+    lines[y].windowOne = frame.lines[y].windowOne;
+    lines[y].windowTwo = frame.lines[y].windowTwo;
+  }
+
+  uint pixels = 256 * hdScale() * hdScale();
+  uint threads = renderThreads.GetWorkerCount() + 1;
+  if(lineScratch.size() != 2 * pixels * threads) lineScratch.assign(2 * pixels * threads, {});
+  lineScratchSize = pixels;
+
+  tileCache.update(segment.vram, segment.vramDirty);
+  Line::segment = &segment;
+  if(hdScale() > 1) Line::cacheMode7HD();
+  //a handful of lines before an irq isn't worth waking the workers for
+  if(segment.count >= 8) {
+    renderThreads.Run(Line::renderLine, segment.count);
+  } else {
+    for(uint index : range(segment.count)) Line::renderLine(index, 0);
+  }
+  Line::segment = nullptr;
+}
+
+//a dirty 2bpp tile is half of a 4bpp one and a quarter of an 8bpp one
+auto PPU::TileCache::update(const uint16* vram, const uint64* dirty) -> void {
+  static const uint8 noFlip[8] = {};
+  uint64 rows[8];
+  for(uint word : range(64)) {
+    if(!dirty[word]) continue;
+    for(uint tileMode : range(3)) {
+      uint words = 1 << tileMode;  //two bitplanes to a word
+      for(uint bit = 0; bit < 64; bit += words) {
+        if(!(dirty[word] >> bit & (1ull << words) - 1)) continue;
+        uint address = (word * 64 + bit) * 8;
+        for(uint y : range(8)) {
+          rows[y] = 0;
+          for(uint n : range(words)) rows[y] |= (uint64)vram[address + n * 8 + y] << n * 16;
+        }
+        TileDecode::Decode(rows, noFlip, 8, &decoded[index(tileMode, address)]);
+      }
+    }
+  }
+}
+
+//lines are 1024 pixels apart for both fields of hires, or 256 * scale * scale apart in hd mode 7.
+//without overscan they start 7 lines down, so there's room for 8 more than the 240 lines.
+auto PPU::resizeOutput() -> void {
+  uint size = (240 + 8) * std::max(1024u, 256 * hdScale() * hdScale());
+  if(size != outputSize) {
+    delete[] output;
+    output = new uint16[size];
+    outputSize = size;
+  }
+  memory::fill<uint16>(output, outputSize);
+}
+
+//waits for the frames already submitted to be drawn before stopping renderThread
+auto PPU::stopRendering() -> void {
+  if(!renderThread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(renderMutex);
+    renderStop = true;
+  }
+  renderCondition.notify_all();
+  renderThread.join();
+}
+
 auto PPU::scanline() -> void {
   /*if(vcounter() == 0)*/ {
     /*ppubase.display.interlace = io.interlace;
@@ -2170,15 +2463,14 @@ void filterRender( uint32_t* colortable, uint32_t* output, uint outpitch, const
 }
 
 uint32_t palette[ 32768 ];
-uint32_t filteredOutput[ 256 * 240 ];
-
-auto PPU::refresh( SDL_Window* window ) -> void {
+//emulation or render thread: converts the frame to 32 bit color for the presentation thread
+auto PPU::refresh( VideoFrame& video, const Latch& latch ) -> void {
   /*if(system.frameCounter == 0 && !system.runAhead)*/ {
     auto output = this->output;
     uint pitch, width, height;
-    if(!hd()) {
+    if(!latch.hd) {
       pitch  = 512 << !interlace();
-      width  = 256 << hires();
+      width  = 256 << latch.hires;
       height = 240 << interlace();
     } else {
       pitch  = 256 * hdScale();
@@ -2191,18 +2483,28 @@ auto PPU::refresh( SDL_Window* window ) -> void {
     if(!latch.overscan && pitch != frame.pitch && width != frame.width && height != frame.height) {
       for(uint y : range(240)) {
         if(y >= 8 && y <= 230) continue;  //these scanlines are always rendered.
-        auto output = this->output + (!hd() ? (y * 1024 + (interlace() /*&& field()*/ ? 512 : 0)) : (y * 256 * hdScale() * hdScale()));
-        auto width = (!hd() ? (!hires() ? 256 : 512) : (256 * hdScale() * hdScale()));
+        auto output = this->output + (!latch.hd ? (y * 1024 + (interlace() /*&& field()*/ ? 512 : 0)) : (y * 256 * hdScale() * hdScale()));
+        auto width = (!latch.hd ? (!latch.hires ? 256 : 512) : (256 * hdScale() * hdScale()));
         memory::fill<uint16>(output, width);
       }
     }
 
     /*if(auto device = controllerPort2.device) device->draw(output, pitch * sizeof(uint16), width, height);
     platform->videoFrame(output, pitch * sizeof(uint16), width, height, hd() ? hdScale() : 1);*/
-		//auto filteredOutput = new uint32_t[ width * height ];
-		auto length = width * sizeof( uint32_t );
-		filterRender( palette, filteredOutput, length, (const uint16_t*)output, (pitch * sizeof( uint16 )), width, height );
+		video.width = std::min( width, VideoFrame::MAX_WIDTH );
+		video.height = std::min( height, VideoFrame::MAX_HEIGHT );
+		auto length = video.width * sizeof( uint32_t );
+		filterRender( palette, video.pixels.data(), length, (const uint16_t*)output, (pitch * sizeof( uint16 )), video.width, video.height );
 
+    frame.pitch  = pitch;
+    frame.width  = width;
+    frame.height = height;
+  }
+  //if(system.frameCounter++ >= system.frameSkip) system.frameCounter = 0;
+}
+
+//presentation thread: uploads the frame and swaps, this is the only place the ppu touches GL
+auto PPU::present( const VideoFrame& video, SDL_Window* window ) -> void {
 		glBindTexture( GL_TEXTURE_2D, texture );
 #ifndef __EMSCRIPTEN__ 
 		GLint const Swizzle[] = { GL_BLUE, GL_GREEN, GL_RED, GL_ALPHA };
@@ -2211,7 +2513,7 @@ auto PPU::refresh( SDL_Window* window ) -> void {
 		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, Swizzle[ 2 ] );
 		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, Swizzle[ 3 ] );
 #endif // __EMSCRIPTEN__
-		glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, filteredOutput );
+		glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, video.width, video.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, video.pixels.data() );
 		//glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, filteredOutput );
 
 		glUseProgram( 0 );
@@ -2257,12 +2559,6 @@ auto PPU::refresh( SDL_Window* window ) -> void {
 		render( sourceWidth, sourceHeight, outputX, outputY, outputWidth, outputHeight );
 		
 		SDL_GL_SwapWindow( window );
-
-    frame.pitch  = pitch;
-    frame.width  = width;
-    frame.height = height;
-  }
-  //if(system.frameCounter++ >= system.frameSkip) system.frameCounter = 0;
 }
 
 auto PPU::load() -> bool {
@@ -2317,7 +2613,7 @@ auto updateVideoPalette() -> void {
 	}
 }
 
-void InitOpenGL()
+auto PPU::initOpenGL() -> void
 {
 	glDisable( GL_BLEND );
 	glDisable( GL_DEPTH_TEST );
@@ -2340,9 +2636,15 @@ void InitOpenGL()
 	glGenTextures( 1, &texture );
 }
 
-auto PPU::power(bool reset) -> void {
+auto PPU::power(bool reset, uint renderWorkers, bool pipeline, const Mode7Options& mode7) -> void {
+  stopRendering();
+
+  //the output, the line buffers and the frames are all sized by the scale, so it only changes here
+  mode7Options = mode7;
+  mode7Options.scale = std::clamp(mode7Options.scale, 1u, Mode7Options::MaxScale);
+
   //PPUcounter::reset();
-  memory::fill<uint16>(output, 1024 * 960);
+  resizeOutput();
 
   if(!reset) {
     for(auto& word : vram) word = 0x0000;
@@ -2359,10 +2661,45 @@ auto PPU::power(bool reset) -> void {
 
   Line::start = 0;
   Line::count = 0;
+  memset(vramDirty, 0xff, sizeof(vramDirty));
+  windowCache.valid = false;
+  objectsDirty = true;
+  assert(TileDecode::Verify());
+  assert(Mode7Fetch::Verify());
+  assert(Compositor::Verify());
+  assert(Mode7HD::Verify());
+  renderThreads.Start(renderWorkers);
+#ifdef __EMSCRIPTEN__
+  pipeline = false;
+#endif // __EMSCRIPTEN__
+  renderFrames = std::vector<RenderFrame>(pipeline ? 2 : 1);
+  renderFilling = 0;
+  renderSubmitted = 0;
+  renderCompleted = 0;
+  renderStop = false;
+  if(pipeline) renderThread = std::thread(&PPU::renderMain, this);
 
   frame = {};
 
 	updateVideoPalette();
+}
 
-	InitOpenGL();
+//the line caches are rebuilt from this every frame, so only the serialized: members make up the state
+auto PPU::serialize(Serializer& s) -> void {
+  s(latch);
+  s(io);
+  //run-ahead and rewind load a state every frame, so only the tiles that differ are decoded again
+  if(auto state = s.Reserve(sizeof(vram))) {
+    if(s.GetMode() == Serializer::Mode::Save) {
+      memcpy(state, vram, sizeof(vram));
+    } else {
+      for(uint address = 0; address < 32 * 1024; address += 8) {
+        if(memcmp(vram + address, state + address * 2, 16)) vramDirty[address >> 9] |= 1ull << (address >> 3 & 63);
+      }
+      memcpy(vram, state, sizeof(vram));
+    }
+  }
+  s(cgram);
+  s(objects);
+  if(s.GetMode() == Serializer::Mode::Load) objectsDirty = true;
 }
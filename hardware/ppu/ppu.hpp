@@ -1,7 +1,13 @@
 #ifndef PPU_HPP
 #define PPU_HPP
 
+#include <condition_variable>
 #include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "RenderThreadPool.hpp"
+#include "Compositor.hpp"
 
 //performance-focused, scanline-based, parallelized implementation of PPU
 
@@ -27,9 +33,25 @@ using int13 = int16_t;
 
 struct SDL_Window;
 class DmaController;
+class IoRegisters;
+class FrameProfiler;
+class Serializer;
+class FrameQueue;
+struct VideoFrame;
 struct InternalRegisterState;
 
 struct PPU {
+  struct Latch;
+
+  //hd mode 7 draws the mode 7 layer scale times finer in both directions, averaged back down to 256 pixels when
+  //supersampling. perspective correction interpolates the matrix between lines instead of taking it as it is.
+  struct Mode7Options {
+    static constexpr uint MaxScale = 4;
+    uint scale = 1;
+    bool perspective = true;
+    bool supersample = false;
+  };
+
   auto interlace() const -> bool;
   auto overscan() const -> bool;
   auto vdisp() const -> uint;
@@ -44,7 +66,7 @@ struct PPU {
   auto renderCycle() const -> uint;
   auto noVRAMBlocking() const -> bool;
 
-	void doFrame( DmaController& dmaController, const InternalRegisterState& registerState, SDL_Window* window );
+	void doFrame( DmaController& dmaController, const InternalRegisterState& registerState, FrameProfiler& profiler, const bool render, FrameQueue* frames );
 
   //ppu.cpp
   PPU();
@@ -55,9 +77,14 @@ struct PPU {
   auto step(uint clocks) -> void;
   auto main() -> void;
   auto scanline() -> void;
-  auto refresh( SDL_Window* window ) -> void;
+  auto refresh( VideoFrame& video, const Latch& latch ) -> void;
+  auto present( const VideoFrame& video, SDL_Window* window ) -> void;
+  auto initOpenGL() -> void;
   auto load() -> bool;
-  auto power(bool reset) -> void;
+  auto power(bool reset, uint renderWorkers, bool pipeline, const Mode7Options& mode7) -> void;
+  auto serialize(Serializer&) -> void;
+  auto stopRendering() -> void;
+  auto resizeOutput() -> void;
 
 public:
   struct Source { enum : uint8 { BG1, BG2, BG3, BG4, OBJ1, OBJ2, COL }; };
@@ -234,15 +261,77 @@ public:
     uint8 priority = 0;
     uint8 palette = 0;
     bool hflip = 0;
-    uint32 data = 0;
+    const uint8* row = nullptr;
   };
 
-  struct Pixel {
-    uint8 source = 0;
-    uint8 priority = 0;
-    uint16 color = 0;
+  //the objects on each line in index order, for one object size setting. only rebuilt after oam was written or
+  //the object size changed, so a line looks at its own few objects instead of all 128.
+  struct ObjectBuckets {
+    auto matches(const IO::Object& self) const -> bool { return valid && baseSize == self.baseSize && interlace == self.interlace; }
+    auto build(const Object* objects, uint8 baseSize, bool interlace) -> void;
+
+    bool valid = false;
+    uint8 baseSize = 0;
+    bool interlace = 0;
+    uint16 start[257] = {};        //line y is indices[start[y]] up to indices[start[y + 1]]
+    uint8 indices[128 * 64] = {};  //objects are at most 64 lines tall
+  };
+
+  using Pixel = Compositor::Pixel;
+
+  //one bit for each pixel of a line
+  struct WindowMask {
+    uint64 bits[4];
+    auto operator[](uint x) const -> bool { return bits[x >> 6] >> (x & 63) & 1; }
+  };
+
+  //everything the lines read besides their own io and cgram, copied when they are flushed so
+  //the cpu can carry on writing vram and oam while they are drawn
+  struct RenderSegment {
+    uint start = 0;
+    uint count = 0;
+    Latch latch;
+    uint16 vram[32 * 1024];
+    uint64 vramDirty[64];
+    Object objects[128];
+    ObjectBuckets objectBuckets;
+  };
+
+  //render side, every row of every tile decoded to its 8 palette indices, once for each bpp. the tiles vram
+  //writes touched are decoded again before the next segment that is drawn.
+  struct TileCache {
+    //2bpp, 4bpp and 8bpp tiles back to back, the vram word address of a row finds it in any of them
+    static auto index(uint tileMode, uint address) -> uint {
+      uint base = tileMode == TileMode::BPP2 ? 0 : tileMode == TileMode::BPP4 ? 4096 * 64 : 6144 * 64;
+      return base + ((address >> tileMode & ~7) | (address & 7)) * 8;
+    }
+    auto row(uint tileMode, uint address) const -> const uint8* { return &decoded[index(tileMode, address)]; }
+    auto update(const uint16* vram, const uint64* dirty) -> void;
+
+    uint8 decoded[(4096 + 2048 + 1024) * 64] = {};
+  };
+
+  struct RenderFrame {
+    struct LineCache {
+      IO io;
+      uint16 cgram[256];
+      WindowMask windowOne;
+      WindowMask windowTwo;
+    } lines[240];
+
+    //the partial flush before the vertical irq and the rest of the frame
+    RenderSegment segments[2];
+    uint segmentCount = 0;
+    FrameQueue* frames = nullptr;
   };
 
+  //render.cpp
+  auto beginRenderFrame() -> RenderFrame&;
+  auto submitRenderFrame(FrameQueue* frames) -> void;
+  auto renderFrame(RenderFrame& frame) -> void;
+  auto renderSegment(RenderFrame& frame, const RenderSegment& segment) -> void;
+  auto renderMain() -> void;
+
   //io.cpp
   auto latchCounters(uint hcounter, uint vcounter) -> void;
   auto latchCounters() -> void;
@@ -253,8 +342,9 @@ public:
   auto writeOAM(uint10 address, uint8 data) -> void;
   template<bool Byte> auto readCGRAM(uint8 address) -> uint8;
   auto writeCGRAM(uint8 address, uint15 data) -> void;
-  auto readIO(uint address, uint8 data) -> uint8;
-  auto writeIO(uint address, uint8 data) -> void;
+  template<uint Address> auto readIO(uint8 data) -> uint8;
+  template<uint Address> auto writeIO(uint8 data) -> void;
+  auto mapIO(IoRegisters& registers) -> void;
   auto updateVideoMode() -> void;
 
   //object.cpp
@@ -272,20 +362,36 @@ public:
   Object objects[128] = {};
 
   //[unserialized]
+  //one bit per 2bpp tile written since the last segment, the 4bpp and 8bpp tiles over it are dirty too
+  uint64 vramDirty[64] = {};
+  TileCache tileCache;
+  //cpu side, the buckets for ppu.objects, flush() rebuilds them when writeObject() has set objectsDirty
+  ObjectBuckets objectBuckets;
+  bool objectsDirty = true;
   uint16* output = {};
+  uint outputSize = 0;
   uint16* lightTable[16] = {};
 
   uint ItemLimit = 0;
   uint TileLimit = 0;
+  Mode7Options mode7Options;
+
+  //cpu side, the window masks of the last line cached, reused as long as the edges stay the same
+  struct WindowCache {
+    bool valid = false;
+    uint8 edges[4] = {};
+    WindowMask one;
+    WindowMask two;
+  } windowCache;
 
   struct Line {
     //line.cpp
     inline auto field() const -> bool { return fieldID; }
-    static auto flush() -> void;
+    static auto flush(bool render = true) -> void;
+    static auto renderLine(uint index, uint worker) -> void;
     auto cache() -> void;
+    static auto evaluateFlags(const PPU::IO::Object&, uint y, const Object* objects, const ObjectBuckets& buckets, bool& rangeOver, bool& timeOver) -> void;
     auto render(bool field) -> void;
-    auto pixel(uint x, Pixel above, Pixel below) const -> uint16;
-    auto blend(uint x, uint y, bool halve) const -> uint16;
     auto directColor(uint paletteIndex, uint paletteColor) const -> uint16;
     auto plotAbove(uint x, uint8 source, uint8 priority, uint16 color) -> void;
     auto plotBelow(uint x, uint8 source, uint8 priority, uint16 color) -> void;
@@ -304,21 +410,15 @@ public:
     auto renderMode7HD(PPU::IO::Background&, uint8 source) -> void;
     auto lerp(float pa, float va, float pb, float vb, float pr) -> float;
 
-    //mode7hd-avx2.cpp
-    auto renderMode7HD_AVX2(
-      PPU::IO::Background&, uint8 source,
-      Pixel* above, Pixel* below,
-      bool* windowAbove, bool* windowBelow,
-      float originX, float a,
-      float originY, float c
-    ) -> void;
-
     //object.cpp
+    static auto objectItem(uint8 baseSize, bool interlace, const Object& object, uint8 index) -> ObjectItem;
+    static auto evaluateObjects(const PPU::IO::Object&, uint y, const Object* objects, const ObjectBuckets& buckets, ObjectItem* items) -> uint;
     auto renderObject(PPU::IO::Object&) -> void;
 
     //window.cpp
-    auto renderWindow(PPU::IO::WindowLayer&, bool enable, bool output[256]) -> void;
-    auto renderWindow(PPU::IO::WindowColor&, uint mask,   bool output[256]) -> void;
+    static auto windowRange(uint left, uint right) -> WindowMask;
+    auto renderWindow(PPU::IO::WindowLayer&, bool enable, WindowMask& output) -> void;
+    auto renderWindow(PPU::IO::WindowColor&, uint mask,   WindowMask& output) -> void;
 
   //unserialized:
     uint y;  //constant
@@ -326,23 +426,47 @@ public:
 
     IO io;
     uint16 cgram[256];
+    //the pixels inside window one and window two, every layer's windows are made from these
+    WindowMask windowOne;
+    WindowMask windowTwo;
 
     ObjectItem items[128];  //32 on real hardware
     ObjectTile tiles[128];  //34 on real hardware; 1024 max (128 * 64-width tiles)
 
-    Pixel above[256 * 9 * 9];
-    Pixel below[256 * 9 * 9];
+    //the render thread's share of lineScratch while this line is being drawn
+    Pixel* above;
+    Pixel* below;
+
+    WindowMask windowAbove;
+    WindowMask windowBelow;
 
-    bool windowAbove[256];
-    bool windowBelow[256];
+    //merged into ppu.io.obj by flush() once every line is done, so no two threads write the same flags
+    bool rangeOver;
+    bool timeOver;
 
-    //flush()
+    //flush(), the lines cached since the last flush
     static uint start;
     static uint count;
+    //render side, what the lines being drawn read in place of ppu.vram, ppu.objects and ppu.latch
+    static const RenderSegment* segment;
   };
 
 //unserialized:
   Line lines[240];
+  RenderThreadPool renderThreads;
+  //above and below for each render thread, 256 * hdScale() * hdScale() pixels each
+  std::vector<Pixel> lineScratch;
+  uint lineScratchSize = 0;
+
+  //with pipelining the frames are drawn on renderThread while the cpu runs the next one
+  std::vector<RenderFrame> renderFrames;
+  uint renderFilling = 0;
+  uint64 renderSubmitted = 0;
+  uint64 renderCompleted = 0;
+  bool renderStop = false;
+  std::thread renderThread;
+  std::mutex renderMutex;
+  std::condition_variable renderCondition;
 
   //used to help detect when the video output size changes between frames to clear overscan area.
   struct Frame {
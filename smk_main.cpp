@@ -1,7 +1,100 @@
 #include "hardware/hardware.hpp"
+#include <iostream>
+#include <string>
 
-int main( int argc, char** argv ) 
-{	
-	Hardware::GetInstance().PowerOn();
+int main( int argc, char** argv )
+{
+	Hardware::Options options;
+	for ( int i = 1; i < argc; i++ )
+	{
+		const std::string argument( argv[i] );
+		if ( argument == "--headless" )
+		{
+			options.headless = true;
+		}
+		else if ( argument == "--frames" && i + 1 < argc )
+		{
+			options.frames = std::stoull( argv[++i] );
+		}
+		else if ( argument == "--benchmark" && i + 1 < argc )
+		{
+			options.benchmark = argv[++i];
+		}
+		else if ( argument == "--run-ahead" && i + 1 < argc )
+		{
+			options.runAhead = std::stoul( argv[++i] );
+		}
+		else if ( argument == "--frame-skip" && i + 1 < argc )
+		{
+			options.frameSkip = std::stoul( argv[++i] );
+		}
+		else if ( argument == "--render-threads" && i + 1 < argc )
+		{
+			options.renderThreads = std::stoi( argv[++i] );
+		}
+		else if ( argument == "--pipeline-rendering" )
+		{
+			options.pipelineRendering = true;
+		}
+		else if ( argument == "--mode7-scale" && i + 1 < argc )
+		{
+			options.mode7Scale = std::stoul( argv[++i] );
+		}
+		else if ( argument == "--mode7-supersample" )
+		{
+			options.mode7Supersample = true;
+		}
+		else if ( argument == "--no-mode7-perspective" )
+		{
+			options.mode7Perspective = false;
+		}
+		else if ( argument == "--rewind" && i + 1 < argc )
+		{
+			options.rewindSeconds = std::stoul( argv[++i] );
+		}
+		else if ( argument == "--rewind-memory" && i + 1 < argc )
+		{
+			options.rewindMegabytes = std::stoul( argv[++i] );
+		}
+		else if ( argument == "--record-movie" && i + 1 < argc )
+		{
+			options.recordMovie = argv[++i];
+		}
+		else if ( argument == "--play-movie" && i + 1 < argc )
+		{
+			options.playMovie = argv[++i];
+		}
+		else
+		{
+			std::cout << "smk: smk [--headless] [--frames count] [--benchmark resultspath] [--run-ahead frames] [--frame-skip frames] [--render-threads count] [--pipeline-rendering] [--mode7-scale 1-4] [--mode7-supersample] [--no-mode7-perspective] [--rewind seconds] [--rewind-memory megabytes] [--record-movie moviepath | --play-movie moviepath]" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( options.headless && options.frames == 0 )
+	{
+		std::cout << "ERROR: --headless needs --frames" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if ( !options.benchmark.empty() && options.frames == 0 )
+	{
+		std::cout << "ERROR: --benchmark needs --frames" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if ( options.mode7Scale < 1 || options.mode7Scale > 4 )
+	{
+		std::cout << "ERROR: --mode7-scale must be 1 to 4" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if ( !options.recordMovie.empty() && !options.playMovie.empty() )
+	{
+		std::cout << "ERROR: can't record and play a movie at the same time" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	Hardware::GetInstance().PowerOn( options );
 	return 0;
-}
\ No newline at end of file
+}
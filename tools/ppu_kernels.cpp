@@ -0,0 +1,171 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "../hardware/ppu/Compositor.hpp"
+#include "../hardware/ppu/Mode7Fetch.hpp"
+#include "../hardware/ppu/Mode7HD.hpp"
+#include "../hardware/ppu/TileDecode.hpp"
+
+// Checks every SIMD version of the PPU kernels this machine runs against the scalar one and times them all, so a
+// change to one of them can be measured without a whole game in the way.
+namespace
+{
+	template<typename Function>
+	double NanosecondsPerCall( const uint32_t calls, Function function )
+	{
+		const auto start = std::chrono::steady_clock::now();
+		for ( uint32_t i = 0; i < calls; i++ )
+		{
+			function( i );
+		}
+		return std::chrono::duration<double, std::nano>( std::chrono::steady_clock::now() - start ).count() / calls;
+	}
+}
+
+int main( int argc, char** argv )
+{
+	const uint32_t calls = argc > 1 ? std::stoul( argv[1] ) : 100000;
+	const CpuFeatures& features = CpuFeatures::Get();
+
+	if ( !Mode7Fetch::Verify() || !Mode7HD::Verify() || !TileDecode::Verify() || !Compositor::Verify() )
+	{
+		std::cout << "ERROR: a SIMD kernel doesn't match the scalar one" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	uint64_t random = 0x9e3779b97f4a7c15ull;
+	std::vector<uint16_t> vram( 32 * 1024 );
+	for ( uint16_t& word : vram )
+	{
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		word = static_cast<uint16_t>( random );
+	}
+
+	// A line of track about halfway down the screen, rotated a little.
+	std::vector<std::pair<std::string, Mode7Fetch::Kernel>> mode7 = { { "scalar", Mode7Fetch::FetchScalar } };
+#ifdef SMK_X86_64
+	if ( features.sse41 )
+	{
+		mode7.emplace_back( "sse4.1", Mode7Fetch::FetchSSE41 );
+	}
+	if ( features.avx2 )
+	{
+		mode7.emplace_back( "avx2", Mode7Fetch::FetchAVX2 );
+	}
+#endif // SMK_X86_64
+	uint8_t palettes[ 256 ];
+	for ( const auto& [ name, kernel ] : mode7 )
+	{
+		const double nanoseconds = NanosecondsPerCall( calls, [ &, kernel = kernel ]( const uint32_t i )
+		{
+			const Mode7Fetch::Params params = { 0x18000 + static_cast<int32_t>( i & 255 ) * 64, 0x40000, 0x00f0, 0x0040, false, 0 };
+			kernel( vram.data(), params, palettes );
+		} );
+		std::cout << "mode 7 line      " << name << ": " << nanoseconds << " ns" << std::endl;
+	}
+
+	// The same line as one row of 4x hd mode 7, drawn above and below.
+	std::vector<std::pair<std::string, Mode7HD::Kernel>> mode7HD = { { "scalar", Mode7HD::DrawRowScalar } };
+#ifdef SMK_X86_64
+	if ( features.avx2 )
+	{
+		mode7HD.emplace_back( "avx2", Mode7HD::DrawRowAVX2 );
+	}
+#endif // SMK_X86_64
+	uint8_t enable[ 1024 ];
+	float subpixelX[ 1024 ];
+	for ( uint32_t x = 0; x < 1024; x++ )
+	{
+		enable[ x ] = 3;
+		subpixelX[ x ] = x / 4.0f - 0.5f;
+	}
+	std::vector<Compositor::Pixel> hdAbove( 1024 );
+	std::vector<Compositor::Pixel> hdBelow( 1024 );
+	for ( const auto& [ name, kernel ] : mode7HD )
+	{
+		const double nanoseconds = NanosecondsPerCall( calls, [ &, kernel = kernel ]( const uint32_t i )
+		{
+			const Mode7HD::Params params = { static_cast<float>( 0x18000 + ( i & 255 ) * 64 ), 0x40000, 240.0f, 64.0f, 0, false, 0, { 2, 2 } };
+			kernel( vram.data(), vram.data(), params, enable, subpixelX, 1024, hdAbove.data(), hdBelow.data() );
+		} );
+		std::cout << "hd mode 7 row    " << name << ": " << nanoseconds << " ns" << std::endl;
+	}
+
+	// 32 4bpp tiles, a tile of 8 rows per call like TileCache::update.
+	std::vector<std::pair<std::string, TileDecode::Kernel>> tiles = { { "scalar", TileDecode::DecodeScalar } };
+#ifdef SMK_X86_64
+	tiles.emplace_back( "sse2", TileDecode::DecodeSSE2 );
+	if ( features.bmi2 )
+	{
+		tiles.emplace_back( "bmi2", TileDecode::DecodeBMI2 );
+	}
+	if ( features.avx2 )
+	{
+		tiles.emplace_back( "avx2", TileDecode::DecodeAVX2 );
+	}
+#endif // SMK_X86_64
+	uint64_t rows[ 32 * 8 ];
+	const uint8_t noFlip[ 8 ] = {};
+	uint8_t colors[ 32 * 64 ];
+	for ( uint32_t n = 0; n < 32 * 8; n++ )
+	{
+		rows[ n ] = vram[ n / 8 * 16 + n % 8 ] | static_cast<uint64_t>( vram[ n / 8 * 16 + n % 8 + 8 ] ) << 16;
+	}
+	for ( const auto& [ name, kernel ] : tiles )
+	{
+		const double nanoseconds = NanosecondsPerCall( calls, [ &, kernel = kernel ]( const uint32_t i )
+		{
+			for ( uint32_t tile = 0; tile < 32; tile++ )
+			{
+				kernel( rows + tile * 8, noFlip, 8, colors + tile * 64 );
+			}
+			rows[ 0 ] ^= colors[ i & 2047 ] & 1;
+		} );
+		std::cout << "32 tiles decoded " << name << ": " << nanoseconds << " ns" << std::endl;
+	}
+
+	// One line with a background above the backdrop, color math halving it with the below screen inside the windows.
+	std::vector<std::pair<std::string, Compositor::Kernel>> compositors = { { "scalar", Compositor::ComposeScalar } };
+#ifdef SMK_X86_64
+	if ( features.sse41 )
+	{
+		compositors.emplace_back( "sse4.1", Compositor::ComposeSSE41 );
+	}
+	if ( features.avx2 )
+	{
+		compositors.emplace_back( "avx2", Compositor::ComposeAVX2 );
+	}
+#endif // SMK_X86_64
+	Compositor::Pixel above[ 256 ];
+	Compositor::Pixel below[ 256 ];
+	for ( uint32_t x = 0; x < 256; x++ )
+	{
+		above[ x ] = { static_cast<uint8_t>( x & 1 ), 0, static_cast<uint16_t>( vram[ x ] & 0x7fff ) };
+		below[ x ] = { static_cast<uint8_t>( x & 2 ? 1 : Compositor::SourceCOL ), 0, static_cast<uint16_t>( vram[ 256 + x ] & 0x7fff ) };
+	}
+	const uint64_t windowAbove[ 4 ] = { ~0ull, ~0ull, ~0ull, ~0ull };
+	const uint64_t windowBelow[ 4 ] = { 0ull, ~0ull, ~0ull, 0ull };
+	std::vector<uint16_t> luma( 32768 + 1 );
+	for ( uint32_t color = 0; color < 32768; color++ )
+	{
+		luma[ color ] = static_cast<uint16_t>( color >> 1 & 0x3def );
+	}
+	const Compositor::Params params = { 0x3f, true, false, true, 0, luma.data() };
+	uint16_t output[ 256 ];
+	for ( const auto& [ name, kernel ] : compositors )
+	{
+		const double nanoseconds = NanosecondsPerCall( calls, [ &, kernel = kernel ]( const uint32_t i )
+		{
+			kernel( above, below, windowAbove, windowBelow, 256, params, output );
+			above[ 0 ].color = output[ i & 255 ] & 0x7fff;
+		} );
+		std::cout << "compositor line  " << name << ": " << nanoseconds << " ns" << std::endl;
+	}
+	return EXIT_SUCCESS;
+}
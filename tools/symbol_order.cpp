@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Turns the smk_call_counts.txt written by a --profile-calls build of smk into a linker symbol ordering file.
+// Functions called at least once per frame on average come first, hottest first, so the per frame working set is
+// packed together. The ones that only ran briefly (boot, menus, attract mode) follow and functions that never ran are
+// pushed to the very end.
+int main( int argc, char** argv )
+{
+	if ( argc < 3 )
+	{
+		std::cout << "symbol_order: symbol_order callcountspath orderingfilepath" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::ifstream callCounts( argv[1] );
+	std::string framesLabel;
+	uint64_t frames = 0;
+	if ( !( callCounts >> framesLabel >> frames ) || framesLabel != "frames" )
+	{
+		std::cout << "ERROR: " << argv[1] << " is not a call count profile" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<std::pair<uint64_t, std::string>> hotFunctions;
+	std::vector<std::pair<uint64_t, std::string>> coldFunctions;
+	std::vector<std::string> unusedFunctions;
+	uint64_t count = 0;
+	std::string functionName;
+	while ( callCounts >> count >> functionName )
+	{
+		if ( count == 0 )
+		{
+			unusedFunctions.push_back( functionName );
+		}
+		else if ( count >= frames )
+		{
+			hotFunctions.emplace_back( count, functionName );
+		}
+		else
+		{
+			coldFunctions.emplace_back( count, functionName );
+		}
+	}
+
+	const auto byCountDescending = []( const auto& a, const auto& b ) { return a.first > b.first || ( a.first == b.first && a.second < b.second ); };
+	std::sort( hotFunctions.begin(), hotFunctions.end(), byCountDescending );
+	std::sort( coldFunctions.begin(), coldFunctions.end(), byCountDescending );
+
+	std::ofstream orderingFile( argv[2] );
+	for ( const auto& [ _, name ] : hotFunctions )
+	{
+		orderingFile << name << std::endl;
+	}
+	for ( const auto& [ _, name ] : coldFunctions )
+	{
+		orderingFile << name << std::endl;
+	}
+	for ( const auto& name : unusedFunctions )
+	{
+		orderingFile << name << std::endl;
+	}
+
+	std::cout << hotFunctions.size() << " hot, " << coldFunctions.size() << " cold and " << unusedFunctions.size() << " unused functions over " << frames << " frames" << std::endl;
+	return EXIT_SUCCESS;
+}